@@ -72,13 +72,49 @@ typedef uint64_t uint64;
 struct TConfig {
 	// Service Config
 	int LoginPort;
+	int StatusPort;
+	int StatusMaxConnections;
+	int StatusTimeout;
+	int StatusMaxAcceptsPerIteration;
+	char HandoffPath[100];
+	int HandoffDrainTimeout;
+	char IOEngine[16];
+	int Workers;
+	bool WorkerAffinity;
+	bool ReusePortSteering;
+	int ListenBacklog;
+	int DeferAccept;
+	int FastOpen;
+	int MaxAcceptsPerIteration;
+	int MaxRequestsPerIteration;
+	int MaxProcessingTime;
+	int StatsInterval;
 	int ConnectionTimeout;
+	int HeaderTimeout;
+	int PayloadTimeout;
+	int ProcessingTimeout;
+	int WriteTimeout;
+	int MinReadRate;
+	int AdaptiveTimeoutFloor;
+	char TeardownMode[16];
+	int DrainTimeout;
+	bool ResetOnError;
 	int MaxConnections;
+	int LoginReservePercent;
 	int MaxStatusRecords;
 	int MinStatusInterval;
 	char QueryManagerHost[100];
 	int QueryManagerPort;
 	char QueryManagerPassword[30];
+	int QueryManagerConnections;
+	int QueryManagerPipelineDepth;
+	int QueryManagerBatchSize;
+	int QueryManagerConnectTimeout;
+	int QueryManagerQueryTimeout;
+	bool QueryManagerClientDeadline;
+	int QueryManagerBreakerThreshold;
+	int QueryManagerBreakerMaxBackoff;
+	bool QueryManagerBreakerEarlyReject;
 
 	// Service Info
 	char StatusWorld[30];
@@ -124,6 +160,7 @@ int Latin1ToUTF8(char *Dest, int DestCapacity, const char *Src, int SrcLength);
 bool ParseBoolean(bool *Dest, const char *String);
 bool ParseInteger(int *Dest, const char *String);
 bool ParseDuration(int *Dest, const char *String);
+bool ParseDurationMS(int *Dest, const char *String);
 bool ParseSize(int *Dest, const char *String);
 bool ParseString(char *Dest, int DestCapacity, const char *String);
 void ParseMotd(char *Dest, int DestCapacity, const char *String);
@@ -490,6 +527,81 @@ bool RSADecrypt(RSAKey *Key, uint8 *Data, int Size);
 void XTEAEncrypt(const uint32 *Key, uint8 *Data, int Size);
 void XTEADecrypt(const uint32 *Key, uint8 *Data, int Size);
 
+// uring.cc
+//==============================================================================
+struct io_uring_sqe;
+struct io_uring_cqe;
+struct io_uring_buf_ring;
+
+struct TIOUring{
+	int Fd;
+	void *RingPtr;
+	size_t RingSize;
+	io_uring_sqe *SQEs;
+	size_t SQEsSize;
+	uint32 *SQHead;
+	uint32 *SQTail;
+	uint32 SQMask;
+	uint32 SQEntries;
+	uint32 SQLocalTail;
+	uint32 *CQHead;
+	uint32 *CQTail;
+	uint32 CQMask;
+	io_uring_cqe *CQEs;
+};
+
+struct TIOBufferRing{
+	io_uring_buf_ring *Ring;
+	size_t RingSize;
+	uint8 *Memory;
+	int NumBuffers;
+	int BufferSize;
+	int GroupID;
+	uint16 Tail;
+};
+
+bool IOUringInit(TIOUring *Ring, int Entries);
+void IOUringExit(TIOUring *Ring);
+io_uring_sqe *IOUringGetSQE(TIOUring *Ring);
+bool IOUringReserve(TIOUring *Ring, int Count);
+int IOUringSubmit(TIOUring *Ring, int WaitCount, int TimeoutMS);
+io_uring_cqe *IOUringPeekCQE(TIOUring *Ring);
+void IOUringAdvanceCQ(TIOUring *Ring);
+bool IOBufferRingInit(TIOUring *Ring, TIOBufferRing *BufferRing,
+		int GroupID, int NumBuffers, int BufferSize);
+void IOBufferRingExit(TIOBufferRing *BufferRing);
+uint8 *IOBufferRingGet(TIOBufferRing *BufferRing, int BufferID);
+void IOBufferRingRecycle(TIOBufferRing *BufferRing, int BufferID);
+
+// timer.cc
+//==============================================================================
+#define TIMER_LEVELS 4
+#define TIMER_SLOTS 64
+
+struct TTimer{
+	TTimer *Prev;
+	TTimer *Next;
+	int64 Deadline;
+	void (*Callback)(TTimer *Timer);
+	void *Data;
+	uint8 Level;
+	uint8 Slot;
+	bool Active;
+};
+
+struct TTimerWheel{
+	int64 Time;
+	int Count;
+	uint64 Occupied[TIMER_LEVELS];
+	TTimer *Slots[TIMER_LEVELS][TIMER_SLOTS];
+};
+
+void TimerWheelInit(TTimerWheel *Wheel, int64 Time);
+void TimerStart(TTimerWheel *Wheel, TTimer *Timer, int64 Deadline);
+void TimerStop(TTimerWheel *Wheel, TTimer *Timer);
+void TimerWheelAdvance(TTimerWheel *Wheel, int64 Time);
+int TimerWheelNextTimeout(TTimerWheel *Wheel, int64 Time);
+
 // query.cc
 //==============================================================================
 enum {
@@ -502,16 +614,21 @@ enum {
 	QUERY_STATUS_OK			= 0,
 	QUERY_STATUS_ERROR		= 1,
 	QUERY_STATUS_FAILED		= 3,
+
+	// NOTE(fusion): This one never comes from the query manager. It is given to
+	// queries that weren't answered before their deadline.
+	QUERY_STATUS_TIMEOUT	= -1,
 };
 
 enum {
 	QUERY_LOGIN				= 0,
 	QUERY_LOGIN_ACCOUNT		= 11,
 	QUERY_GET_WORLDS		= 150,
-};
 
-struct TQueryManagerConnection{
-	int Socket;
+	// NOTE(fusion): This one is not part of the original protocol. Query managers
+	// that support it answer an empty batch with `QUERY_STATUS_OK`, which is how
+	// it's negotiated after logging in.
+	QUERY_LOGIN_ACCOUNT_BATCH	= 240,
 };
 
 struct TCharacterLoginData{
@@ -532,22 +649,180 @@ struct TWorld {
 	int LastShutdown;
 };
 
+// NOTE(fusion): Queries are owned by whoever submits them and only hold their
+// parameters, which are serialized when the query is actually sent. The
+// callback is called once, with the response positioned right after its status
+// byte, or with NULL if the query failed, unless the query is cancelled first.
+// Queries that aren't answered by their deadline fail with `QUERY_STATUS_TIMEOUT`.
+struct TQuery;
+typedef void TQueryCallback(TQuery *Query, int Status, TReadBuffer *Response);
+
+struct TQuery{
+	TQuery *Prev;
+	TQuery *Next;
+	bool Pending;
+	int Type;
+	int64 SubmitTime;
+	int64 Deadline;
+	TQueryCallback *Callback;
+	void *Data;
+
+	// NOTE(fusion): Request parameters.
+	int AccountID;
+	char Password[30];
+	char IPAddress[16];
+};
+
+struct TQueryManagerPool;
+
+// NOTE(fusion): A request carries a single query, or a batch of logins with
+// one result per query. `WriteEnd` is the position of the end of the request
+// in the connection's output stream, which tells whether it was fully written.
+// A request that isn't answered by its `Deadline` means the query manager is
+// stuck, or the stream is out of sync, and the connection is dropped.
+#define QUERY_MAX_BATCH_SIZE 16
+struct TQueryInFlight{
+	bool Batch;
+	int NumQueries;
+	TQuery *Queries[QUERY_MAX_BATCH_SIZE];
+	int64 WriteEnd;
+	int64 Deadline;
+};
+
+// NOTE(fusion): Reconnects go through the whole handshake without blocking,
+// and only connections that reach `QUERY_MANAGER_READY` take queries.
+enum QueryManagerState {
+	QUERY_MANAGER_DISCONNECTED	= 0,
+	QUERY_MANAGER_CONNECTING	= 1,
+	QUERY_MANAGER_LOGGING_IN	= 2,
+	QUERY_MANAGER_PROBING		= 3,
+	QUERY_MANAGER_READY			= 4,
+};
+
+#define QUERY_MAX_PIPELINE_DEPTH 16
+#define QUERY_READ_BUFFER_SIZE KB(64)
+#define QUERY_WRITE_BUFFER_SIZE KB(16)
+struct TQueryManagerConnection{
+	TQueryManagerPool *Pool;
+	int Socket;
+	int State;
+	int Generation;
+	int64 RetryTime;
+	int64 ConnectDeadline;
+	bool Reconnecting;
+	bool BatchLogins;
+
+	// NOTE(fusion): Requests waiting for their responses, in the order they were
+	// sent, which is also the order responses come back. A cancelled query that
+	// was already sent leaves a NULL entry, since its response still needs to
+	// be consumed.
+	TQueryInFlight InFlight[QUERY_MAX_PIPELINE_DEPTH];
+	int InFlightHead;
+	int NumInFlight;
+	int64 BusySince;
+
+	int64 WriteOffset;
+	int WriteSize;
+	int WritePosition;
+	int ReadPosition;
+	uint8 WriteBuffer[QUERY_WRITE_BUFFER_SIZE];
+	uint8 ReadBuffer[QUERY_READ_BUFFER_SIZE];
+
+	// NOTE(fusion): The io_uring engine polls the socket for readiness, with at
+	// most one poll in flight, which may outlive the socket it was armed for.
+	bool RingPollArmed;
+	bool RingPollCancelled;
+	int RingPollEvents;
+	int RingPollGeneration;
+};
+
+// NOTE(fusion): Queries wait in the pool until a connection has room in its
+// pipeline. Stats are accumulated between calls to `ResetQueryManagerStats`.
+struct TQueryManagerStats{
+	int64 StartTime;
+	int64 Sent;
+	int64 WaitTime;
+	int64 MaxWaitTime;
+	int64 BusyTime;
+	int64 Replayed;
+	int64 Batches;
+	int64 Batched;
+	int64 LoginTimeouts;
+	int64 GetWorldsTimeouts;
+	int64 StalledStreams;
+	int64 BreakerOpened;
+	int64 BreakerRejected;
+	int64 BreakerEarlyRejected;
+};
+
+// NOTE(fusion): The circuit breaker is driven by the event loop, which opens it
+// after too many connection failures in a row. `ConsecutiveFailures` is also
+// bumped by stalled connections, and reset by any response.
+enum QueryManagerBreakerState {
+	QUERY_BREAKER_CLOSED	= 0,
+	QUERY_BREAKER_OPEN		= 1,
+	QUERY_BREAKER_HALF_OPEN	= 2,
+};
+
+struct TQueryManagerPool{
+	TQueryManagerConnection *Connections;
+	int NumConnections;
+	TQuery *PendingHead;
+	TQuery *PendingTail;
+	int NumPending;
+	bool SkipBatchProbe;
+	int64 NextDeadline;
+	int ConsecutiveFailures;
+	int BreakerState;
+	int BreakerBackoff;
+	int64 BreakerProbeTime;
+	uint32 RandomSeed;
+	TQueryManagerStats Stats;
+};
+
+bool InitQueryManagerResolver(void);
+void ExitQueryManagerResolver(void);
+void RefreshQueryManagerAddress(void);
 bool Connect(TQueryManagerConnection *Connection);
+bool StartConnect(TQueryManagerConnection *Connection, int64 Deadline);
 void Disconnect(TQueryManagerConnection *Connection);
 bool IsConnected(TQueryManagerConnection *Connection);
+bool IsConnecting(TQueryManagerConnection *Connection);
 TWriteBuffer PrepareQuery(int QueryType, uint8 *Buffer, int BufferSize);
-int ExecuteQuery(TQueryManagerConnection *Connection, bool AutoReconnect,
-		TWriteBuffer *WriteBuffer, TReadBuffer *OutReadBuffer);
-int LoginAccount(int AccountID, const char *Password, const char *IPAddress,
+int ExecuteQuery(TQueryManagerConnection *Connection,
+		int64 Deadline, TWriteBuffer *WriteBuffer, TReadBuffer *OutReadBuffer);
+bool InitQueryManagerPool(TQueryManagerPool *Pool, int NumConnections);
+void ExitQueryManagerPool(TQueryManagerPool *Pool);
+int NumConnectedQueryManagers(TQueryManagerPool *Pool);
+int NumConnectingQueryManagers(TQueryManagerPool *Pool);
+int NumBusyQueryManagers(TQueryManagerPool *Pool);
+int NumInFlightQueries(TQueryManagerPool *Pool);
+void UpdateQueryManagerStats(TQueryManagerPool *Pool);
+void ResetQueryManagerStats(TQueryManagerPool *Pool);
+void SubmitQuery(TQueryManagerPool *Pool, TQuery *Query, int64 Deadline);
+void ExpireQueries(TQueryManagerPool *Pool, int64 Now);
+void SendQueries(TQueryManagerPool *Pool);
+void CancelQuery(TQueryManagerPool *Pool, TQuery *Query);
+void FailPendingQueries(TQueryManagerPool *Pool);
+bool HasPendingQueries(TQueryManagerPool *Pool);
+bool QueryManagerWantsWrite(TQueryManagerConnection *Connection);
+void ProcessQueryManager(TQueryManagerConnection *Connection, int Events);
+void PrepareLoginAccount(TQuery *Query, int AccountID,
+		const char *Password, const char *IPAddress);
+int LoginAccountResult(int Status, TReadBuffer *Response,
 		int MaxCharacters, int *NumCharacters, TCharacterLoginData *Characters,
 		int *PremiumDays);
-int GetWorld(const char *WorldName, TWorld *OutWorld);
-bool InitQuery(void);
-void ExitQuery(void);
+void PrepareGetWorlds(TQuery *Query);
+int GetWorldResult(int Status, TReadBuffer *Response,
+		const char *WorldName, TWorld *OutWorld);
 
 // status.cc
 //==============================================================================
-const char *GetStatusString(void);
+void InitStatus(void);
+bool BeginStatusRefresh(void);
+void AbortStatusRefresh(void);
+void FinishStatusRefresh(const TWorld *World);
+int GetStatusString(char *Dest, int DestCapacity);
 
 // connections.cc
 //==============================================================================
@@ -556,26 +831,87 @@ enum ConnectionState {
 	CONNECTION_READING		= 1,
 	CONNECTION_PROCESSING	= 2,
 	CONNECTION_WRITING		= 3,
+	CONNECTION_DRAINING		= 4,
+	CONNECTION_RELEASING	= 5,
+	CONNECTION_QUERYING		= 6,
+};
+
+enum ConnectionPhase {
+	CONNECTION_PHASE_NONE		= 0,
+	CONNECTION_PHASE_HEADER		= 1,
+	CONNECTION_PHASE_PAYLOAD	= 2,
+	CONNECTION_PHASE_PROCESSING	= 3,
+	CONNECTION_PHASE_WRITING	= 4,
+	CONNECTION_PHASE_DRAINING	= 5,
+};
+
+enum ConnectionClass {
+	CONNECTION_CLASS_UNKNOWN	= 0,
+	CONNECTION_CLASS_LOGIN		= 1,
+	CONNECTION_CLASS_STATUS		= 2,
+	NUM_CONNECTION_CLASSES		= 3,
+};
+
+struct TWorker;
+struct TConnection;
+struct TConnectionChunk;
+
+// NOTE(fusion): Connections are split into hot and cold data. The hot part is
+// what the event loop touches for every event and scan, and is kept within a
+// single cache line, while the cold part, which is only touched when actually
+// reading, writing, processing requests, or (re)scheduling timers, lives in a
+// parallel array.
+//  Everything up to `Chunk` in the cold part is cleared when the connection
+// is released, the rest is owned by the slot itself.
+//  The inline buffer is large enough for any valid request. Responses that
+// don't fit in it will borrow a larger buffer from the worker's buffer pool,
+// in which case `Buffer` will point to that instead.
+#define CONNECTION_INLINE_BUFFER_SIZE 160
+struct TConnectionData {
+	TTimer Timer;
+	TConnection *RunPrev;
+	TConnection *RunNext;
+	bool Scheduled;
+	bool PeerClosed;
+	int IPAddress;
+	uint32 RandomSeed;
+	uint32 XTEA[4];
+	char RemoteAddress[32];
+	TQuery Query;
+	TConnectionChunk *Chunk;
+	TConnection *NextFree;
+	uint8 *Buffer;
+	int BufferSize;
+	uint8 InlineBuffer[CONNECTION_INLINE_BUFFER_SIZE];
 };
 
 struct TConnection {
 	ConnectionState State;
+	ConnectionClass SlotClass;
+	ConnectionPhase Phase;
 	int Socket;
-	int IPAddress;
-	int StartTime;
 	int RWSize;
 	int RWPosition;
-	uint32 RandomSeed;
-	uint32 XTEA[4];
-	char RemoteAddress[32];
-	uint8 Buffer[KB(2)];
+	int RingSocket;
+	int RingOps;
+	int64 StartTime;
+	int64 PhaseStartTime;
+	TWorker *Worker;
+	TConnectionData *Data;
 };
 
+STATIC_ASSERT(sizeof(TConnection) <= 64);
+
 struct TStatusRecord {
 	int IPAddress;
 	int Timestamp;
 };
 
+void WakeConnections(void);
+bool ConnectionsHandedOff(void);
+void DrainConnections(void);
+bool ConnectionsDrained(void);
+bool ReloadConnections(const TConfig *Config);
 void ProcessConnections(void);
 bool InitConnections(void);
 void ExitConnections(void);
@@ -1,10 +1,21 @@
 #include "common.hh"
 
 #include <errno.h>
-#include <fcntl.h>
+#include <inttypes.h>
+#include <linux/filter.h>
+#include <linux/io_uring.h>
 #include <netinet/in.h>
+#include <netinet/tcp.h>
 #include <poll.h>
+#include <pthread.h>
+#include <sched.h>
+#include <signal.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/mman.h>
 #include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
 #include <unistd.h>
 
 #if TIBIA772
@@ -13,19 +24,180 @@ static const int TERMINALVERSION[] = {772, 772, 772};
 static const int TERMINALVERSION[] = {770, 770, 770};
 #endif
 
-static RSAKey *g_PrivateKey;
+// NOTE(fusion): Each worker runs its own event loop, on its own thread, with
+// its own listener and slice of the connection table. Listeners are bound with
+// `SO_REUSEPORT` so the kernel distributes incoming connections between them,
+// meaning workers never have to share anything other than read-only data, the
+// status records, and the status string.
+//  The first worker runs on the main thread, through `ProcessConnections`.
+//
+// NOTE(fusion): Connection slots are allocated in fixed size chunks that are
+// never moved, so connection pointers remain stable as the table grows. Each
+// chunk has its own free list and chunks with free slots are kept in a list,
+// making both assignment and release O(1). Chunks are mapped directly so they
+// can be given back to the system once empty, except for a single spare chunk
+// to avoid thrashing around chunk boundaries.
+//  Empty chunks are only unmapped at the end of the loop iteration, because
+// whoever released the last connection may still check its state afterwards.
+//  Mappings are page aligned, so aligning the hot array to a cache line puts
+// each connection's hot part in exactly one line.
+static const int CONNECTION_CHUNK_SIZE = 64;
+
+struct TConnectionChunk{
+	int Index;
+	int NumUsed;
+	bool PendingFree;
+	TConnectionChunk *NextEmpty;
+	TConnectionChunk *PrevAvailable;
+	TConnectionChunk *NextAvailable;
+	TConnection *FreeList;
+	alignas(64) TConnection Connections[CONNECTION_CHUNK_SIZE];
+	TConnectionData Data[CONNECTION_CHUNK_SIZE];
+};
+
+// NOTE(fusion): Larger buffers are borrowed from a per-worker pool, with a few
+// size classes, and returned when the connection is released. Each class keeps
+// a limited number of free buffers around, with the free list stored in the
+// buffers themselves.
+static const int BUFFER_CLASS_SIZES[] = { 512, KB(2), KB(8) };
+static const int BUFFER_CLASS_MAX_CACHED = 64;
+
+struct TPoolBuffer{
+	TPoolBuffer *Next;
+};
+
+struct TBufferPool{
+	TPoolBuffer *FreeList[NARRAY(BUFFER_CLASS_SIZES)];
+	int NumCached[NARRAY(BUFFER_CLASS_SIZES)];
+};
+
+struct TWorkerStats{
+	int64 Accepted;
+	int64 Rejected;
+	int64 Paused;
+	int64 Deferred;
+	int64 TimedOut;
+	int64 ShedStatus;
+	int64 ActiveClose;
+	int64 PassiveClose;
+	int64 Reset;
+	int64 DrainTimedOut;
+	int64 Yielded;
+};
+
+struct TWorker{
+	int WorkerID;
+	pthread_t Thread;
+	bool ThreadStarted;
+	int Epoll;
+	TIOUring Ring;
+	TIOBufferRing RingBuffers;
+	int Listener;
+
+	// NOTE(fusion): When `StatusPort` is set, status requests also get their
+	// own worker, with its own listener, connection table, timeout, and accept
+	// budget, so a crawler flood there can't affect login latency.
+	bool StatusOnly;
+	int ConnectionTimeout;
+	int MaxAcceptsPerIteration;
+
+	TConnectionChunk **Chunks;
+	int MaxChunks;
+	int NumConnections;
+	int MaxConnections;
+	TConnectionChunk *AvailableHead;
+	TConnectionChunk *AvailableTail;
+	TConnectionChunk *SpareChunk;
+	TConnectionChunk *EmptyChunks;
+	TBufferPool BufferPool;
+
+	// NOTE(fusion): Connections are classified as soon as we know their first
+	// payload byte. Status requests can't take slots above `StatusLimit`, which
+	// are reserved for logins, and are shed instead.
+	int NumByClass[NUM_CONNECTION_CLASSES];
+	int StatusLimit;
+
+	// NOTE(fusion): Connection deadlines are kept in a timer wheel, which also
+	// determines how long we can block waiting for events. `LoopTime` is taken
+	// once per iteration, right after waking up, and used for everything that
+	// needs the current time in that iteration.
+	int64 LoopTime;
+	TTimerWheel Timers;
+
+	// NOTE(fusion): Idle workers may block indefinitely, so we need some way to
+	// wake them up, when stopping.
+	int WakeFd;
+	uint64 WakeValue;
+
+	// NOTE(fusion): We stop accepting connections while the table is full,
+	// leaving them in the listen backlog instead of accepting and closing them
+	// right away. The number of accepts per iteration is also bounded, so a
+	// flood of new connections can't starve the ones we already have. Accepts
+	// that were left for the next iteration are flagged as pending.
+	bool Accepting;
+	bool AcceptPending;
+	int AcceptBudget;
+	int AcceptsInFlight;
+
+	// NOTE(fusion): Complete requests aren't processed right away but queued,
+	// and each iteration only runs a bounded batch of them, by count and time,
+	// leaving the rest for the next one. Logins are expensive, with an RSA
+	// decrypt and a query manager round trip each, so a burst of them would
+	// otherwise stall accepts and writes for everyone else.
+	TConnection *RunQueueHead;
+	TConnection *RunQueueTail;
+	int RunQueueLength;
+
+	TQueryManagerPool QueryManagers;
+	TTimer QueryManagerTimer;
+
+	// NOTE(fusion): After a listener handoff, workers stop accepting for good
+	// and flag themselves as drained once their last connection is released.
+	bool Draining;
+	bool Drained;
+
+	// NOTE(fusion): Settings derived from the config are re-applied by each
+	// worker, at the start of an iteration, when the config generation changes.
+	int ConfigGeneration;
+
+	TTimer StatsTimer;
+	TWorkerStats Stats;
+};
 
-static int g_Listener = -1;
-static TConnection *g_Connections;
-static int g_MaxConnections;
+static RSAKey *g_PrivateKey;
 
+static bool g_UseIOUring;
+static int g_TeardownMode;
+static TWorker *g_Workers;
+static int g_NumWorkers;
+static int g_NumLoginWorkers;
+static int g_StopWorkers;
+static int g_DrainWorkers;
+
+// NOTE(fusion): Workers hold the config lock for reading during the whole
+// iteration, except while waiting for events, which is when a reload can take
+// it for writing. It prefers writers so busy workers can't hold it forever.
+static pthread_rwlock_t g_ConfigLock;
+static bool g_ConfigLockInit;
+static int g_ConfigGeneration;
+static int g_MainWakeFd = -1;
+
+static int g_HandoffSocket = -1;
+static int g_HandoffPeer = -1;
+static pthread_t g_HandoffThread;
+static bool g_HandoffThreadStarted;
+static int g_HandedOff;
+static TTimer g_DrainTimer;
+static bool g_DrainTimedOut;
+
+static pthread_mutex_t g_StatusRecordsMutex = PTHREAD_MUTEX_INITIALIZER;
 static TStatusRecord *g_StatusRecords;
 static int g_MaxStatusRecords;
 
 // Connection Handling
 //==============================================================================
-static int ListenerBind(uint16 Port){
-	int Socket = socket(AF_INET, SOCK_STREAM, 0);
+static int ListenerBind(uint16 Port, bool ReusePort){
+	int Socket = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
 	if(Socket == -1){
 		LOG_ERR("Failed to create listener socket: (%d) %s", errno, strerrordesc_np(errno));
 		return -1;
@@ -38,17 +210,34 @@ static int ListenerBind(uint16 Port){
 		return -1;
 	}
 
-	int Flags = fcntl(Socket, F_GETFL);
-	if(Flags == -1){
-		LOG_ERR("Failed to get socket flags: (%d) %s", errno, strerrordesc_np(errno));
-		close(Socket);
-		return -1;
+	if(ReusePort){
+		int Enable = 1;
+		if(setsockopt(Socket, SOL_SOCKET, SO_REUSEPORT, &Enable, sizeof(Enable)) == -1){
+			LOG_ERR("Failed to set SO_REUSEPORT: (%d) %s", errno, strerrordesc_np(errno));
+			close(Socket);
+			return -1;
+		}
 	}
 
-	if(fcntl(Socket, F_SETFL, Flags | O_NONBLOCK) == -1){
-		LOG_ERR("Failed to set socket flags: (%d) %s", errno, strerrordesc_np(errno));
-		close(Socket);
-		return -1;
+	// NOTE(fusion): Only wake up for connections that have already sent data,
+	// so port scanners and idle clients don't take up connection slots. Every
+	// valid request fits in the first segment anyways.
+	if(g_Config.DeferAccept > 0){
+		int DeferAccept = g_Config.DeferAccept;
+		if(setsockopt(Socket, IPPROTO_TCP, TCP_DEFER_ACCEPT, &DeferAccept, sizeof(DeferAccept)) == -1){
+			LOG_ERR("Failed to set TCP_DEFER_ACCEPT: (%d) %s", errno, strerrordesc_np(errno));
+			close(Socket);
+			return -1;
+		}
+	}
+
+	if(g_Config.FastOpen > 0){
+		int FastOpen = g_Config.FastOpen;
+		if(setsockopt(Socket, IPPROTO_TCP, TCP_FASTOPEN, &FastOpen, sizeof(FastOpen)) == -1){
+			LOG_ERR("Failed to set TCP_FASTOPEN: (%d) %s", errno, strerrordesc_np(errno));
+			close(Socket);
+			return -1;
+		}
 	}
 
 	sockaddr_in Addr = {};
@@ -61,7 +250,7 @@ static int ListenerBind(uint16 Port){
 		return -1;
 	}
 
-	if(listen(Socket, 128) == -1){
+	if(listen(Socket, g_Config.ListenBacklog) == -1){
 		LOG_ERR("Failed to listen to port %d: (%d) %s", Port, errno, strerrordesc_np(errno));
 		close(Socket);
 		return -1;
@@ -70,107 +259,836 @@ static int ListenerBind(uint16 Port){
 	return Socket;
 }
 
+static bool ListenerAttachSteering(int Listener, int NumListeners){
+	// NOTE(fusion): Select the listener from the reuseport group based on the
+	// CPU that is handling the incoming connection. Listeners are indexed in
+	// the order they were bound, which is the same as the worker order, so
+	// with workers pinned to their CPUs, connections stay on the same core.
+	sock_filter Code[] = {
+		{ BPF_LD  | BPF_W   | BPF_ABS, 0, 0, (uint32)(SKF_AD_OFF + SKF_AD_CPU) },
+		{ BPF_ALU | BPF_MOD | BPF_K,   0, 0, (uint32)NumListeners },
+		{ BPF_RET | BPF_A,             0, 0, 0 },
+	};
+
+	sock_fprog Program = {};
+	Program.len = (unsigned short)NARRAY(Code);
+	Program.filter = Code;
+	if(setsockopt(Listener, SOL_SOCKET, SO_ATTACH_REUSEPORT_CBPF, &Program, sizeof(Program)) == -1){
+		LOG_ERR("Failed to attach reuseport program: (%d) %s", errno, strerrordesc_np(errno));
+		return false;
+	}
+
+	return true;
+}
+
 static int ListenerAccept(int Listener, uint32 *OutAddr, uint16 *OutPort){
-	while(true){
-		sockaddr_in SocketAddr = {};
-		socklen_t SocketAddrLen = sizeof(SocketAddr);
-		int Socket = accept(Listener, (sockaddr*)&SocketAddr, &SocketAddrLen);
-		if(Socket == -1){
-			if(errno != EAGAIN){
-				LOG_ERR("Failed to accept connection: (%d) %s", errno, strerrordesc_np(errno));
+	sockaddr_in SocketAddr = {};
+	socklen_t SocketAddrLen = sizeof(SocketAddr);
+	int Socket = accept4(Listener, (sockaddr*)&SocketAddr, &SocketAddrLen,
+			SOCK_NONBLOCK | SOCK_CLOEXEC);
+	if(Socket == -1){
+		if(errno != EAGAIN){
+			LOG_ERR("Failed to accept connection: (%d) %s", errno, strerrordesc_np(errno));
+		}
+		return -1;
+	}
+
+	if(OutAddr){
+		*OutAddr = ntohl(SocketAddr.sin_addr.s_addr);
+	}
+
+	if(OutPort){
+		*OutPort = ntohs(SocketAddr.sin_port);
+	}
+
+	return Socket;
+}
+
+static void CloseConnection(TConnection *Connection){
+	if(Connection->Socket != -1){
+		if(g_UseIOUring){
+			// NOTE(fusion): In-flight operations hold their own reference to the
+			// socket, so closing the descriptor wouldn't tear it down. Shutting it
+			// down will complete them instead, and the descriptor is closed after
+			// that, when the connection is released.
+			if(Connection->RingSocket != -1){
+				shutdown(Connection->RingSocket, SHUT_RDWR);
 			}
-			return -1;
+		}else{
+			// NOTE(fusion): Sockets are never duplicated so closing them will also
+			// remove them from the epoll interest list, without an extra syscall.
+			close(Connection->Socket);
 		}
+		Connection->Socket = -1;
+	}
+}
 
-		int Flags = fcntl(Socket, F_GETFL);
-		if(Flags == -1){
-			LOG_ERR("Failed to get socket flags: (%d) %s", errno, strerrordesc_np(errno));
-			close(Socket);
+// NOTE(fusion): Whoever sends the first FIN is left with the connection in
+// TIME_WAIT, which is always us with the default `close` mode. With `shutdown`
+// we still send the first FIN but wait for the client's before closing, which
+// makes sure it gets the whole response. With `passive` we only close after
+// the client does, or after the drain timeout, leaving TIME_WAIT on its side.
+//  Error paths may also reset the connection with a zero linger close, which
+// skips TIME_WAIT altogether.
+enum {
+	TEARDOWN_CLOSE		= 0,
+	TEARDOWN_SHUTDOWN	= 1,
+	TEARDOWN_PASSIVE	= 2,
+};
+
+static void AbortConnection(TConnection *Connection){
+	if(Connection->Socket != -1 && g_Config.ResetOnError){
+		linger Linger = {};
+		Linger.l_onoff = 1;
+		Linger.l_linger = 0;
+		if(setsockopt(Connection->Socket, SOL_SOCKET, SO_LINGER, &Linger, sizeof(Linger)) == -1){
+			LOG_ERR("Failed to set socket option SO_LINGER: (%d) %s", errno, strerrordesc_np(errno));
+		}else{
+			Connection->Worker->Stats.Reset += 1;
+		}
+	}
+
+	CloseConnection(Connection);
+}
+
+static void ConnectionPeerClosed(TConnection *Connection){
+	if(g_TeardownMode == TEARDOWN_PASSIVE
+			&& Connection->SlotClass != CONNECTION_CLASS_STATUS){
+		Connection->Worker->Stats.PassiveClose += 1;
+	}
+
+	CloseConnection(Connection);
+}
+
+static void ConnectionDrainReceived(TConnection *Connection, int BytesRead){
+	// NOTE(fusion): Clients have nothing else to send after their request, so
+	// anything received while draining is discarded, up to a buffer's worth.
+	Connection->RWPosition += BytesRead;
+	if(Connection->RWPosition > Connection->Data->BufferSize){
+		AbortConnection(Connection);
+	}
+}
+
+static void ConnectionResetBuffer(TConnection *Connection);
+
+static void ConnectionOutputFinished(TConnection *Connection){
+	TWorker *Worker = Connection->Worker;
+	if(g_TeardownMode == TEARDOWN_CLOSE){
+		Worker->Stats.ActiveClose += 1;
+		CloseConnection(Connection);
+		return;
+	}
+
+	// NOTE(fusion): Status responses aren't framed and clients will read them
+	// until EOF, so we can't wait for them to close first.
+	if(g_TeardownMode == TEARDOWN_SHUTDOWN
+			|| Connection->SlotClass == CONNECTION_CLASS_STATUS){
+		if(shutdown(Connection->Socket, SHUT_WR) == -1){
+			CloseConnection(Connection);
+			return;
+		}
+		Worker->Stats.ActiveClose += 1;
+	}
+
+	ConnectionResetBuffer(Connection);
+	Connection->State = CONNECTION_DRAINING;
+	Connection->RWSize = 0;
+	Connection->RWPosition = 0;
+	if(Connection->Data->PeerClosed){
+		ConnectionPeerClosed(Connection);
+	}
+}
+
+// io_uring Engine
+//==============================================================================
+// NOTE(fusion): The io_uring engine is completion based so instead of polling
+// sockets and then reading/writing, we keep a few accepts in flight on the
+// listener, a multishot receive on each connection, using buffers provided by
+// a buffer ring, and submit responses as a linked write+close chain. Submissions are
+// batched and only flushed when we wait for completions, at the beginning of
+// each iteration.
+//  Connections keep the actual descriptor in `RingSocket` while `Socket` is
+// set to -1 as soon as they're closed, to keep the same semantics as the epoll
+// engine. They can only be released after all operations have completed, which
+// is tracked with `RingOps`.
+enum {
+	URING_OP_ACCEPT		= 1,
+	URING_OP_RECEIVE	= 2,
+	URING_OP_CANCEL		= 3,
+	URING_OP_WRITE		= 4,
+	URING_OP_CLOSE		= 5,
+	URING_OP_WAKE		= 6,
+	URING_OP_QUERY		= 7,
+};
+
+static const int URING_ENTRIES = 1024;
+static const int URING_BUFFER_GROUP = 0;
+static const int URING_BUFFER_COUNT = 1024;
+static const int URING_BUFFER_SIZE = 512;
+
+STATIC_ASSERT(alignof(TConnection) >= 8);
+STATIC_ASSERT(alignof(TQueryManagerConnection) >= 8);
+
+static io_uring_sqe *URingPrepare(TWorker *Worker, TConnection *Connection,
+		int Op, int Opcode, int Fd){
+	io_uring_sqe *SQE = IOUringGetSQE(&Worker->Ring);
+	if(SQE == NULL){
+		LOG_ERR("Failed to get submission entry (Op: %d)", Op);
+		return NULL;
+	}
+
+	SQE->opcode = (uint8)Opcode;
+	SQE->fd = Fd;
+	SQE->user_data = (uint64)(uintptr_t)Connection | (uint64)Op;
+	if(Connection != NULL){
+		Connection->RingOps += 1;
+	}
+	return SQE;
+}
+
+static bool URingSubmitAccept(TWorker *Worker){
+	io_uring_sqe *SQE = URingPrepare(Worker, NULL, URING_OP_ACCEPT,
+			IORING_OP_ACCEPT, Worker->Listener);
+	if(SQE == NULL){
+		return false;
+	}
+
+	SQE->accept_flags = SOCK_NONBLOCK | SOCK_CLOEXEC;
+	Worker->AcceptsInFlight += 1;
+	return true;
+}
+
+static void URingUpdateAccept(TWorker *Worker){
+	// NOTE(fusion): A multishot accept would keep draining the listen backlog
+	// regardless of how many slots we have left. Instead, we keep one accept in
+	// flight for each connection we're willing to take, bounded by free slots
+	// and by what's left of this iteration's accept budget.
+	if(Worker->Draining){
+		return;
+	}
+
+	int FreeSlots = Worker->MaxConnections - Worker->NumConnections;
+	int Wanted = (FreeSlots < Worker->AcceptBudget ? FreeSlots : Worker->AcceptBudget);
+	while(Worker->AcceptsInFlight < Wanted){
+		if(!URingSubmitAccept(Worker)){
+			break;
+		}
+	}
+}
+
+static void PauseAccepting(TWorker *Worker){
+	if(Worker->Accepting){
+		Worker->Accepting = false;
+		Worker->Stats.Paused += 1;
+	}
+}
+
+static void ResumeAccepting(TWorker *Worker){
+	if(!Worker->Accepting && !Worker->Draining){
+		Worker->Accepting = true;
+		Worker->AcceptPending = true;
+		if(g_UseIOUring){
+			URingUpdateAccept(Worker);
+		}
+	}
+}
+
+static void URingSubmitWake(TWorker *Worker){
+	io_uring_sqe *SQE = URingPrepare(Worker, NULL, URING_OP_WAKE,
+			IORING_OP_READ, Worker->WakeFd);
+	if(SQE != NULL){
+		SQE->addr = (uint64)(uintptr_t)&Worker->WakeValue;
+		SQE->len = sizeof(Worker->WakeValue);
+	}
+}
+
+static void URingSubmitReceive(TConnection *Connection){
+	TWorker *Worker = Connection->Worker;
+	io_uring_sqe *SQE = URingPrepare(Worker, Connection, URING_OP_RECEIVE,
+			IORING_OP_RECV, Connection->RingSocket);
+	if(SQE == NULL){
+		CloseConnection(Connection);
+		return;
+	}
+
+	SQE->ioprio = IORING_RECV_MULTISHOT;
+	SQE->flags = IOSQE_BUFFER_SELECT;
+	SQE->buf_group = (uint16)Worker->RingBuffers.GroupID;
+}
+
+static bool URingWantsReceive(TConnection *Connection){
+	// NOTE(fusion): Unless responses are chained with a close, the receive is
+	// kept while writing, to catch the client's FIN when draining.
+	if(Connection->Socket == -1){
+		return false;
+	}else if(Connection->State == CONNECTION_READING || Connection->State == CONNECTION_DRAINING){
+		return true;
+	}else if(Connection->State == CONNECTION_WRITING){
+		return g_TeardownMode != TEARDOWN_CLOSE && !Connection->Data->PeerClosed;
+	}else{
+		return false;
+	}
+}
+
+static void URingSubmitOutput(TConnection *Connection, bool CancelReceive){
+	TWorker *Worker = Connection->Worker;
+	bool LinkClose = (g_TeardownMode == TEARDOWN_CLOSE);
+	if(!IOUringReserve(&Worker->Ring, 3)){
+		LOG_ERR("Failed to reserve submission entries");
+		CloseConnection(Connection);
+		return;
+	}
+
+	// NOTE(fusion): The multishot receive holds a reference to the socket and
+	// would prevent the linked close from actually closing it. The cancel is
+	// hard linked so the write is issued regardless of it finding the receive.
+	io_uring_sqe *SQE;
+	if(CancelReceive && LinkClose){
+		SQE = URingPrepare(Worker, Connection, URING_OP_CANCEL,
+				IORING_OP_ASYNC_CANCEL, Connection->RingSocket);
+		SQE->cancel_flags = IORING_ASYNC_CANCEL_FD | IORING_ASYNC_CANCEL_ALL;
+		SQE->flags = IOSQE_IO_HARDLINK;
+	}
+
+	SQE = URingPrepare(Worker, Connection, URING_OP_WRITE,
+			IORING_OP_SEND, Connection->RingSocket);
+	SQE->addr = (uint64)(uintptr_t)(Connection->Data->Buffer + Connection->RWPosition);
+	SQE->len = (uint32)(Connection->RWSize - Connection->RWPosition);
+	SQE->msg_flags = MSG_NOSIGNAL;
+	if(LinkClose){
+		SQE->flags = IOSQE_IO_LINK;
+		URingPrepare(Worker, Connection, URING_OP_CLOSE,
+				IORING_OP_CLOSE, Connection->RingSocket);
+	}
+}
+
+static uint8 *BufferPoolGet(TBufferPool *Pool, int Size, int *OutSize){
+	for(int i = 0; i < NARRAY(BUFFER_CLASS_SIZES); i += 1){
+		if(Size > BUFFER_CLASS_SIZES[i]){
 			continue;
 		}
 
-		if(fcntl(Socket, F_SETFL, Flags | O_NONBLOCK) == -1){
-			LOG_ERR("Failed to set socket flags: (%d) %s", errno, strerrordesc_np(errno));
-			close(Socket);
+		uint8 *Buffer;
+		if(Pool->FreeList[i] != NULL){
+			TPoolBuffer *PoolBuffer = Pool->FreeList[i];
+			Pool->FreeList[i] = PoolBuffer->Next;
+			Pool->NumCached[i] -= 1;
+			Buffer = (uint8*)PoolBuffer;
+		}else{
+			Buffer = (uint8*)malloc(BUFFER_CLASS_SIZES[i]);
+			if(Buffer == NULL){
+				return NULL;
+			}
+		}
+
+		*OutSize = BUFFER_CLASS_SIZES[i];
+		return Buffer;
+	}
+
+	return NULL;
+}
+
+static void BufferPoolPut(TBufferPool *Pool, uint8 *Buffer, int Size){
+	for(int i = 0; i < NARRAY(BUFFER_CLASS_SIZES); i += 1){
+		if(Size != BUFFER_CLASS_SIZES[i]){
 			continue;
 		}
 
-		if(OutAddr){
-			*OutAddr = ntohl(SocketAddr.sin_addr.s_addr);
+		if(Pool->NumCached[i] < BUFFER_CLASS_MAX_CACHED){
+			TPoolBuffer *PoolBuffer = (TPoolBuffer*)Buffer;
+			PoolBuffer->Next = Pool->FreeList[i];
+			Pool->FreeList[i] = PoolBuffer;
+			Pool->NumCached[i] += 1;
+			return;
 		}
 
-		if(OutPort){
-			*OutPort = ntohs(SocketAddr.sin_port);
+		break;
+	}
+
+	free(Buffer);
+}
+
+static void BufferPoolExit(TBufferPool *Pool){
+	for(int i = 0; i < NARRAY(BUFFER_CLASS_SIZES); i += 1){
+		while(Pool->FreeList[i] != NULL){
+			TPoolBuffer *PoolBuffer = Pool->FreeList[i];
+			Pool->FreeList[i] = PoolBuffer->Next;
+			free(PoolBuffer);
 		}
+		Pool->NumCached[i] = 0;
+	}
+}
 
-		return Socket;
+static void ConnectionResetBuffer(TConnection *Connection){
+	TConnectionData *Data = Connection->Data;
+	if(Data->Buffer != NULL && Data->Buffer != Data->InlineBuffer){
+		BufferPoolPut(&Connection->Worker->BufferPool, Data->Buffer, Data->BufferSize);
 	}
+
+	Data->Buffer = Data->InlineBuffer;
+	Data->BufferSize = (int)sizeof(Data->InlineBuffer);
 }
 
-static void CloseConnection(TConnection *Connection){
-	if(Connection->Socket != -1){
-		close(Connection->Socket);
-		Connection->Socket = -1;
+static bool ConnectionReserveBuffer(TConnection *Connection, int Size){
+	TConnectionData *Data = Connection->Data;
+	if(Size <= Data->BufferSize){
+		return true;
+	}
+
+	int NewSize;
+	uint8 *NewBuffer = BufferPoolGet(&Connection->Worker->BufferPool, Size, &NewSize);
+	if(NewBuffer == NULL){
+		LOG_ERR("Failed to get buffer with %d bytes for %s",
+				Size, Data->RemoteAddress);
+		return false;
+	}
+
+	// NOTE(fusion): Keep the current contents, which will usually be the request
+	// that is still being processed.
+	memcpy(NewBuffer, Data->Buffer, Data->BufferSize);
+	if(Data->Buffer != Data->InlineBuffer){
+		BufferPoolPut(&Connection->Worker->BufferPool, Data->Buffer, Data->BufferSize);
+	}
+
+	Data->Buffer = NewBuffer;
+	Data->BufferSize = NewSize;
+	return true;
+}
+
+static void ChunkLinkAvailable(TWorker *Worker, TConnectionChunk *Chunk){
+	Chunk->PrevAvailable = Worker->AvailableTail;
+	Chunk->NextAvailable = NULL;
+	if(Worker->AvailableTail != NULL){
+		Worker->AvailableTail->NextAvailable = Chunk;
+	}else{
+		Worker->AvailableHead = Chunk;
+	}
+	Worker->AvailableTail = Chunk;
+}
+
+static void ChunkUnlinkAvailable(TWorker *Worker, TConnectionChunk *Chunk){
+	if(Chunk->PrevAvailable != NULL){
+		Chunk->PrevAvailable->NextAvailable = Chunk->NextAvailable;
+	}else{
+		Worker->AvailableHead = Chunk->NextAvailable;
 	}
+
+	if(Chunk->NextAvailable != NULL){
+		Chunk->NextAvailable->PrevAvailable = Chunk->PrevAvailable;
+	}else{
+		Worker->AvailableTail = Chunk->PrevAvailable;
+	}
+
+	Chunk->PrevAvailable = NULL;
+	Chunk->NextAvailable = NULL;
 }
 
-static TConnection *AssignConnection(int Socket, uint32 Addr, uint16 Port){
-	int ConnectionIndex = -1;
-	for(int i = 0; i < g_Config.MaxConnections; i += 1){
-		if(g_Connections[i].State == CONNECTION_FREE){
-			ConnectionIndex = i;
+static TConnectionChunk *ChunkAlloc(TWorker *Worker){
+	int ChunkIndex = -1;
+	for(int i = 0; i < Worker->MaxChunks; i += 1){
+		if(Worker->Chunks[i] == NULL){
+			ChunkIndex = i;
 			break;
 		}
 	}
 
-	TConnection *Connection = NULL;
-	if(ConnectionIndex != -1){
-		Connection = &g_Connections[ConnectionIndex];
+	if(ChunkIndex == -1){
+		return NULL;
+	}
+
+	// NOTE(fusion): Anonymous mappings are zero initialized, which is also the
+	// FREE state.
+	STATIC_ASSERT(CONNECTION_FREE == 0);
+	void *Memory = mmap(NULL, sizeof(TConnectionChunk), PROT_READ | PROT_WRITE,
+			MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+	if(Memory == MAP_FAILED){
+		LOG_ERR("Failed to map connection chunk: (%d) %s", errno, strerrordesc_np(errno));
+		return NULL;
+	}
+
+	TConnectionChunk *Chunk = (TConnectionChunk*)Memory;
+	Chunk->Index = ChunkIndex;
+	for(int i = CONNECTION_CHUNK_SIZE - 1; i >= 0; i -= 1){
+		TConnection *Connection = &Chunk->Connections[i];
+		TConnectionData *Data = &Chunk->Data[i];
+		Connection->Data = Data;
+		Data->Chunk = Chunk;
+		Data->Buffer = Data->InlineBuffer;
+		Data->BufferSize = (int)sizeof(Data->InlineBuffer);
+		Data->NextFree = Chunk->FreeList;
+		Chunk->FreeList = Connection;
+	}
+
+	Worker->Chunks[ChunkIndex] = Chunk;
+	ChunkLinkAvailable(Worker, Chunk);
+	return Chunk;
+}
+
+static void ChunkFree(TWorker *Worker, TConnectionChunk *Chunk){
+	ASSERT(Worker->Chunks[Chunk->Index] == Chunk);
+	Worker->Chunks[Chunk->Index] = NULL;
+	munmap(Chunk, sizeof(TConnectionChunk));
+}
+
+static TConnection *ConnectionSlotAlloc(TWorker *Worker){
+	if(Worker->NumConnections >= Worker->MaxConnections){
+		return NULL;
+	}
+
+	TConnectionChunk *Chunk = Worker->AvailableHead;
+	if(Chunk == NULL){
+		Chunk = ChunkAlloc(Worker);
+		if(Chunk == NULL){
+			return NULL;
+		}
+	}
+
+	TConnection *Connection = Chunk->FreeList;
+	ASSERT(Connection != NULL && Connection->State == CONNECTION_FREE);
+	Chunk->FreeList = Connection->Data->NextFree;
+	Connection->Data->NextFree = NULL;
+	if(Chunk->FreeList == NULL){
+		ChunkUnlinkAvailable(Worker, Chunk);
+	}
+
+	if(Worker->SpareChunk == Chunk){
+		Worker->SpareChunk = NULL;
+	}
+
+	Chunk->NumUsed += 1;
+	Worker->NumConnections += 1;
+	if(Worker->NumConnections >= Worker->MaxConnections){
+		PauseAccepting(Worker);
+	}
+	return Connection;
+}
+
+static void ConnectionSlotFree(TWorker *Worker, TConnection *Connection){
+	TConnectionChunk *Chunk = Connection->Data->Chunk;
+	ASSERT(Chunk != NULL && Chunk->NumUsed > 0);
+	if(Chunk->FreeList == NULL){
+		ChunkLinkAvailable(Worker, Chunk);
+	}
+
+	Connection->Data->NextFree = Chunk->FreeList;
+	Chunk->FreeList = Connection;
+	Chunk->NumUsed -= 1;
+	Worker->NumConnections -= 1;
+	if(Worker->NumConnections < Worker->MaxConnections){
+		ResumeAccepting(Worker);
+	}
+
+	if(Chunk->NumUsed == 0){
+		if(Worker->SpareChunk == NULL){
+			Worker->SpareChunk = Chunk;
+		}else if(!Chunk->PendingFree){
+			Chunk->PendingFree = true;
+			Chunk->NextEmpty = Worker->EmptyChunks;
+			Worker->EmptyChunks = Chunk;
+		}
+	}
+}
+
+static void FreeEmptyChunks(TWorker *Worker){
+	TConnectionChunk *Chunk = Worker->EmptyChunks;
+	Worker->EmptyChunks = NULL;
+	while(Chunk != NULL){
+		TConnectionChunk *Next = Chunk->NextEmpty;
+		Chunk->PendingFree = false;
+		Chunk->NextEmpty = NULL;
+
+		// NOTE(fusion): The chunk may have been used again, or the spare chunk
+		// taken, since it was queued.
+		if(Chunk->NumUsed == 0 && Chunk != Worker->SpareChunk){
+			if(Worker->SpareChunk == NULL){
+				Worker->SpareChunk = Chunk;
+			}else{
+				ChunkUnlinkAvailable(Worker, Chunk);
+				ChunkFree(Worker, Chunk);
+			}
+		}
+
+		Chunk = Next;
+	}
+}
+
+static int ConnectionSlotIndex(TConnection *Connection){
+	TConnectionChunk *Chunk = Connection->Data->Chunk;
+	return Chunk->Index * CONNECTION_CHUNK_SIZE
+		+ (int)(Connection - Chunk->Connections);
+}
+
+static void ScheduleConnection(TConnection *Connection){
+	TConnectionData *Data = Connection->Data;
+	ASSERT(!Data->Scheduled);
+	TWorker *Worker = Connection->Worker;
+	Data->RunPrev = Worker->RunQueueTail;
+	Data->RunNext = NULL;
+	if(Worker->RunQueueTail != NULL){
+		Worker->RunQueueTail->Data->RunNext = Connection;
+	}else{
+		Worker->RunQueueHead = Connection;
+	}
+	Worker->RunQueueTail = Connection;
+	Worker->RunQueueLength += 1;
+	Data->Scheduled = true;
+}
+
+static void UnscheduleConnection(TConnection *Connection){
+	TConnectionData *Data = Connection->Data;
+	if(!Data->Scheduled){
+		return;
+	}
+
+	TWorker *Worker = Connection->Worker;
+	if(Data->RunPrev != NULL){
+		Data->RunPrev->Data->RunNext = Data->RunNext;
+	}else{
+		Worker->RunQueueHead = Data->RunNext;
+	}
+
+	if(Data->RunNext != NULL){
+		Data->RunNext->Data->RunPrev = Data->RunPrev;
+	}else{
+		Worker->RunQueueTail = Data->RunPrev;
+	}
+
+	Worker->RunQueueLength -= 1;
+	Data->RunPrev = NULL;
+	Data->RunNext = NULL;
+	Data->Scheduled = false;
+}
+
+static void ConnectionTimedOut(TTimer *Timer);
+static void UpdateConnectionDeadline(TConnection *Connection);
+
+// NOTE(fusion): Same as with io_uring completions, epoll registrations carry
+// what kind of descriptor they are for in the low bits of the pointer, so
+// events can be dispatched without looking the pointer up anywhere.
+enum : int {
+	EPOLL_TAG_CONNECTION	= 0,
+	EPOLL_TAG_LISTENER		= 1,
+	EPOLL_TAG_WAKE			= 2,
+	EPOLL_TAG_QUERY			= 3,
+};
+
+STATIC_ASSERT(alignof(TWorker) >= 8);
+
+static uint64 EpollTag(void *Pointer, int Tag){
+	ASSERT(((uintptr_t)Pointer & 7) == 0);
+	return (uint64)(uintptr_t)Pointer | (uint64)Tag;
+}
+
+static TConnection *AssignConnection(TWorker *Worker, int Socket, uint32 Addr, uint16 Port){
+	TConnection *Connection = ConnectionSlotAlloc(Worker);
+	if(Connection != NULL){
+		// NOTE(fusion): Connections are registered once, for both input and
+		// output, in edge-triggered mode. This means we need to always consume
+		// input or output until `EAGAIN`, or we won't be notified again.
+		if(!g_UseIOUring){
+			epoll_event Event = {};
+			Event.events = EPOLLIN | EPOLLOUT | EPOLLET;
+			Event.data.u64 = EpollTag(Connection, EPOLL_TAG_CONNECTION);
+			if(epoll_ctl(Worker->Epoll, EPOLL_CTL_ADD, Socket, &Event) == -1){
+				LOG_ERR("Failed to register connection: (%d) %s", errno, strerrordesc_np(errno));
+				ConnectionSlotFree(Worker, Connection);
+				return NULL;
+			}
+		}
+
+		Connection->SlotClass = CONNECTION_CLASS_UNKNOWN;
+		Worker->NumByClass[CONNECTION_CLASS_UNKNOWN] += 1;
+
+		Connection->Worker = Worker;
 		Connection->State = CONNECTION_READING;
 		Connection->Socket = Socket;
-		Connection->IPAddress = (int)Addr;
-		Connection->StartTime = GetMonotonicUptime();
-		Connection->RandomSeed = (uint32)rand();
-		StringBufFormat(Connection->RemoteAddress,
+		Connection->RingSocket = (g_UseIOUring ? Socket : -1);
+		Connection->RingOps = 0;
+		Connection->Data->IPAddress = (int)Addr;
+		Connection->StartTime = Worker->LoopTime;
+		Connection->Data->RandomSeed = (uint32)rand();
+		StringBufFormat(Connection->Data->RemoteAddress,
 				"%d.%d.%d.%d:%d",
-				((Connection->IPAddress >> 24) & 0xFF),
-				((Connection->IPAddress >> 16) & 0xFF),
-				((Connection->IPAddress >>  8) & 0xFF),
-				((Connection->IPAddress >>  0) & 0xFF),
+				((Connection->Data->IPAddress >> 24) & 0xFF),
+				((Connection->Data->IPAddress >> 16) & 0xFF),
+				((Connection->Data->IPAddress >>  8) & 0xFF),
+				((Connection->Data->IPAddress >>  0) & 0xFF),
 				(int)Port);
-		LOG("Connection %s assigned to slot %d",
-				Connection->RemoteAddress, ConnectionIndex);
+
+		Connection->Data->Timer.Callback = ConnectionTimedOut;
+		Connection->Data->Timer.Data = Connection;
+		UpdateConnectionDeadline(Connection);
+
+		LOG("Connection %s assigned to worker %d slot %d",
+				Connection->Data->RemoteAddress, Worker->WorkerID,
+				ConnectionSlotIndex(Connection));
+
+		if(g_UseIOUring){
+			URingSubmitReceive(Connection);
+		}
 	}
 	return Connection;
 }
 
 static void ReleaseConnection(TConnection *Connection){
-	if(Connection->State != CONNECTION_FREE){
-		LOG("Connection %s released", Connection->RemoteAddress);
+	if(Connection->State != CONNECTION_FREE && Connection->State != CONNECTION_RELEASING){
+		LOG("Connection %s released", Connection->Data->RemoteAddress);
 		CloseConnection(Connection);
+		UnscheduleConnection(Connection);
+
+		// NOTE(fusion): A status refresh that never completes would prevent any
+		// other request from refreshing it.
+		if(Connection->State == CONNECTION_QUERYING){
+			TQuery *Query = &Connection->Data->Query;
+			CancelQuery(&Connection->Worker->QueryManagers, Query);
+			if(Query->Type == QUERY_GET_WORLDS){
+				AbortStatusRefresh();
+			}
+		}
+
+		TimerStop(&Connection->Worker->Timers, &Connection->Data->Timer);
+		Connection->State = CONNECTION_RELEASING;
+	}
+
+	// NOTE(fusion): With io_uring, the slot can only be reused after all its
+	// operations have completed. This is always immediate with epoll.
+	if(Connection->State == CONNECTION_RELEASING && Connection->RingOps == 0){
+		if(Connection->RingSocket != -1){
+			close(Connection->RingSocket);
+		}
+
+		ConnectionResetBuffer(Connection);
+
+		TWorker *Worker = Connection->Worker;
+		TConnectionData *Data = Connection->Data;
+		Worker->NumByClass[Connection->SlotClass] -= 1;
+		// NOTE(fusion): The buffer is always written before it's read, so there
+		// is no point in clearing it and touching its pages here.
 		memset(Connection, 0, sizeof(TConnection));
+		memset(Data, 0, offsetof(TConnectionData, Chunk));
 		Connection->State = CONNECTION_FREE;
+		Connection->Data = Data;
+		ConnectionSlotFree(Worker, Connection);
 	}
 }
 
-static void CheckConnectionInput(TConnection *Connection, int Events){
-	if(Connection->Socket == -1 || (Events & POLLIN) == 0){
-		return;
+// NOTE(fusion): The only valid requests are logins, which have a fixed size,
+// and status requests, which also have a fixed size in the only format we
+// support. Anything else can be rejected as soon as we see the header, without
+// waiting for the payload.
+static const int LOGIN_REQUEST_SIZE = 145;
+static const int STATUS_REQUEST_SIZE = 6;
+STATIC_ASSERT((2 + LOGIN_REQUEST_SIZE) <= CONNECTION_INLINE_BUFFER_SIZE);
+STATIC_ASSERT((2 + STATUS_REQUEST_SIZE) <= CONNECTION_INLINE_BUFFER_SIZE);
+
+static bool ValidRequestSize(int PayloadSize, int Command){
+	if(Command == 1){
+		return PayloadSize == LOGIN_REQUEST_SIZE;
+	}else if(Command == 255){
+		return PayloadSize == STATUS_REQUEST_SIZE;
+	}else if(Command == -1){
+		return PayloadSize == LOGIN_REQUEST_SIZE
+			|| PayloadSize == STATUS_REQUEST_SIZE;
+	}else{
+		return false;
 	}
+}
 
-	if(Connection->State != CONNECTION_READING){
-		LOG_ERR("Connection %s (State: %d) sending out-of-order data",
-				Connection->RemoteAddress, Connection->State);
-		CloseConnection(Connection);
-		return;
+static bool ClassifyConnection(TConnection *Connection, int Command){
+	TWorker *Worker = Connection->Worker;
+	ConnectionClass SlotClass = (Command == 255)
+			? CONNECTION_CLASS_STATUS
+			: CONNECTION_CLASS_LOGIN;
+	if(SlotClass != CONNECTION_CLASS_STATUS && Worker->StatusOnly){
+		LOG_WARN("Login request from %s on status port", Connection->Data->RemoteAddress);
+		return false;
 	}
 
-	while(true){
-		int ReadSize = (Connection->RWSize > 0 ? Connection->RWSize : 2);
-		int BytesRead = (int)read(Connection->Socket,
-				(Connection->Buffer + Connection->RWPosition),
-				(ReadSize           - Connection->RWPosition));
-		if(BytesRead == -1){
+	if(SlotClass == CONNECTION_CLASS_STATUS
+			&& Worker->NumConnections > Worker->StatusLimit){
+		Worker->Stats.ShedStatus += 1;
+		return false;
+	}
+
+	Worker->NumByClass[Connection->SlotClass] -= 1;
+	Worker->NumByClass[SlotClass] += 1;
+	Connection->SlotClass = SlotClass;
+	return true;
+}
+
+static void ConnectionInputReceived(TConnection *Connection, int BytesRead){
+	Connection->RWPosition += BytesRead;
+	if(Connection->RWPosition < 2){
+		return;
+	}
+
+	uint8 *Buffer = Connection->Data->Buffer;
+	int PayloadSize = (int)BufferRead16LE(Buffer);
+	int Command = (Connection->RWPosition > 2 ? (int)Buffer[2] : -1);
+	if(!ValidRequestSize(PayloadSize, Command)){
+		AbortConnection(Connection);
+		return;
+	}
+
+	if(Command != -1 && Connection->SlotClass == CONNECTION_CLASS_UNKNOWN
+			&& !ClassifyConnection(Connection, Command)){
+		CloseConnection(Connection);
+		return;
+	}
+
+	// NOTE(fusion): Requests are processed from the start of the buffer, so we
+	// need to move the payload there. Any trailing data is ignored.
+	if(Connection->RWPosition >= (2 + PayloadSize)){
+		memmove(Buffer, Buffer + 2, PayloadSize);
+		Connection->State = CONNECTION_PROCESSING;
+		Connection->RWSize = PayloadSize;
+		Connection->RWPosition = 0;
+		ScheduleConnection(Connection);
+	}
+}
+
+static void DrainConnectionInput(TConnection *Connection){
+	while(Connection->Socket != -1){
+		int BytesRead = (int)read(Connection->Socket,
+				Connection->Data->Buffer, Connection->Data->BufferSize);
+		if(BytesRead == -1){
+			if(errno != EAGAIN){
+				CloseConnection(Connection);
+			}
+			break;
+		}else if(BytesRead == 0){
+			ConnectionPeerClosed(Connection);
+			break;
+		}
+
+		ConnectionDrainReceived(Connection, BytesRead);
+	}
+}
+
+static void CheckConnectionInput(TConnection *Connection, int Events){
+	if(Connection->Socket == -1 || (Events & EPOLLIN) == 0){
+		return;
+	}
+
+	if(Connection->State == CONNECTION_DRAINING){
+		DrainConnectionInput(Connection);
+		return;
+	}
+
+	if(Connection->State != CONNECTION_READING){
+		LOG_ERR("Connection %s (State: %d) sending out-of-order data",
+				Connection->Data->RemoteAddress, Connection->State);
+		AbortConnection(Connection);
+		return;
+	}
+
+	// NOTE(fusion): Read as much as the buffer can hold, which is enough for any
+	// valid request, header included, so a complete request takes a single read.
+	while(Connection->Socket != -1 && Connection->State == CONNECTION_READING){
+		int ReadSize = Connection->Data->BufferSize - Connection->RWPosition;
+		int BytesRead = (int)read(Connection->Socket,
+				(Connection->Data->Buffer + Connection->RWPosition), ReadSize);
+		if(BytesRead == -1){
 			if(errno != EAGAIN){
 				// NOTE(fusion): Connection error.
 				CloseConnection(Connection);
@@ -182,293 +1100,1912 @@ static void CheckConnectionInput(TConnection *Connection, int Events){
 			break;
 		}
 
-		Connection->RWPosition += BytesRead;
-		if(Connection->RWPosition >= ReadSize){
-			if(Connection->RWSize != 0){
-				Connection->State = CONNECTION_PROCESSING;
-				break;
-			}else if(Connection->RWPosition == 2){
-				int PayloadSize = (int)BufferRead16LE(Connection->Buffer);
-				if(PayloadSize <= 0 || PayloadSize > (int)sizeof(Connection->Buffer)){
-					CloseConnection(Connection);
-					break;
+		ConnectionInputReceived(Connection, BytesRead);
+
+		// NOTE(fusion): A short read means the socket has been drained, so there
+		// is no point in reading again just to get `EAGAIN`.
+		if(BytesRead < ReadSize){
+			break;
+		}
+	}
+}
+
+static void CheckConnectionRequest(TConnection *Connection){
+	if(Connection->Socket == -1){
+		return;
+	}
+
+	if(Connection->State != CONNECTION_PROCESSING){
+		return;
+	}
+
+	// PARANOID(fusion): A non-empty payload is guaranteed, due to how we parse
+	// input in `ConnectionInputReceived`.
+	ASSERT(Connection->RWSize > 0);
+
+	int Command = Connection->Data->Buffer[0];
+	if(Command == 1){
+		ProcessLoginRequest(Connection);
+	}else if(Command == 255){
+		ProcessStatusRequest(Connection);
+	}else{
+		LOG_ERR("Invalid command %d from %s (expected 1 or 255)",
+				Command, Connection->Data->RemoteAddress);
+		AbortConnection(Connection);
+	}
+}
+
+static void CheckConnectionOutput(TConnection *Connection, int Events){
+	// NOTE(fusion): We'll only get an `EPOLLOUT` edge after a write returns
+	// `EAGAIN`, but we want to allow requests to complete in a single cycle, so
+	// we always check for output if the connection is WRITING.
+	(void)Events;
+
+	if(Connection->Socket == -1){
+		return;
+	}
+
+	if(Connection->State != CONNECTION_WRITING){
+		return;
+	}
+
+	while(true){
+		int BytesWritten = (int)write(Connection->Socket,
+				(Connection->Data->Buffer + Connection->RWPosition),
+				(Connection->RWSize - Connection->RWPosition));
+		if(BytesWritten == -1){
+			if(errno != EAGAIN){
+				CloseConnection(Connection);
+			}
+			break;
+		}
+
+		Connection->RWPosition += BytesWritten;
+		if(Connection->RWPosition >= Connection->RWSize){
+			// NOTE(fusion): The client's FIN may have arrived along with the
+			// request, in which case there won't be another edge for it.
+			ConnectionOutputFinished(Connection);
+			if(Connection->State == CONNECTION_DRAINING){
+				DrainConnectionInput(Connection);
+			}
+			break;
+		}
+	}
+}
+
+static void CheckConnection(TConnection *Connection, int Events){
+	if((Events & (EPOLLERR | EPOLLHUP)) != 0){
+		CloseConnection(Connection);
+	}
+
+	if(Connection->Socket == -1){
+		ReleaseConnection(Connection);
+	}
+}
+
+// NOTE(fusion): Besides the overall `ConnectionTimeout`, each phase of a
+// connection has its own deadline. Once the header is in, the payload also
+// needs to keep up a minimum data rate, measured from the end of the header
+// with one second worth of slack. Before that, only `HeaderTimeout` applies,
+// so clients that are slow to send their first bytes aren't cut short by the
+// rate rule. Phase deadlines shrink as
+// the worker's table fills up, from their configured values at half occupancy
+// down to `AdaptiveTimeoutFloor` percent when full, so slots are recycled
+// faster under attack while slow clients still get through otherwise.
+static const char *ConnectionPhaseName(ConnectionPhase Phase){
+	switch(Phase){
+		case CONNECTION_PHASE_NONE:			return "NONE";
+		case CONNECTION_PHASE_HEADER:		return "HEADER";
+		case CONNECTION_PHASE_PAYLOAD:		return "PAYLOAD";
+		case CONNECTION_PHASE_PROCESSING:	return "PROCESSING";
+		case CONNECTION_PHASE_WRITING:		return "WRITING";
+		case CONNECTION_PHASE_DRAINING:		return "DRAINING";
+		default:							return "UNKNOWN";
+	}
+}
+
+static ConnectionPhase GetConnectionPhase(TConnection *Connection){
+	switch(Connection->State){
+		case CONNECTION_READING:{
+			return (Connection->RWPosition < 2)
+				? CONNECTION_PHASE_HEADER
+				: CONNECTION_PHASE_PAYLOAD;
+		}
+
+		case CONNECTION_PROCESSING:	return CONNECTION_PHASE_PROCESSING;
+		case CONNECTION_QUERYING:	return CONNECTION_PHASE_PROCESSING;
+		case CONNECTION_WRITING:	return CONNECTION_PHASE_WRITING;
+		case CONNECTION_DRAINING:	return CONNECTION_PHASE_DRAINING;
+		default:					return CONNECTION_PHASE_NONE;
+	}
+}
+
+static int64 ScaleTimeout(TWorker *Worker, int Timeout){
+	int Floor = g_Config.AdaptiveTimeoutFloor;
+	int HalfConnections = Worker->MaxConnections / 2;
+	if(Floor >= 100 || Worker->NumConnections <= HalfConnections){
+		return Timeout;
+	}
+
+	int64 Range = Worker->MaxConnections - HalfConnections;
+	int64 Excess = Worker->NumConnections - HalfConnections;
+	int64 Percent = 100 - ((100 - Floor) * Excess) / Range;
+	return ((int64)Timeout * Percent) / 100;
+}
+
+static void UpdateConnectionDeadline(TConnection *Connection){
+	TWorker *Worker = Connection->Worker;
+	ConnectionPhase Phase = GetConnectionPhase(Connection);
+	if(Connection->Phase != Phase){
+		Connection->Phase = Phase;
+		Connection->PhaseStartTime = Worker->LoopTime;
+	}
+
+	int PhaseTimeout = 0;
+	switch(Phase){
+		case CONNECTION_PHASE_HEADER:		PhaseTimeout = g_Config.HeaderTimeout; break;
+		case CONNECTION_PHASE_PAYLOAD:		PhaseTimeout = g_Config.PayloadTimeout; break;
+		case CONNECTION_PHASE_PROCESSING:	PhaseTimeout = g_Config.ProcessingTimeout; break;
+		case CONNECTION_PHASE_WRITING:		PhaseTimeout = g_Config.WriteTimeout; break;
+		case CONNECTION_PHASE_DRAINING:		PhaseTimeout = g_Config.DrainTimeout; break;
+		default:							break;
+	}
+
+	int64 Deadline = INT64_MAX;
+	if(Worker->ConnectionTimeout > 0){
+		Deadline = Connection->StartTime + Worker->ConnectionTimeout;
+	}
+
+	if(PhaseTimeout > 0){
+		int64 PhaseDeadline = Connection->PhaseStartTime + ScaleTimeout(Worker, PhaseTimeout);
+		if(PhaseDeadline < Deadline){
+			Deadline = PhaseDeadline;
+		}
+	}
+
+	if(Phase == CONNECTION_PHASE_PAYLOAD && g_Config.MinReadRate > 0){
+		int64 RateDeadline = Connection->PhaseStartTime + ScaleTimeout(Worker, 1000)
+				+ ((int64)(Connection->RWPosition - 2) * 1000) / g_Config.MinReadRate;
+		if(RateDeadline < Deadline){
+			Deadline = RateDeadline;
+		}
+	}
+
+	if(Deadline == INT64_MAX){
+		TimerStop(&Worker->Timers, &Connection->Data->Timer);
+	}else if(!Connection->Data->Timer.Active || Connection->Data->Timer.Deadline != Deadline){
+		TimerStart(&Worker->Timers, &Connection->Data->Timer, Deadline);
+	}
+}
+
+static void ConnectionTimedOut(TTimer *Timer){
+	TConnection *Connection = (TConnection*)Timer->Data;
+	if(Connection->State == CONNECTION_DRAINING){
+		Connection->Worker->Stats.DrainTimedOut += 1;
+		if(g_TeardownMode == TEARDOWN_PASSIVE
+				&& Connection->SlotClass != CONNECTION_CLASS_STATUS){
+			Connection->Worker->Stats.ActiveClose += 1;
+		}
+		ReleaseConnection(Connection);
+		return;
+	}
+
+	int ElapsedTime = (int)(Connection->Worker->LoopTime - Connection->StartTime);
+	int PhaseTime = (int)(Connection->Worker->LoopTime - Connection->PhaseStartTime);
+	LOG_WARN("Connection %s TIMEDOUT (Phase: %s, PhaseTime: %dms, ElapsedTime: %dms, Received: %d)",
+			Connection->Data->RemoteAddress, ConnectionPhaseName(Connection->Phase),
+			PhaseTime, ElapsedTime, (Connection->State == CONNECTION_READING ? Connection->RWPosition : 0));
+	Connection->Worker->Stats.TimedOut += 1;
+	ReleaseConnection(Connection);
+}
+
+static void AcceptConnection(TWorker *Worker, int Socket, uint32 Addr, uint16 Port){
+	if(AssignConnection(Worker, Socket, Addr, Port) == NULL){
+		LOG_ERR("Rejecting connection %08X:%d:"
+				" max number of connections reached (%d)",
+				Addr, Port, Worker->MaxConnections);
+		Worker->Stats.Rejected += 1;
+		close(Socket);
+	}else{
+		Worker->Stats.Accepted += 1;
+	}
+}
+
+static void AcceptConnections(TWorker *Worker){
+	ASSERT(Worker->Listener != -1);
+	while(Worker->AcceptPending && Worker->Accepting){
+		if(Worker->AcceptBudget <= 0){
+			Worker->Stats.Deferred += 1;
+			break;
+		}
+
+		uint32 Addr;
+		uint16 Port;
+		int Socket = ListenerAccept(Worker->Listener, &Addr, &Port);
+		if(Socket == -1){
+			Worker->AcceptPending = false;
+			break;
+		}
+
+		Worker->AcceptBudget -= 1;
+		AcceptConnection(Worker, Socket, Addr, Port);
+	}
+}
+
+static void URingAccept(TWorker *Worker, int Result){
+	ASSERT(Worker->AcceptsInFlight > 0);
+	Worker->AcceptsInFlight -= 1;
+	if(Result >= 0){
+		// NOTE(fusion): With several accepts in flight, each one would need its
+		// own address storage, so it's simpler to just ask for it.
+		int Socket = Result;
+		sockaddr_in SocketAddr = {};
+		socklen_t SocketAddrLen = sizeof(SocketAddr);
+		if(getpeername(Socket, (sockaddr*)&SocketAddr, &SocketAddrLen) == -1){
+			LOG_ERR("Failed to get peer address: (%d) %s", errno, strerrordesc_np(errno));
+			close(Socket);
+		}else{
+			uint32 Addr = ntohl(SocketAddr.sin_addr.s_addr);
+			uint16 Port = ntohs(SocketAddr.sin_port);
+			AcceptConnection(Worker, Socket, Addr, Port);
+		}
+
+		Worker->AcceptBudget -= 1;
+		if(Worker->AcceptBudget == 0){
+			Worker->Stats.Deferred += 1;
+		}
+	}else if(Result != -ECANCELED){
+		LOG_ERR("Failed to accept connection: (%d) %s", -Result, strerrordesc_np(-Result));
+	}
+
+	URingUpdateAccept(Worker);
+}
+
+static void URingReceive(TConnection *Connection, int Result, uint32 Flags, bool More){
+	int BufferID = -1;
+	if((Flags & IORING_CQE_F_BUFFER) != 0){
+		BufferID = (int)(Flags >> IORING_CQE_BUFFER_SHIFT);
+	}
+
+	if(Connection->Socket != -1){
+		if(Result > 0 && BufferID != -1){
+			if(Connection->State == CONNECTION_DRAINING){
+				ConnectionDrainReceived(Connection, Result);
+			}else if(Connection->State != CONNECTION_READING){
+				LOG_ERR("Connection %s (State: %d) sending out-of-order data",
+						Connection->Data->RemoteAddress, Connection->State);
+				AbortConnection(Connection);
+			}else{
+				// NOTE(fusion): Any trailing data after a complete request is
+				// ignored, same as with the epoll engine.
+				const uint8 *Data = IOBufferRingGet(&Connection->Worker->RingBuffers, BufferID);
+				int Count = Connection->Data->BufferSize - Connection->RWPosition;
+				if(Count > Result){
+					Count = Result;
 				}
 
-				Connection->RWSize = PayloadSize;
-				Connection->RWPosition = 0;
+				memcpy(Connection->Data->Buffer + Connection->RWPosition, Data, Count);
+				ConnectionInputReceived(Connection, Count);
+			}
+		}else if(Result == 0){
+			// NOTE(fusion): Graceful close. The response may still be in flight,
+			// in which case we only close after it's written.
+			if(Connection->State == CONNECTION_DRAINING){
+				ConnectionPeerClosed(Connection);
+			}else if(Connection->State == CONNECTION_WRITING
+					&& g_TeardownMode != TEARDOWN_CLOSE){
+				Connection->Data->PeerClosed = true;
 			}else{
-				PANIC("Invalid input state (State: %d, RWSize: %d, RWPosition: %d)",
-						Connection->State, Connection->RWSize, Connection->RWPosition);
+				CloseConnection(Connection);
+			}
+		}else if(Result != -ENOBUFS && Result != -ECANCELED){
+			// NOTE(fusion): Connection error.
+			CloseConnection(Connection);
+		}
+	}
+
+	if(BufferID != -1){
+		IOBufferRingRecycle(&Connection->Worker->RingBuffers, BufferID);
+	}
+
+	// NOTE(fusion): A multishot receive may terminate early, most notably when
+	// we run out of provided buffers, in which case we need to re-arm it.
+	if(!More && URingWantsReceive(Connection)){
+		URingSubmitReceive(Connection);
+	}
+}
+
+static void URingWrite(TConnection *Connection, int Result){
+	if(Result < 0){
+		CloseConnection(Connection);
+		return;
+	}
+
+	// NOTE(fusion): A short write breaks the chain and cancels the linked close,
+	// in which case we need to submit the rest of the response again.
+	Connection->RWPosition += Result;
+	if(Connection->Socket != -1 && Connection->RWPosition < Connection->RWSize){
+		URingSubmitOutput(Connection, false);
+	}else if(Connection->Socket != -1 && g_TeardownMode != TEARDOWN_CLOSE){
+		ConnectionOutputFinished(Connection);
+	}
+}
+
+static void URingClose(TConnection *Connection, int Result){
+	// NOTE(fusion): A cancelled close means the linked write either failed or
+	// was incomplete, which is handled by `URingWrite`.
+	if(Result != -ECANCELED){
+		Connection->Worker->Stats.ActiveClose += 1;
+		Connection->RingSocket = -1;
+		Connection->Socket = -1;
+	}
+}
+
+static void URingWake(TWorker *Worker, int Result){
+	if(Result < 0 && Result != -ECANCELED){
+		LOG_ERR("Failed to read wake event: (%d) %s", -Result, strerrordesc_np(-Result));
+	}
+
+	if(Result != -ECANCELED){
+		URingSubmitWake(Worker);
+	}
+}
+
+static void URingQueryManager(TWorker *Worker, TQueryManagerConnection *QueryManager, int Result){
+	(void)Worker;
+	QueryManager->RingPollArmed = false;
+	QueryManager->RingPollCancelled = false;
+	if(Result < 0){
+		if(Result != -ECANCELED){
+			LOG_ERR("Failed to poll query manager: (%d) %s", -Result, strerrordesc_np(-Result));
+		}
+		return;
+	}
+
+	// NOTE(fusion): The poll may have been armed for a previous connection, in
+	// which case its events are meaningless.
+	if(QueryManager->RingPollGeneration == QueryManager->Generation){
+		ProcessQueryManager(QueryManager, Result);
+	}
+}
+
+static void URingProcessConnections(TWorker *Worker, int Timeout){
+	// NOTE(fusion): Flush pending submissions and block until the next timer
+	// expires, or indefinitely if there are none.
+	pthread_rwlock_unlock(&g_ConfigLock);
+	int Result = IOUringSubmit(&Worker->Ring, 1, Timeout);
+	pthread_rwlock_rdlock(&g_ConfigLock);
+	Worker->LoopTime = GetClockMonotonicMS();
+	if(Result == -1 && errno != ETIME && errno != EINTR){
+		return;
+	}
+
+	while(io_uring_cqe *Entry = IOUringPeekCQE(&Worker->Ring)){
+		io_uring_cqe CQE = *Entry;
+		IOUringAdvanceCQ(&Worker->Ring);
+
+		int Op = (int)(CQE.user_data & 7);
+		bool More = (CQE.flags & IORING_CQE_F_MORE) != 0;
+		TConnection *Connection = (TConnection*)(uintptr_t)(CQE.user_data & ~(uint64)7);
+		if(Op == URING_OP_ACCEPT){
+			URingAccept(Worker, CQE.res);
+			continue;
+		}else if(Op == URING_OP_WAKE){
+			URingWake(Worker, CQE.res);
+			continue;
+		}else if(Op == URING_OP_QUERY){
+			URingQueryManager(Worker, (TQueryManagerConnection*)Connection, CQE.res);
+			continue;
+		}else if(Op == URING_OP_CANCEL && Connection == NULL){
+			// NOTE(fusion): Listener accepts cancelled by `StopListening`, or
+			// query manager polls cancelled by `URingUpdateQueryManager`.
+			continue;
+		}
+
+		ASSERT(Connection != NULL && Connection->RingOps > 0);
+		if(!More){
+			Connection->RingOps -= 1;
+		}
+
+		switch(Op){
+			case URING_OP_RECEIVE:	URingReceive(Connection, CQE.res, CQE.flags, More); break;
+			case URING_OP_CANCEL:	break;
+			case URING_OP_WRITE:	URingWrite(Connection, CQE.res); break;
+			case URING_OP_CLOSE:	URingClose(Connection, CQE.res); break;
+			default:{
+				LOG_ERR("Unknown completion op %d", Op);
+				break;
+			}
+		}
+
+		if(Connection->Socket == -1){
+			ReleaseConnection(Connection);
+		}else{
+			UpdateConnectionDeadline(Connection);
+		}
+	}
+}
+
+static void EpollProcessConnections(TWorker *Worker, int Timeout){
+	// NOTE(fusion): Block until the next timer expires, or indefinitely if there
+	// are none. Don't block at all if there are accepts left from the previous
+	// iteration, since the listener won't trigger again in edge-triggered mode.
+	if(Worker->Accepting && Worker->AcceptPending){
+		Timeout = 0;
+	}
+
+	epoll_event Events[256];
+	pthread_rwlock_unlock(&g_ConfigLock);
+	int NumEvents = epoll_wait(Worker->Epoll, Events, NARRAY(Events), Timeout);
+	pthread_rwlock_rdlock(&g_ConfigLock);
+	Worker->LoopTime = GetClockMonotonicMS();
+	if(NumEvents == -1){
+		if(errno != EINTR){
+			LOG_ERR("Failed to wait for events: (%d) %s",
+					errno, strerrordesc_np(errno));
+		}
+		return;
+	}
+
+	// NOTE(fusion): Process connections. Each socket will show up at most once
+	// per wait, so a connection released here won't have any stale events left.
+	for(int i = 0; i < NumEvents; i += 1){
+		int EventMask = (int)Events[i].events;
+		int Tag = (int)(Events[i].data.u64 & 7);
+		void *Pointer = (void*)(uintptr_t)(Events[i].data.u64 & ~(uint64)7);
+		TConnection *Connection = (TConnection*)Pointer;
+		if(Tag == EPOLL_TAG_LISTENER){
+			if((EventMask & EPOLLIN) != 0){
+				Worker->AcceptPending = true;
+			}
+		}else if(Tag == EPOLL_TAG_QUERY){
+			ProcessQueryManager((TQueryManagerConnection*)Pointer, EventMask);
+		}else if(Tag == EPOLL_TAG_WAKE){
+			uint64 WakeValue;
+			while(read(Worker->WakeFd, &WakeValue, sizeof(WakeValue)) > 0){
+				// no-op
 			}
+		}else if(Connection->State != CONNECTION_FREE){
+			CheckConnectionInput(Connection, EventMask);
+			CheckConnectionOutput(Connection, EventMask);
+			CheckConnection(Connection, EventMask);
+			if(Connection->State != CONNECTION_FREE){
+				UpdateConnectionDeadline(Connection);
+			}
+		}
+	}
+
+	// NOTE(fusion): Accept new connections only after processing the ones we
+	// already have, which also frees their slots sooner.
+	AcceptConnections(Worker);
+}
+
+// NOTE(fusion): Called after a request has been processed, either right away
+// or after its query completes, to start writing the response or release the
+// connection. Connections still waiting on a query only get a new deadline.
+static void FinishConnectionRequest(TConnection *Connection){
+	if(g_UseIOUring){
+		if(Connection->Socket != -1 && Connection->State == CONNECTION_WRITING){
+			URingSubmitOutput(Connection, true);
+		}
+
+		if(Connection->Socket == -1){
+			ReleaseConnection(Connection);
+		}else{
+			UpdateConnectionDeadline(Connection);
+		}
+	}else{
+		CheckConnectionOutput(Connection, 0);
+		CheckConnection(Connection, 0);
+		if(Connection->State != CONNECTION_FREE){
+			UpdateConnectionDeadline(Connection);
 		}
 	}
-}
+}
+
+static void RunConnections(TWorker *Worker){
+	int MaxRequests = g_Config.MaxRequestsPerIteration;
+	if(MaxRequests <= 0){
+		MaxRequests = INT32_MAX;
+	}
+
+	// NOTE(fusion): `LoopTime` is refreshed after each request, so deadlines set
+	// after a long batch still start from the actual time.
+	int64 StartTime = GetClockMonotonicMS();
+	int NumRequests = 0;
+	Worker->LoopTime = StartTime;
+	while(Worker->RunQueueHead != NULL){
+		if(NumRequests >= MaxRequests || (g_Config.MaxProcessingTime > 0
+				&& (Worker->LoopTime - StartTime) >= g_Config.MaxProcessingTime)){
+			Worker->Stats.Yielded += 1;
+			break;
+		}
+
+		TConnection *Connection = Worker->RunQueueHead;
+		UnscheduleConnection(Connection);
+		CheckConnectionRequest(Connection);
+		Worker->LoopTime = GetClockMonotonicMS();
+		NumRequests += 1;
+		FinishConnectionRequest(Connection);
+	}
+}
+
+// Query Manager
+//==============================================================================
+static bool RegisterQueryManager(TWorker *Worker, TQueryManagerConnection *QueryManager){
+	// NOTE(fusion): Same as connections, query manager sockets are registered
+	// once, for both input and output, in edge-triggered mode. The io_uring
+	// engine arms their polls in `UpdateQueryManagers` instead.
+	if(!g_UseIOUring){
+		epoll_event Event = {};
+		Event.events = EPOLLIN | EPOLLOUT | EPOLLET;
+		Event.data.u64 = EpollTag(QueryManager, EPOLL_TAG_QUERY);
+		if(epoll_ctl(Worker->Epoll, EPOLL_CTL_ADD, QueryManager->Socket, &Event) == -1){
+			LOG_ERR("Failed to register query manager: (%d) %s", errno, strerrordesc_np(errno));
+			Disconnect(QueryManager);
+			return false;
+		}
+	}
+
+	return true;
+}
+
+static const int QUERY_CLIENT_DEADLINE_MARGIN = 100;
+
+static bool SubmitConnectionQuery(TConnection *Connection, TQueryCallback *Callback){
+	TWorker *Worker = Connection->Worker;
+	TQueryManagerPool *Pool = &Worker->QueryManagers;
+	if(Pool->BreakerState != QUERY_BREAKER_CLOSED){
+		Pool->Stats.BreakerRejected += 1;
+		return false;
+	}
+
+	if(NumConnectedQueryManagers(Pool) == 0 && NumConnectingQueryManagers(Pool) == 0){
+		return false;
+	}
+
+	// NOTE(fusion): There is no point in sending a query after its connection
+	// has timed out, so the query may be given the connection's own deadline,
+	// minus some margin, so the client can still be answered with an error.
+	Connection->State = CONNECTION_QUERYING;
+	UpdateConnectionDeadline(Connection);
+	int64 Deadline = INT64_MAX;
+	if(g_Config.QueryManagerClientDeadline && Connection->Data->Timer.Active){
+		Deadline = Connection->Data->Timer.Deadline - QUERY_CLIENT_DEADLINE_MARGIN;
+	}
+
+	TQuery *Query = &Connection->Data->Query;
+	Query->Callback = Callback;
+	Query->Data = Connection;
+	SubmitQuery(Pool, Query, Deadline);
+	return true;
+}
+
+static void URingUpdateQueryManager(TWorker *Worker, TQueryManagerConnection *QueryManager){
+	// NOTE(fusion): There is only ever one poll in flight and it is one-shot, so
+	// it needs to be armed again after each completion, and replaced when we
+	// need to wait for output or the connection changed.
+	int Events = (int)EPOLLIN;
+	if(QueryManagerWantsWrite(QueryManager)){
+		Events |= (int)EPOLLOUT;
+	}
+
+	if(!QueryManager->RingPollArmed){
+		io_uring_sqe *SQE = URingPrepare(Worker, NULL, URING_OP_QUERY,
+				IORING_OP_POLL_ADD, QueryManager->Socket);
+		if(SQE != NULL){
+			SQE->user_data = (uint64)(uintptr_t)QueryManager | (uint64)URING_OP_QUERY;
+			SQE->poll32_events = (uint32)Events;
+			QueryManager->RingPollArmed = true;
+			QueryManager->RingPollEvents = Events;
+			QueryManager->RingPollGeneration = QueryManager->Generation;
+		}
+	}else if(!QueryManager->RingPollCancelled
+			&& (QueryManager->RingPollGeneration != QueryManager->Generation
+				|| (Events & ~QueryManager->RingPollEvents) != 0)){
+		io_uring_sqe *SQE = URingPrepare(Worker, NULL, URING_OP_CANCEL,
+				IORING_OP_ASYNC_CANCEL, -1);
+		if(SQE != NULL){
+			SQE->addr = (uint64)(uintptr_t)QueryManager | (uint64)URING_OP_QUERY;
+			QueryManager->RingPollCancelled = true;
+		}
+	}
+}
+
+// NOTE(fusion): Broken connections are replaced at the end of each iteration,
+// at most once per `QUERY_MANAGER_RETRY_INTERVAL`, whether there are queries
+// waiting or not. Reconnecting doesn't block, and queries keep waiting while
+// any connection is still trying, so they only fail right away if none are
+// left. The timer just wakes up the event loop for retries and timeouts.
+static const int QUERY_MANAGER_RETRY_INTERVAL = 1000;
+
+static void QueryManagerTimerExpired(TTimer *Timer){
+	(void)Timer;
+}
+
+// NOTE(fusion): The circuit breaker opens once `QueryManagerBreakerThreshold`
+// attempts in a row have failed and there is no connection left. Queries then
+// fail right away, instead of waiting on connections that are bound to fail,
+// and a single connection is retried as a probe, with exponential backoff and
+// some jitter so workers don't all probe at once. A successful probe closes
+// the breaker and the other connections are retried right away.
+static const char *QueryBreakerStateName(int State){
+	switch(State){
+		case QUERY_BREAKER_CLOSED:		return "CLOSED";
+		case QUERY_BREAKER_OPEN:		return "OPEN";
+		case QUERY_BREAKER_HALF_OPEN:	return "HALF_OPEN";
+		default:						return "UNKNOWN";
+	}
+}
+
+static bool QueryBreakerOpen(TWorker *Worker){
+	return Worker->QueryManagers.BreakerState != QUERY_BREAKER_CLOSED;
+}
+
+static int ScheduleQueryBreakerProbe(TWorker *Worker){
+	TQueryManagerPool *Pool = &Worker->QueryManagers;
+	int Backoff = Pool->BreakerBackoff;
+	int Delay = Backoff / 2 + (int)(rand_r(&Pool->RandomSeed) % (uint32)(Backoff / 2 + 1));
+	Pool->BreakerState = QUERY_BREAKER_OPEN;
+	Pool->BreakerProbeTime = Worker->LoopTime + Delay;
+	return Delay;
+}
+
+static void OpenQueryBreaker(TWorker *Worker){
+	TQueryManagerPool *Pool = &Worker->QueryManagers;
+	Pool->BreakerBackoff = QUERY_MANAGER_RETRY_INTERVAL;
+	Pool->Stats.BreakerOpened += 1;
+	int Delay = ScheduleQueryBreakerProbe(Worker);
+	LOG_ERR("Worker %d query manager breaker OPEN after %d consecutive failures,"
+			" next probe in %dms", Worker->WorkerID, Pool->ConsecutiveFailures, Delay);
+	FailPendingQueries(Pool);
+}
+
+static void CloseQueryBreaker(TWorker *Worker){
+	TQueryManagerPool *Pool = &Worker->QueryManagers;
+	LOG("Worker %d query manager breaker CLOSED (was %s)",
+			Worker->WorkerID, QueryBreakerStateName(Pool->BreakerState));
+	Pool->BreakerState = QUERY_BREAKER_CLOSED;
+	for(int i = 0; i < Pool->NumConnections; i += 1){
+		Pool->Connections[i].RetryTime = Worker->LoopTime;
+	}
+}
+
+static void QueryManagerConnectFailed(TWorker *Worker, TQueryManagerConnection *QueryManager){
+	TQueryManagerPool *Pool = &Worker->QueryManagers;
+	QueryManager->RetryTime = Worker->LoopTime + QUERY_MANAGER_RETRY_INTERVAL;
+	Pool->ConsecutiveFailures += 1;
+	if(Pool->BreakerState == QUERY_BREAKER_HALF_OPEN){
+		Pool->BreakerBackoff *= 2;
+		if(Pool->BreakerBackoff > g_Config.QueryManagerBreakerMaxBackoff){
+			Pool->BreakerBackoff = g_Config.QueryManagerBreakerMaxBackoff;
+		}
+		int Delay = ScheduleQueryBreakerProbe(Worker);
+		LOG_ERR("Worker %d query manager probe failed, breaker OPEN, next probe in %dms",
+				Worker->WorkerID, Delay);
+	}
+}
+
+// NOTE(fusion): Only one connection may be retried while the breaker is open,
+// which moves it to HALF_OPEN until the probe either connects or fails.
+static bool QueryBreakerAllowsConnect(TWorker *Worker, int Index){
+	TQueryManagerPool *Pool = &Worker->QueryManagers;
+	if(Pool->BreakerState == QUERY_BREAKER_CLOSED){
+		return true;
+	}else if(Pool->BreakerState == QUERY_BREAKER_OPEN
+			&& Worker->LoopTime >= Pool->BreakerProbeTime){
+		LOG("Worker %d query manager breaker HALF_OPEN, probing (%d/%d)",
+				Worker->WorkerID, (Index + 1), Pool->NumConnections);
+		Pool->BreakerState = QUERY_BREAKER_HALF_OPEN;
+		return true;
+	}else{
+		return false;
+	}
+}
+
+static void UpdateQueryManagers(TWorker *Worker){
+	TQueryManagerPool *Pool = &Worker->QueryManagers;
+	ExpireQueries(Pool, Worker->LoopTime);
+
+	if(QueryBreakerOpen(Worker) && g_Config.QueryManagerBreakerThreshold <= 0){
+		CloseQueryBreaker(Worker);
+	}
+
+	int64 NextTime = INT64_MAX;
+	for(int i = 0; i < Pool->NumConnections; i += 1){
+		TQueryManagerConnection *QueryManager = &Pool->Connections[i];
+		if(IsConnecting(QueryManager) && Worker->LoopTime >= QueryManager->ConnectDeadline){
+			LOG_ERR("Worker %d timed out connecting to query manager (%d/%d)",
+					Worker->WorkerID, (i + 1), Pool->NumConnections);
+			Disconnect(QueryManager);
+		}
+
+		if(QueryManager->Reconnecting && !IsConnecting(QueryManager)){
+			QueryManager->Reconnecting = false;
+			if(IsConnected(QueryManager)){
+				LOG("Worker %d reconnected to query manager (%d/%d)",
+						Worker->WorkerID, (i + 1), Pool->NumConnections);
+				Pool->ConsecutiveFailures = 0;
+				if(QueryBreakerOpen(Worker)){
+					CloseQueryBreaker(Worker);
+				}
+			}else{
+				QueryManagerConnectFailed(Worker, QueryManager);
+			}
+		}
+
+		if(QueryManager->Socket == -1 && Worker->LoopTime >= QueryManager->RetryTime
+				&& QueryBreakerAllowsConnect(Worker, i)){
+			int64 Deadline = Worker->LoopTime + g_Config.QueryManagerConnectTimeout;
+			if(StartConnect(QueryManager, Deadline) && RegisterQueryManager(Worker, QueryManager)){
+				QueryManager->Reconnecting = true;
+			}else{
+				QueryManagerConnectFailed(Worker, QueryManager);
+			}
+		}
+	}
+
+	if(!QueryBreakerOpen(Worker) && g_Config.QueryManagerBreakerThreshold > 0
+			&& Pool->ConsecutiveFailures >= g_Config.QueryManagerBreakerThreshold
+			&& NumConnectedQueryManagers(Pool) == 0){
+		OpenQueryBreaker(Worker);
+	}
+
+	for(int i = 0; i < Pool->NumConnections; i += 1){
+		TQueryManagerConnection *QueryManager = &Pool->Connections[i];
+		if(IsConnecting(QueryManager)){
+			if(QueryManager->ConnectDeadline < NextTime){
+				NextTime = QueryManager->ConnectDeadline;
+			}
+		}else if(QueryManager->Socket == -1 && !QueryBreakerOpen(Worker)){
+			if(QueryManager->RetryTime < NextTime){
+				NextTime = QueryManager->RetryTime;
+			}
+		}
+	}
+
+	if(Pool->BreakerState == QUERY_BREAKER_OPEN && Pool->BreakerProbeTime < NextTime){
+		NextTime = Pool->BreakerProbeTime;
+	}
+
+	if(NumConnectedQueryManagers(Pool) == 0 && NumConnectingQueryManagers(Pool) == 0){
+		FailPendingQueries(Pool);
+	}
+
+	SendQueries(Pool);
+	if(Pool->NextDeadline < NextTime){
+		NextTime = Pool->NextDeadline;
+	}
+
+	if(g_UseIOUring){
+		for(int i = 0; i < Pool->NumConnections; i += 1){
+			if(Pool->Connections[i].Socket != -1){
+				URingUpdateQueryManager(Worker, &Pool->Connections[i]);
+			}
+		}
+	}
+
+	if(NextTime != INT64_MAX){
+		TimerStart(&Worker->Timers, &Worker->QueryManagerTimer, NextTime);
+	}else{
+		TimerStop(&Worker->Timers, &Worker->QueryManagerTimer);
+	}
+}
+
+static void LogQueryManagerStats(TWorker *Worker){
+	TQueryManagerPool *Pool = &Worker->QueryManagers;
+	TQueryManagerStats *Stats = &Pool->Stats;
+	UpdateQueryManagerStats(Pool);
+	int64 Elapsed = Worker->LoopTime - Stats->StartTime;
+	int Utilization = 0;
+	if(Elapsed > 0){
+		Utilization = (int)((Stats->BusyTime * 100) / (Elapsed * Pool->NumConnections));
+	}
+
+	int64 AverageWait = 0;
+	if(Stats->Sent > 0){
+		AverageWait = Stats->WaitTime / Stats->Sent;
+	}
+
+	LOG("Worker %d query manager: %d/%d connected, %d connecting, %d busy, %d in flight,"
+			" %d pending, %" PRId64 " sent, %" PRId64 " batched in %" PRId64 " batches,"
+			" %" PRId64 " replayed, %d%% utilization, %" PRId64 "ms avg wait,"
+			" %" PRId64 "ms max wait, %" PRId64 " login timeouts,"
+			" %" PRId64 " get worlds timeouts, %" PRId64 " stalled, breaker %s,"
+			" %" PRId64 " opened, %" PRId64 " rejected, %" PRId64 " early rejected",
+			Worker->WorkerID, NumConnectedQueryManagers(Pool), Pool->NumConnections,
+			NumConnectingQueryManagers(Pool), NumBusyQueryManagers(Pool), NumInFlightQueries(Pool), Pool->NumPending,
+			Stats->Sent, Stats->Batched, Stats->Batches, Stats->Replayed, Utilization,
+			AverageWait, Stats->MaxWaitTime, Stats->LoginTimeouts, Stats->GetWorldsTimeouts,
+			Stats->StalledStreams, QueryBreakerStateName(Pool->BreakerState),
+			Stats->BreakerOpened, Stats->BreakerRejected, Stats->BreakerEarlyRejected);
+	ResetQueryManagerStats(Pool);
+}
+
+static void LogWorkerStats(TTimer *Timer){
+	TWorker *Worker = (TWorker*)Timer->Data;
+	LOG("Worker %d%s: %d/%d connections (%d login, %d status, %d unknown),"
+			" %" PRId64 " accepted, %" PRId64 " rejected, %" PRId64 " paused,"
+			" %" PRId64 " deferred, %" PRId64 " timed out, %" PRId64 " status shed,"
+			" %" PRId64 " active close, %" PRId64 " passive close, %" PRId64 " reset,"
+			" %" PRId64 " drain timed out, %d queued, %" PRId64 " yielded",
+			Worker->WorkerID, (Worker->StatusOnly ? " (status)" : ""),
+			Worker->NumConnections, Worker->MaxConnections,
+			Worker->NumByClass[CONNECTION_CLASS_LOGIN],
+			Worker->NumByClass[CONNECTION_CLASS_STATUS],
+			Worker->NumByClass[CONNECTION_CLASS_UNKNOWN],
+			Worker->Stats.Accepted, Worker->Stats.Rejected, Worker->Stats.Paused,
+			Worker->Stats.Deferred, Worker->Stats.TimedOut, Worker->Stats.ShedStatus,
+			Worker->Stats.ActiveClose, Worker->Stats.PassiveClose, Worker->Stats.Reset,
+			Worker->Stats.DrainTimedOut, Worker->RunQueueLength, Worker->Stats.Yielded);
+	LogQueryManagerStats(Worker);
+	TimerStart(&Worker->Timers, Timer, Worker->LoopTime + g_Config.StatsInterval * 1000);
+}
+
+static int WorkerMaxConnections(bool StatusOnly){
+	// NOTE(fusion): The connection limit is split evenly between login workers,
+	// rounding up so we never have less than `MaxConnections` in total.
+	if(StatusOnly){
+		return g_Config.StatusMaxConnections;
+	}else{
+		return (g_Config.MaxConnections + g_NumLoginWorkers - 1) / g_NumLoginWorkers;
+	}
+}
+
+static bool ResizeConnectionTable(TWorker *Worker, int MaxConnections){
+	// NOTE(fusion): The chunk array never shrinks, so live connections are kept
+	// when the limit is lowered. Their chunks are released as usual, once empty,
+	// and no new connections are accepted until we're back under the limit.
+	int MaxChunks = (MaxConnections + CONNECTION_CHUNK_SIZE - 1) / CONNECTION_CHUNK_SIZE;
+	if(MaxChunks > Worker->MaxChunks){
+		TConnectionChunk **Chunks = (TConnectionChunk**)realloc(
+				Worker->Chunks, MaxChunks * sizeof(TConnectionChunk*));
+		if(Chunks == NULL){
+			LOG_ERR("Failed to resize connection table of worker %d to %d connections",
+					Worker->WorkerID, MaxConnections);
+			return false;
+		}
+
+		memset(Chunks + Worker->MaxChunks, 0,
+				(MaxChunks - Worker->MaxChunks) * sizeof(TConnectionChunk*));
+		Worker->Chunks = Chunks;
+		Worker->MaxChunks = MaxChunks;
+	}
+
+	Worker->MaxConnections = MaxConnections;
+	if(Worker->NumConnections >= Worker->MaxConnections){
+		PauseAccepting(Worker);
+	}else{
+		ResumeAccepting(Worker);
+	}
+	return true;
+}
+
+static bool ApplyWorkerConfig(TWorker *Worker){
+	int MaxConnections = WorkerMaxConnections(Worker->StatusOnly);
+	if(MaxConnections != Worker->MaxConnections
+			&& !ResizeConnectionTable(Worker, MaxConnections)){
+		return false;
+	}
+
+	if(Worker->StatusOnly){
+		Worker->StatusLimit = Worker->MaxConnections;
+		Worker->ConnectionTimeout = g_Config.StatusTimeout;
+		Worker->MaxAcceptsPerIteration = g_Config.StatusMaxAcceptsPerIteration;
+	}else{
+		Worker->StatusLimit = Worker->MaxConnections
+				- (Worker->MaxConnections * g_Config.LoginReservePercent) / 100;
+		Worker->ConnectionTimeout = g_Config.ConnectionTimeout;
+		Worker->MaxAcceptsPerIteration = g_Config.MaxAcceptsPerIteration;
+	}
+
+	if(g_Config.StatsInterval > 0){
+		Worker->StatsTimer.Callback = LogWorkerStats;
+		Worker->StatsTimer.Data = Worker;
+		TimerStart(&Worker->Timers, &Worker->StatsTimer,
+				Worker->LoopTime + g_Config.StatsInterval * 1000);
+	}else{
+		TimerStop(&Worker->Timers, &Worker->StatsTimer);
+	}
+
+	Worker->ConfigGeneration = g_ConfigGeneration;
+	return true;
+}
+
+static void WakeWorker(TWorker *Worker){
+	uint64 WakeValue = 1;
+	if(write(Worker->WakeFd, &WakeValue, sizeof(WakeValue)) == -1){
+		LOG_ERR("Failed to wake worker %d: (%d) %s",
+				Worker->WorkerID, errno, strerrordesc_np(errno));
+	}
+}
+
+static void StopListening(TWorker *Worker){
+	// NOTE(fusion): The listener is now shared with the new process, so it is
+	// never closed here. Epoll registrations belong to the open file description
+	// and won't go away on their own, and io_uring accepts hold a reference to
+	// it, so both need to be removed explicitly.
+	Worker->Draining = true;
+	Worker->Accepting = false;
+	Worker->AcceptPending = false;
+	if(g_UseIOUring){
+		if(Worker->AcceptsInFlight > 0){
+			io_uring_sqe *SQE = URingPrepare(Worker, NULL, URING_OP_CANCEL,
+					IORING_OP_ASYNC_CANCEL, Worker->Listener);
+			if(SQE != NULL){
+				SQE->cancel_flags = IORING_ASYNC_CANCEL_FD | IORING_ASYNC_CANCEL_ALL;
+			}
+		}
+	}else if(epoll_ctl(Worker->Epoll, EPOLL_CTL_DEL, Worker->Listener, NULL) == -1){
+		LOG_ERR("Failed to unregister listener: (%d) %s", errno, strerrordesc_np(errno));
+	}
+}
+
+static void ProcessWorkerConnections(TWorker *Worker){
+	pthread_rwlock_rdlock(&g_ConfigLock);
+	if(Worker->ConfigGeneration != g_ConfigGeneration){
+		ApplyWorkerConfig(Worker);
+	}
+
+	Worker->AcceptBudget = Worker->MaxAcceptsPerIteration;
+	if(Worker->AcceptBudget <= 0){
+		Worker->AcceptBudget = INT32_MAX;
+	}
+
+	// NOTE(fusion): Don't block if there are requests left from the previous
+	// batch. Ready writes and accepts are still served between batches.
+	int Timeout = TimerWheelNextTimeout(&Worker->Timers, Worker->LoopTime);
+	if(Worker->RunQueueHead != NULL){
+		Timeout = 0;
+	}
+
+	if(g_UseIOUring){
+		URingUpdateAccept(Worker);
+		URingProcessConnections(Worker, Timeout);
+	}else{
+		EpollProcessConnections(Worker, Timeout);
+	}
+
+	RunConnections(Worker);
+	TimerWheelAdvance(&Worker->Timers, Worker->LoopTime);
+	UpdateQueryManagers(Worker);
+	FreeEmptyChunks(Worker);
+
+	// NOTE(fusion): Workers are woken up when draining starts, so this needs to
+	// be checked after waiting, or we'd just go back to sleep. Accepts that were
+	// in flight may still complete with a connection, instead of cancelled.
+	if(!Worker->Draining && __atomic_load_n(&g_DrainWorkers, __ATOMIC_ACQUIRE)){
+		StopListening(Worker);
+	}
+
+	if(Worker->Draining && !Worker->Drained
+			&& Worker->NumConnections == 0
+			&& Worker->AcceptsInFlight == 0){
+		__atomic_store_n(&Worker->Drained, true, __ATOMIC_RELEASE);
+		if(Worker != &g_Workers[0]){
+			WakeWorker(&g_Workers[0]);
+		}
+	}
+
+	pthread_rwlock_unlock(&g_ConfigLock);
+}
+
+static void PinWorkerThread(TWorker *Worker){
+	int NumCPUs = (int)sysconf(_SC_NPROCESSORS_ONLN);
+	if(NumCPUs <= 0){
+		NumCPUs = 1;
+	}
+
+	cpu_set_t CPUSet;
+	CPU_ZERO(&CPUSet);
+	CPU_SET(Worker->WorkerID % NumCPUs, &CPUSet);
+	int ErrCode = pthread_setaffinity_np(pthread_self(), sizeof(CPUSet), &CPUSet);
+	if(ErrCode != 0){
+		LOG_ERR("Failed to pin worker %d to CPU %d: (%d) %s",
+				Worker->WorkerID, (Worker->WorkerID % NumCPUs),
+				ErrCode, strerrordesc_np(ErrCode));
+	}
+}
+
+static void *WorkerThread(void *Argument){
+	TWorker *Worker = (TWorker*)Argument;
+	if(g_Config.WorkerAffinity){
+		PinWorkerThread(Worker);
+	}
+
+	while(!__atomic_load_n(&g_StopWorkers, __ATOMIC_RELAXED)){
+		ProcessWorkerConnections(Worker);
+	}
+
+	return NULL;
+}
+
+static bool InitWorker(TWorker *Worker, int WorkerID, bool StatusOnly, int Listener){
+	Worker->WorkerID = WorkerID;
+	Worker->StatusOnly = StatusOnly;
+	Worker->LoopTime = GetClockMonotonicMS();
+	TimerWheelInit(&Worker->Timers, Worker->LoopTime);
+	Worker->Accepting = true;
+	Worker->AcceptPending = true;
+	if(!ApplyWorkerConfig(Worker)){
+		return false;
+	}
+
+	Worker->WakeFd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+	if(Worker->WakeFd == -1){
+		LOG_ERR("Failed to create wake event: (%d) %s", errno, strerrordesc_np(errno));
+		return false;
+	}
+
+	int Port = (StatusOnly ? g_Config.StatusPort : g_Config.LoginPort);
+	Worker->Listener = Listener;
+	if(Worker->Listener == -1){
+		Worker->Listener = ListenerBind((uint16)Port, (!StatusOnly && g_NumLoginWorkers > 1));
+	}
+
+	if(Worker->Listener == -1){
+		LOG_ERR("Failed to bind listener to port %d", Port);
+		return false;
+	}
+
+	if(g_UseIOUring){
+		if(!IOUringInit(&Worker->Ring, URING_ENTRIES)){
+			LOG_ERR("Failed to initialize io_uring");
+			return false;
+		}
+
+		if(!IOBufferRingInit(&Worker->Ring, &Worker->RingBuffers, URING_BUFFER_GROUP,
+				URING_BUFFER_COUNT, URING_BUFFER_SIZE)){
+			LOG_ERR("Failed to initialize io_uring buffer ring");
+			return false;
+		}
+
+		URingSubmitWake(Worker);
+	}else{
+		Worker->Epoll = epoll_create1(EPOLL_CLOEXEC);
+		if(Worker->Epoll == -1){
+			LOG_ERR("Failed to create epoll instance: (%d) %s", errno, strerrordesc_np(errno));
+			return false;
+		}
+
+		epoll_event Event = {};
+		Event.events = EPOLLIN | EPOLLET;
+		Event.data.u64 = EpollTag(Worker, EPOLL_TAG_LISTENER);
+		if(epoll_ctl(Worker->Epoll, EPOLL_CTL_ADD, Worker->Listener, &Event) == -1){
+			LOG_ERR("Failed to register listener: (%d) %s", errno, strerrordesc_np(errno));
+			return false;
+		}
+
+		Event.events = EPOLLIN | EPOLLET;
+		Event.data.u64 = EpollTag(Worker, EPOLL_TAG_WAKE);
+		if(epoll_ctl(Worker->Epoll, EPOLL_CTL_ADD, Worker->WakeFd, &Event) == -1){
+			LOG_ERR("Failed to register wake event: (%d) %s", errno, strerrordesc_np(errno));
+			return false;
+		}
+	}
+
+	// NOTE(fusion): Each worker has its own pool of query manager connections.
+	// We only need one of them to start, the others are retried later.
+	if(!InitQueryManagerPool(&Worker->QueryManagers, g_Config.QueryManagerConnections)){
+		return false;
+	}
+
+	TQueryManagerPool *Pool = &Worker->QueryManagers;
+	for(int i = 0; i < Pool->NumConnections; i += 1){
+		TQueryManagerConnection *QueryManager = &Pool->Connections[i];
+		if(!Connect(QueryManager) || !RegisterQueryManager(Worker, QueryManager)){
+			QueryManager->RetryTime = Worker->LoopTime + QUERY_MANAGER_RETRY_INTERVAL;
+		}
+	}
+
+	Worker->QueryManagerTimer.Callback = QueryManagerTimerExpired;
+	Worker->QueryManagerTimer.Data = Worker;
+
+	if(NumConnectedQueryManagers(Pool) == 0){
+		LOG_ERR("Worker %d failed to connect to query manager", WorkerID);
+		return false;
+	}
+
+	return true;
+}
+
+static void ExitWorker(TWorker *Worker){
+	ExitQueryManagerPool(&Worker->QueryManagers);
+
+	if(Worker->Listener != -1){
+		close(Worker->Listener);
+		Worker->Listener = -1;
+	}
+
+	if(Worker->Epoll != -1){
+		close(Worker->Epoll);
+		Worker->Epoll = -1;
+	}
+
+	if(Worker->Ring.Fd != -1){
+		IOUringExit(&Worker->Ring);
+		IOBufferRingExit(&Worker->RingBuffers);
+	}
+
+	if(Worker->WakeFd != -1){
+		close(Worker->WakeFd);
+		Worker->WakeFd = -1;
+	}
+
+	// NOTE(fusion): Closing the ring will have cancelled any in-flight operations,
+	// so sockets can be closed right away, along with their chunks.
+	if(Worker->Chunks != NULL){
+		for(int i = 0; i < Worker->MaxChunks; i += 1){
+			TConnectionChunk *Chunk = Worker->Chunks[i];
+			if(Chunk == NULL){
+				continue;
+			}
+
+			for(int j = 0; j < CONNECTION_CHUNK_SIZE; j += 1){
+				TConnection *Connection = &Chunk->Connections[j];
+				if(Connection->State != CONNECTION_FREE){
+					CloseConnection(Connection);
+					if(Connection->RingSocket != -1){
+						close(Connection->RingSocket);
+						Connection->RingSocket = -1;
+					}
+					ConnectionResetBuffer(Connection);
+				}
+			}
+
+			ChunkFree(Worker, Chunk);
+		}
+
+		free(Worker->Chunks);
+		Worker->Chunks = NULL;
+	}
+
+	BufferPoolExit(&Worker->BufferPool);
+}
+
+// Listener Handoff
+//==============================================================================
+// NOTE(fusion): To restart without refusing connections, a new process can take
+// over the listeners of a running one. The running process keeps a Unix socket
+// at `HandoffPath` and, when the new process connects, sends it all listeners
+// with SCM_RIGHTS. Once the new process reports it's ready, the old one stops
+// accepting and drains its remaining connections for up to
+// `HandoffDrainTimeout`. Listeners are never closed in the process, so nothing
+// in their backlogs is lost.
+//  Inherited listeners keep the options set by the old process, and extra
+// workers will only be able to join them with `SO_REUSEPORT` if the old process
+// was also running with more than one worker.
+static const int HANDOFF_MAX_LISTENERS = 253; // SCM_MAX_FD
+
+static bool HandoffSendListeners(int Socket){
+	int Listeners[HANDOFF_MAX_LISTENERS];
+	int NumListeners = 0;
+	for(int i = 0; i < g_NumWorkers && NumListeners < HANDOFF_MAX_LISTENERS; i += 1){
+		if(g_Workers[i].Listener != -1){
+			Listeners[NumListeners] = g_Workers[i].Listener;
+			NumListeners += 1;
+		}
+	}
+
+	uint8 Payload = (uint8)NumListeners;
+	iovec IOVec = {};
+	IOVec.iov_base = &Payload;
+	IOVec.iov_len = sizeof(Payload);
+
+	alignas(cmsghdr) uint8 Control[CMSG_SPACE(sizeof(Listeners))] = {};
+	msghdr Message = {};
+	Message.msg_iov = &IOVec;
+	Message.msg_iovlen = 1;
+	Message.msg_control = Control;
+	Message.msg_controllen = CMSG_SPACE(NumListeners * sizeof(int));
+
+	cmsghdr *Header = CMSG_FIRSTHDR(&Message);
+	Header->cmsg_level = SOL_SOCKET;
+	Header->cmsg_type = SCM_RIGHTS;
+	Header->cmsg_len = CMSG_LEN(NumListeners * sizeof(int));
+	memcpy(CMSG_DATA(Header), Listeners, NumListeners * sizeof(int));
+	if(sendmsg(Socket, &Message, MSG_NOSIGNAL) == -1){
+		LOG_ERR("Failed to send listeners: (%d) %s", errno, strerrordesc_np(errno));
+		return false;
+	}
+
+	LOG("Sent %d listeners, waiting for new process...", NumListeners);
+	return true;
+}
+
+static bool HandoffWaitReady(int Socket){
+	// NOTE(fusion): The new process only reports it's ready after initializing
+	// its workers. If it fails before that, we keep running as if nothing had
+	// happened. Shutting down the handoff socket also interrupts the wait.
+	pollfd Fds[2] = {};
+	Fds[0].fd = Socket;
+	Fds[0].events = POLLIN;
+	Fds[1].fd = g_HandoffSocket;
+	Fds[1].events = POLLIN;
+	while(poll(Fds, NARRAY(Fds), -1) == -1){
+		if(errno != EINTR){
+			LOG_ERR("Failed to wait for new process: (%d) %s", errno, strerrordesc_np(errno));
+			return false;
+		}
+	}
+
+	uint8 Ready = 0;
+	return (Fds[0].revents & POLLIN) != 0
+		&& read(Socket, &Ready, sizeof(Ready)) == sizeof(Ready)
+		&& Ready == 1;
+}
+
+static void *HandoffThread(void *Argument){
+	(void)Argument;
+	while(true){
+		int Socket = accept4(g_HandoffSocket, NULL, NULL, SOCK_CLOEXEC);
+		if(Socket == -1){
+			if(errno == EINTR || errno == ECONNABORTED){
+				continue;
+			}
+			break;
+		}
+
+		// NOTE(fusion): The socket permissions should already keep other users
+		// out, but we also check the peer in case they were changed.
+		ucred Peer = {};
+		socklen_t PeerLen = sizeof(Peer);
+		if(getsockopt(Socket, SOL_SOCKET, SO_PEERCRED, &Peer, &PeerLen) == -1){
+			LOG_ERR("Failed to get handoff peer credentials: (%d) %s",
+					errno, strerrordesc_np(errno));
+			close(Socket);
+			continue;
+		}else if(Peer.uid != geteuid()){
+			LOG_WARN("Refusing listener handoff to process %d of user %d",
+					(int)Peer.pid, (int)Peer.uid);
+			close(Socket);
+			continue;
+		}
+
+		LOG("Handing off listeners...");
+		bool Done = HandoffSendListeners(Socket) && HandoffWaitReady(Socket);
+		close(Socket);
+		if(Done){
+			__atomic_store_n(&g_HandedOff, 1, __ATOMIC_RELEASE);
+			WakeWorker(&g_Workers[0]);
+			break;
+		}
+
+		LOG_WARN("Listener handoff aborted");
+	}
+
+	return NULL;
+}
+
+static bool HandoffListen(void){
+	sockaddr_un Addr = {};
+	Addr.sun_family = AF_UNIX;
+	if(strlen(g_Config.HandoffPath) >= sizeof(Addr.sun_path)){
+		LOG_ERR("Handoff path \"%s\" is too long", g_Config.HandoffPath);
+		return false;
+	}
+	StringBufCopy(Addr.sun_path, g_Config.HandoffPath);
+
+	g_HandoffSocket = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+	if(g_HandoffSocket == -1){
+		LOG_ERR("Failed to create handoff socket: (%d) %s", errno, strerrordesc_np(errno));
+		return false;
+	}
+
+	// NOTE(fusion): Any existing socket is either stale or belongs to the
+	// process we took over from, which no longer needs it.
+	//  Whoever connects gets our listeners, so the socket must be created with
+	// owner only permissions rather than fixed up after `bind`, which would
+	// leave a window where anyone could connect. Changing the umask affects the
+	// whole process, but workers don't create any files.
+	unlink(g_Config.HandoffPath);
+	mode_t OldMask = umask(0077);
+	int BindResult = bind(g_HandoffSocket, (sockaddr*)&Addr, sizeof(Addr));
+	int BindError = errno;
+	umask(OldMask);
+	if(BindResult == -1){
+		LOG_ERR("Failed to bind handoff socket to \"%s\": (%d) %s",
+				g_Config.HandoffPath, BindError, strerrordesc_np(BindError));
+		close(g_HandoffSocket);
+		g_HandoffSocket = -1;
+		return false;
+	}
+
+	if(listen(g_HandoffSocket, 1) == -1){
+		LOG_ERR("Failed to listen on handoff socket: (%d) %s", errno, strerrordesc_np(errno));
+		close(g_HandoffSocket);
+		g_HandoffSocket = -1;
+		return false;
+	}
+
+	return true;
+}
+
+static int HandoffReceiveListeners(int *Listeners, int MaxListeners){
+	sockaddr_un Addr = {};
+	Addr.sun_family = AF_UNIX;
+	if(strlen(g_Config.HandoffPath) >= sizeof(Addr.sun_path)){
+		return 0;
+	}
+	StringBufCopy(Addr.sun_path, g_Config.HandoffPath);
+
+	int Socket = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+	if(Socket == -1){
+		LOG_ERR("Failed to create handoff socket: (%d) %s", errno, strerrordesc_np(errno));
+		return 0;
+	}
+
+	if(connect(Socket, (sockaddr*)&Addr, sizeof(Addr)) == -1){
+		if(errno != ENOENT && errno != ECONNREFUSED){
+			LOG_ERR("Failed to connect to handoff socket: (%d) %s",
+					errno, strerrordesc_np(errno));
+		}
+		close(Socket);
+		return 0;
+	}
+
+	timeval Timeout = {};
+	Timeout.tv_sec = 5;
+	if(setsockopt(Socket, SOL_SOCKET, SO_RCVTIMEO, &Timeout, sizeof(Timeout)) == -1){
+		LOG_ERR("Failed to set SO_RCVTIMEO: (%d) %s", errno, strerrordesc_np(errno));
+	}
+
+	uint8 Payload = 0;
+	iovec IOVec = {};
+	IOVec.iov_base = &Payload;
+	IOVec.iov_len = sizeof(Payload);
+
+	alignas(cmsghdr) uint8 Control[CMSG_SPACE(HANDOFF_MAX_LISTENERS * sizeof(int))] = {};
+	msghdr Message = {};
+	Message.msg_iov = &IOVec;
+	Message.msg_iovlen = 1;
+	Message.msg_control = Control;
+	Message.msg_controllen = sizeof(Control);
+	if(recvmsg(Socket, &Message, MSG_CMSG_CLOEXEC) <= 0){
+		LOG_ERR("Failed to receive listeners: (%d) %s", errno, strerrordesc_np(errno));
+		close(Socket);
+		return 0;
+	}
+
+	int NumListeners = 0;
+	for(cmsghdr *Header = CMSG_FIRSTHDR(&Message);
+			Header != NULL;
+			Header = CMSG_NXTHDR(&Message, Header)){
+		if(Header->cmsg_level != SOL_SOCKET || Header->cmsg_type != SCM_RIGHTS){
+			continue;
+		}
+
+		int Count = (int)((Header->cmsg_len - CMSG_LEN(0)) / sizeof(int));
+		for(int i = 0; i < Count; i += 1){
+			int Listener;
+			memcpy(&Listener, CMSG_DATA(Header) + i * sizeof(int), sizeof(int));
+			if(NumListeners < MaxListeners){
+				Listeners[NumListeners] = Listener;
+				NumListeners += 1;
+			}else{
+				close(Listener);
+			}
+		}
+	}
+
+	// NOTE(fusion): Keep the connection open until we're ready to accept, so
+	// the old process knows when to stop.
+	g_HandoffPeer = Socket;
+	LOG("Received %d listeners from running process", NumListeners);
+	return NumListeners;
+}
+
+static void HandoffReady(void){
+	if(g_HandoffPeer != -1){
+		uint8 Ready = 1;
+		if(write(g_HandoffPeer, &Ready, sizeof(Ready)) == -1){
+			LOG_ERR("Failed to report handoff ready: (%d) %s", errno, strerrordesc_np(errno));
+		}
+		close(g_HandoffPeer);
+		g_HandoffPeer = -1;
+	}
+}
+
+static int TakeInheritedListener(int *Listeners, int *NumListeners, int Port){
+	for(int i = 0; i < *NumListeners; i += 1){
+		sockaddr_in Addr = {};
+		socklen_t AddrLen = sizeof(Addr);
+		if(getsockname(Listeners[i], (sockaddr*)&Addr, &AddrLen) == 0
+				&& Addr.sin_family == AF_INET && ntohs(Addr.sin_port) == Port){
+			int Listener = Listeners[i];
+			*NumListeners -= 1;
+			Listeners[i] = Listeners[*NumListeners];
+			return Listener;
+		}
+	}
+
+	return -1;
+}
+
+void WakeConnections(void){
+	// NOTE(fusion): This is called from signal handlers so it needs to be
+	// async-signal-safe, which rules out logging.
+	int WakeFd = g_MainWakeFd;
+	if(WakeFd != -1){
+		uint64 WakeValue = 1;
+		if(write(WakeFd, &WakeValue, sizeof(WakeValue)) == -1){
+			// no-op
+		}
+	}
+}
+
+bool ConnectionsHandedOff(void){
+	return __atomic_load_n(&g_HandedOff, __ATOMIC_ACQUIRE) != 0;
+}
+
+static void DrainTimedOut(TTimer *Timer){
+	(void)Timer;
+	g_DrainTimedOut = true;
+}
+
+void DrainConnections(void){
+	ASSERT(g_Workers != NULL && g_NumWorkers > 0);
+	__atomic_store_n(&g_DrainWorkers, 1, __ATOMIC_RELEASE);
+	for(int i = 1; i < g_NumWorkers; i += 1){
+		WakeWorker(&g_Workers[i]);
+	}
+
+	TWorker *Worker = &g_Workers[0];
+	g_DrainTimedOut = false;
+	if(g_Config.HandoffDrainTimeout > 0){
+		g_DrainTimer.Callback = DrainTimedOut;
+		TimerStart(&Worker->Timers, &g_DrainTimer,
+				Worker->LoopTime + g_Config.HandoffDrainTimeout);
+	}
+}
+
+bool ConnectionsDrained(void){
+	int NumDrained = 0;
+	int NumConnections = 0;
+	for(int i = 0; i < g_NumWorkers; i += 1){
+		if(__atomic_load_n(&g_Workers[i].Drained, __ATOMIC_ACQUIRE)){
+			NumDrained += 1;
+		}else{
+			NumConnections += __atomic_load_n(&g_Workers[i].NumConnections, __ATOMIC_RELAXED);
+		}
+	}
+
+	if(NumDrained == g_NumWorkers){
+		LOG("All connections drained");
+		TimerStop(&g_Workers[0].Timers, &g_DrainTimer);
+		return true;
+	}else if(g_DrainTimedOut){
+		LOG_WARN("Drain timed out with %d connections left", NumConnections);
+		return true;
+	}
+
+	return false;
+}
+
+void ProcessConnections(void){
+	ASSERT(g_Workers != NULL && g_NumWorkers > 0);
+	ProcessWorkerConnections(&g_Workers[0]);
+}
+
+static bool ParseTeardownMode(const char *String, int *OutMode){
+	if(StringEqCI(String, "close")){
+		*OutMode = TEARDOWN_CLOSE;
+	}else if(StringEqCI(String, "shutdown")){
+		*OutMode = TEARDOWN_SHUTDOWN;
+	}else if(StringEqCI(String, "passive")){
+		*OutMode = TEARDOWN_PASSIVE;
+	}else{
+		LOG_ERR("Invalid teardown mode \"%s\" (expected \"close\", \"shutdown\" or \"passive\")",
+				String);
+		return false;
+	}
+	return true;
+}
+
+static int CompareStatusRecords(const void *A, const void *B){
+	// NOTE(fusion): Most recent first.
+	int TimestampA = ((const TStatusRecord*)A)->Timestamp;
+	int TimestampB = ((const TStatusRecord*)B)->Timestamp;
+	return (TimestampA < TimestampB) - (TimestampA > TimestampB);
+}
+
+static bool ResizeStatusRecords(int MaxStatusRecords){
+	bool Result = true;
+	pthread_mutex_lock(&g_StatusRecordsMutex);
+	if(MaxStatusRecords != g_MaxStatusRecords){
+		// NOTE(fusion): Keep the most recent records when shrinking, which are
+		// the ones that still matter for `MinStatusInterval`.
+		if(MaxStatusRecords < g_MaxStatusRecords){
+			qsort(g_StatusRecords, g_MaxStatusRecords,
+					sizeof(TStatusRecord), CompareStatusRecords);
+		}
+
+		TStatusRecord *StatusRecords = (TStatusRecord*)realloc(
+				g_StatusRecords, MaxStatusRecords * sizeof(TStatusRecord));
+		if(StatusRecords == NULL){
+			LOG_ERR("Failed to resize status records to %d", MaxStatusRecords);
+			Result = false;
+		}else{
+			if(MaxStatusRecords > g_MaxStatusRecords){
+				memset(StatusRecords + g_MaxStatusRecords, 0,
+						(MaxStatusRecords - g_MaxStatusRecords) * sizeof(TStatusRecord));
+			}
+			g_StatusRecords = StatusRecords;
+			g_MaxStatusRecords = MaxStatusRecords;
+		}
+	}
+	pthread_mutex_unlock(&g_StatusRecordsMutex);
+	return Result;
+}
+
+// NOTE(fusion): Query manager settings that can be reloaded, checked the same
+// way on startup and on reload.
+static bool CheckQueryManagerConfig(const TConfig *Config){
+	if(Config->QueryManagerPipelineDepth <= 0
+			|| Config->QueryManagerPipelineDepth > QUERY_MAX_PIPELINE_DEPTH){
+		LOG_ERR("Invalid query manager pipeline depth %d (Max: %d)",
+				Config->QueryManagerPipelineDepth, QUERY_MAX_PIPELINE_DEPTH);
+		return false;
+	}
+
+	if(Config->QueryManagerConnectTimeout <= 0){
+		LOG_ERR("Invalid query manager connect timeout %d", Config->QueryManagerConnectTimeout);
+		return false;
+	}
+
+	if(Config->QueryManagerQueryTimeout <= 0){
+		LOG_ERR("Invalid query manager query timeout %d", Config->QueryManagerQueryTimeout);
+		return false;
+	}
+
+	if(Config->QueryManagerBreakerThreshold < 0){
+		LOG_ERR("Invalid query manager breaker threshold %d", Config->QueryManagerBreakerThreshold);
+		return false;
+	}
+
+	if(Config->QueryManagerBreakerMaxBackoff < QUERY_MANAGER_RETRY_INTERVAL){
+		LOG_ERR("Invalid query manager breaker max backoff %d (Min: %d)",
+				Config->QueryManagerBreakerMaxBackoff, QUERY_MANAGER_RETRY_INTERVAL);
+		return false;
+	}
+
+	if(Config->QueryManagerBatchSize < 0
+			|| Config->QueryManagerBatchSize > QUERY_MAX_BATCH_SIZE){
+		LOG_ERR("Invalid query manager batch size %d (Max: %d)",
+				Config->QueryManagerBatchSize, QUERY_MAX_BATCH_SIZE);
+		return false;
+	}
+
+	return true;
+}
+
+bool ReloadConnections(const TConfig *Config){
+	ASSERT(g_Workers != NULL && g_ConfigLockInit);
+	int TeardownMode;
+	if(!ParseTeardownMode(Config->TeardownMode, &TeardownMode)){
+		return false;
+	}
 
-static void CheckConnectionRequest(TConnection *Connection){
-	if(Connection->Socket == -1){
-		return;
+	if(Config->MaxConnections <= 0
+			|| (Config->StatusPort > 0 && Config->StatusMaxConnections <= 0)){
+		LOG_ERR("Invalid connection limits (MaxConnections: %d, StatusMaxConnections: %d)",
+				Config->MaxConnections, Config->StatusMaxConnections);
+		return false;
 	}
 
-	if(Connection->State != CONNECTION_PROCESSING){
-		return;
+	if(Config->MaxStatusRecords <= 0){
+		LOG_ERR("Invalid status record limit %d", Config->MaxStatusRecords);
+		return false;
 	}
 
-	// PARANOID(fusion): A non-empty payload is guaranteed, due to how we parse
-	// input in `CheckConnectionInput` just above.
-	ASSERT(Connection->RWSize > 0);
+	if(!CheckQueryManagerConfig(Config)){
+		return false;
+	}
 
-	int Command = Connection->Buffer[0];
-	if(Command == 1){
-		ProcessLoginRequest(Connection);
-	}else if(Command == 255){
-		ProcessStatusRequest(Connection);
-	}else{
-		LOG_ERR("Invalid command %d from %s (expected 1 or 255)",
-				Command, Connection->RemoteAddress);
-		CloseConnection(Connection);
+	// NOTE(fusion): Workers re-apply their own settings, including resizing
+	// their connection tables, when they see the new generation. We're always
+	// called from the main thread, between iterations of the first worker, so
+	// we're not holding the lock for reading here.
+	pthread_rwlock_wrlock(&g_ConfigLock);
+	g_Config = *Config;
+	g_TeardownMode = TeardownMode;
+	g_ConfigGeneration += 1;
+	ResizeStatusRecords(g_Config.MaxStatusRecords);
+	pthread_rwlock_unlock(&g_ConfigLock);
+
+	for(int i = 1; i < g_NumWorkers; i += 1){
+		WakeWorker(&g_Workers[i]);
 	}
+
+	return true;
 }
 
-static void CheckConnectionOutput(TConnection *Connection, int Events){
-	// NOTE(fusion): We're only polling `POLLOUT` when the connection is WRITING,
-	// but we want to allow requests to complete in a single cycle, so we always
-	// check for output if the connection is WRITING.
-	(void)Events;
+bool InitConnections(void){
+	ASSERT(g_PrivateKey == NULL);
+	ASSERT(g_Workers == NULL);
+	ASSERT(g_StatusRecords == NULL);
 
-	if(Connection->Socket == -1){
-		return;
+	g_PrivateKey = RSALoadPEM("tibia.pem");
+	if(g_PrivateKey == NULL){
+		LOG_ERR("Failed to load RSA key");
+		return false;
 	}
 
-	if(Connection->State != CONNECTION_WRITING){
-		return;
+	if(StringEqCI(g_Config.IOEngine, "io_uring")){
+		g_UseIOUring = true;
+	}else if(StringEqCI(g_Config.IOEngine, "epoll")){
+		g_UseIOUring = false;
+	}else{
+		LOG_ERR("Invalid IO engine \"%s\" (expected \"epoll\" or \"io_uring\")",
+				g_Config.IOEngine);
+		return false;
 	}
 
-	while(true){
-		int BytesWritten = (int)write(Connection->Socket,
-				(Connection->Buffer + Connection->RWPosition),
-				(Connection->RWSize - Connection->RWPosition));
-		if(BytesWritten == -1){
-			if(errno != EAGAIN){
-				CloseConnection(Connection);
-			}
-			break;
-		}
+	if(!ParseTeardownMode(g_Config.TeardownMode, &g_TeardownMode)){
+		return false;
+	}
 
-		Connection->RWPosition += BytesWritten;
-		if(Connection->RWPosition >= Connection->RWSize){
-			CloseConnection(Connection);
-			break;
+	g_NumLoginWorkers = g_Config.Workers;
+	if(g_NumLoginWorkers <= 0){
+		g_NumLoginWorkers = (int)sysconf(_SC_NPROCESSORS_ONLN);
+		if(g_NumLoginWorkers <= 0){
+			g_NumLoginWorkers = 1;
 		}
 	}
-}
 
-static void CheckConnection(TConnection *Connection, int Events){
-	ASSERT((Events & POLLNVAL) == 0);
+	if(g_Config.QueryManagerConnections <= 0){
+		LOG_ERR("Invalid query manager connection count %d",
+				g_Config.QueryManagerConnections);
+		return false;
+	}
 
-	if((Events & (POLLERR | POLLHUP)) != 0){
-		CloseConnection(Connection);
+	if(!CheckQueryManagerConfig(&g_Config)){
+		return false;
 	}
 
-	if(g_Config.ConnectionTimeout > 0){
-		int ElapsedTime = GetMonotonicUptime() - Connection->StartTime;
-		if(ElapsedTime >= g_Config.ConnectionTimeout){
-			LOG_WARN("Connection %s TIMEDOUT (ElapsedTime: %ds, Timeout: %ds)",
-					Connection->RemoteAddress, ElapsedTime, g_Config.ConnectionTimeout);
-			CloseConnection(Connection);
+	// NOTE(fusion): The status worker, if any, always comes after the login
+	// workers, so the first worker is still the one run by the main thread.
+	g_NumWorkers = g_NumLoginWorkers;
+	if(g_Config.StatusPort > 0){
+		if(g_Config.StatusPort == g_Config.LoginPort){
+			LOG_ERR("Status port must be different from login port (%d)",
+					g_Config.LoginPort);
+			return false;
+		}
+
+		if(g_Config.StatusMaxConnections <= 0){
+			LOG_ERR("Invalid status connection limit %d", g_Config.StatusMaxConnections);
+			return false;
 		}
+
+		g_NumWorkers += 1;
 	}
 
-	if(Connection->Socket == -1){
-		ReleaseConnection(Connection);
+	pthread_rwlockattr_t ConfigLockAttr;
+	pthread_rwlockattr_init(&ConfigLockAttr);
+	pthread_rwlockattr_setkind_np(&ConfigLockAttr,
+			PTHREAD_RWLOCK_PREFER_WRITER_NONRECURSIVE_NP);
+	pthread_rwlock_init(&g_ConfigLock, &ConfigLockAttr);
+	pthread_rwlockattr_destroy(&ConfigLockAttr);
+	g_ConfigLockInit = true;
+
+	g_MaxStatusRecords = g_Config.MaxStatusRecords;
+	g_StatusRecords = (TStatusRecord*)calloc(
+			g_MaxStatusRecords, sizeof(TStatusRecord));
+
+	if(!InitQueryManagerResolver()){
+		LOG_ERR("Failed to resolve query manager address");
+		return false;
 	}
-}
 
-static void AcceptConnections(int Events){
-	ASSERT(g_Listener != -1);
-	if((Events & POLLIN) == 0){
-		return;
+	g_Workers = (TWorker*)calloc(g_NumWorkers, sizeof(TWorker));
+	for(int i = 0; i < g_NumWorkers; i += 1){
+		g_Workers[i].Epoll = -1;
+		g_Workers[i].Listener = -1;
+		g_Workers[i].Ring.Fd = -1;
+		g_Workers[i].WakeFd = -1;
 	}
 
-	while(true){
-		uint32 Addr;
-		uint16 Port;
-		int Socket = ListenerAccept(g_Listener, &Addr, &Port);
-		if(Socket == -1){
-			break;
-		}
+	int Inherited[HANDOFF_MAX_LISTENERS];
+	int NumInherited = 0;
+	if(g_Config.HandoffPath[0] != 0){
+		NumInherited = HandoffReceiveListeners(Inherited, NARRAY(Inherited));
+	}
 
-		if(AssignConnection(Socket, Addr, Port) == NULL){
-			LOG_ERR("Rejecting connection %08X:%d:"
-					" max number of connections reached (%d)",
-					Addr, Port, g_Config.MaxConnections);
-			close(Socket);
+	for(int i = 0; i < g_NumWorkers; i += 1){
+		bool StatusOnly = (i >= g_NumLoginWorkers);
+		int Port = (StatusOnly ? g_Config.StatusPort : g_Config.LoginPort);
+		int Listener = TakeInheritedListener(Inherited, &NumInherited, Port);
+		if(!InitWorker(&g_Workers[i], i, StatusOnly, Listener)){
+			LOG_ERR("Failed to initialize worker %d", i);
+			return false;
 		}
 	}
-}
-
-void ProcessConnections(void){
-	int NumFds = 0;
-	int MaxFds = g_MaxConnections + 1;
-	pollfd *Fds = (pollfd*)alloca(MaxFds * sizeof(pollfd));
-	int *ConnectionIndices = (int*)alloca(MaxFds * sizeof(int));
 
-	if(g_Listener != -1){
-		Fds[NumFds].fd = g_Listener;
-		Fds[NumFds].events = POLLIN;
-		Fds[NumFds].revents = 0;
-		ConnectionIndices[NumFds] = -1;
-		NumFds += 1;
+	for(int i = 0; i < NumInherited; i += 1){
+		LOG_WARN("Closing unused inherited listener");
+		close(Inherited[i]);
 	}
 
-	for(int i = 0; i < g_Config.MaxConnections; i += 1){
-		if(g_Connections[i].State == CONNECTION_FREE){
-			continue;
+	g_MainWakeFd = g_Workers[0].WakeFd;
+
+	if(g_NumLoginWorkers > 1 && g_Config.ReusePortSteering){
+		if(!ListenerAttachSteering(g_Workers[0].Listener, g_NumLoginWorkers)){
+			LOG_ERR("Failed to attach listener steering program");
+			return false;
 		}
+	}
+
+	if(g_Config.WorkerAffinity){
+		PinWorkerThread(&g_Workers[0]);
+	}
 
-		Fds[NumFds].fd = g_Connections[i].Socket;
-		Fds[NumFds].events = POLLIN;
-		if(g_Connections[i].State == CONNECTION_WRITING){
-			Fds[NumFds].events |= POLLOUT;
+	// NOTE(fusion): Signals should only be handled by the main thread, which
+	// new threads inherit the mask from.
+	sigset_t SignalSet, OldSignalSet;
+	sigfillset(&SignalSet);
+	pthread_sigmask(SIG_BLOCK, &SignalSet, &OldSignalSet);
+	for(int i = 1; i < g_NumWorkers; i += 1){
+		TWorker *Worker = &g_Workers[i];
+		int ErrCode = pthread_create(&Worker->Thread, NULL, WorkerThread, Worker);
+		if(ErrCode != 0){
+			LOG_ERR("Failed to start worker %d: (%d) %s",
+					i, ErrCode, strerrordesc_np(ErrCode));
+			break;
 		}
-		Fds[NumFds].revents = 0;
-		ConnectionIndices[NumFds] = i;
-		NumFds += 1;
+		Worker->ThreadStarted = true;
 	}
+	pthread_sigmask(SIG_SETMASK, &OldSignalSet, NULL);
 
-	// NOTE(fusion): Block for 1 second at most, so we can properly timeout
-	// idle connections.
-	ASSERT(NumFds > 0);
-	int NumEvents = poll(Fds, NumFds, 1000);
-	if(NumEvents == -1){
-		if(errno != ETIMEDOUT && errno != EINTR){
-			LOG_ERR("Failed to poll connections: (%d) %s",
-					errno, strerrordesc_np(errno));
+	for(int i = 1; i < g_NumWorkers; i += 1){
+		if(!g_Workers[i].ThreadStarted){
+			return false;
 		}
-		return;
 	}
 
-	// NOTE(fusion): Process connections.
-	for(int i = 0; i < NumFds; i += 1){
-		int Index = ConnectionIndices[i];
-		int Events = (int)Fds[i].revents;
-		if(Index >= 0 && Index < g_Config.MaxConnections){
-			TConnection *Connection = &g_Connections[Index];
-			CheckConnectionInput(Connection, Events);
-			CheckConnectionRequest(Connection);
-			CheckConnectionOutput(Connection, Events);
-			CheckConnection(Connection, Events);
-		}else if(Index == -1 && Fds[i].fd == g_Listener){
-			AcceptConnections(Events);
+	// NOTE(fusion): The handoff socket isn't essential, so failing to set it up
+	// won't prevent us from running, and we still need to report ready to the
+	// process we took over from, if any.
+	if(g_Config.HandoffPath[0] != 0){
+		if(HandoffListen()){
+			pthread_sigmask(SIG_BLOCK, &SignalSet, &OldSignalSet);
+			int ErrCode = pthread_create(&g_HandoffThread, NULL, HandoffThread, NULL);
+			pthread_sigmask(SIG_SETMASK, &OldSignalSet, NULL);
+			if(ErrCode != 0){
+				LOG_ERR("Failed to start handoff thread: (%d) %s",
+						ErrCode, strerrordesc_np(ErrCode));
+			}else{
+				g_HandoffThreadStarted = true;
+			}
 		}else{
-			LOG_ERR("Unknown connection index %d", Index);
+			LOG_ERR("Listener handoff is disabled");
 		}
 	}
-}
 
-bool InitConnections(void){
-	ASSERT(g_PrivateKey == NULL);
-	ASSERT(g_Listener == -1);
-	ASSERT(g_Connections == NULL);
-	ASSERT(g_StatusRecords == NULL);
+	HandoffReady();
+	return true;
+}
 
-	g_PrivateKey = RSALoadPEM("tibia.pem");
-	if(g_PrivateKey == NULL){
-		LOG_ERR("Failed to load RSA key");
-		return false;
+void ExitConnections(void){
+	if(g_HandoffThreadStarted){
+		shutdown(g_HandoffSocket, SHUT_RDWR);
+		pthread_join(g_HandoffThread, NULL);
+		g_HandoffThreadStarted = false;
 	}
 
-	g_Listener = ListenerBind((uint16)g_Config.LoginPort);
-	if(g_Listener == -1){
-		LOG_ERR("Failed to bind listener to port %d", g_Config.LoginPort);
-		return false;
+	if(g_HandoffSocket != -1){
+		// NOTE(fusion): After a handoff, the socket path belongs to the new
+		// process.
+		close(g_HandoffSocket);
+		g_HandoffSocket = -1;
+		if(!ConnectionsHandedOff()){
+			unlink(g_Config.HandoffPath);
+		}
 	}
 
-	g_MaxConnections = g_Config.MaxConnections;
-	g_Connections = (TConnection*)calloc(
-			g_MaxConnections, sizeof(TConnection));
-	for(int i = 0; i < g_MaxConnections; i += 1){
-		g_Connections[i].State = CONNECTION_FREE;
+	if(g_HandoffPeer != -1){
+		close(g_HandoffPeer);
+		g_HandoffPeer = -1;
 	}
 
-	g_MaxStatusRecords = g_Config.MaxStatusRecords;
-	g_StatusRecords = (TStatusRecord*)calloc(
-			g_MaxStatusRecords, sizeof(TStatusRecord));
+	g_MainWakeFd = -1;
+	if(g_Workers != NULL){
+		__atomic_store_n(&g_StopWorkers, 1, __ATOMIC_RELAXED);
+		for(int i = 0; i < g_NumWorkers; i += 1){
+			if(g_Workers[i].ThreadStarted){
+				WakeWorker(&g_Workers[i]);
+			}
+		}
 
-	return true;
-}
+		for(int i = 0; i < g_NumWorkers; i += 1){
+			if(g_Workers[i].ThreadStarted){
+				pthread_join(g_Workers[i].Thread, NULL);
+				g_Workers[i].ThreadStarted = false;
+			}
+		}
 
-void ExitConnections(void){
-	if(g_PrivateKey != NULL){
-		RSAFree(g_PrivateKey);
-		g_PrivateKey = NULL;
-	}
+		for(int i = 0; i < g_NumWorkers; i += 1){
+			ExitWorker(&g_Workers[i]);
+		}
 
-	if(g_Listener != -1){
-		close(g_Listener);
-		g_Listener = -1;
+		free(g_Workers);
+		g_Workers = NULL;
 	}
 
-	if(g_Connections != NULL){
-		for(int i = 0; i < g_MaxConnections; i += 1){
-			ReleaseConnection(&g_Connections[i]);
-		}
+	ExitQueryManagerResolver();
 
-		free(g_Connections);
-		g_Connections = NULL;
+	if(g_PrivateKey != NULL){
+		RSAFree(g_PrivateKey);
+		g_PrivateKey = NULL;
 	}
 
 	if(g_StatusRecords != NULL){
 		free(g_StatusRecords);
 		g_StatusRecords = NULL;
 	}
+
+	if(g_ConfigLockInit){
+		pthread_rwlock_destroy(&g_ConfigLock);
+		g_ConfigLockInit = false;
+	}
 }
 
 // Login Request
 //==============================================================================
-static TWriteBuffer PrepareXTEAResponse(TConnection *Connection){
+static TWriteBuffer PrepareXTEAResponse(TConnection *Connection, int MaxPayloadSize){
 	if(Connection->State != CONNECTION_PROCESSING){
 		LOG_ERR("Connection %s is not PROCESSING (State: %d)",
-				Connection->RemoteAddress, Connection->State);
+				Connection->Data->RemoteAddress, Connection->State);
 		CloseConnection(Connection);
 		return TWriteBuffer(NULL, 0);
 	}
 
-	TWriteBuffer WriteBuffer(Connection->Buffer, sizeof(Connection->Buffer));
+	// NOTE(fusion): Reserve space for both headers and the XTEA padding.
+	if(!ConnectionReserveBuffer(Connection, MaxPayloadSize + 4 + 7)){
+		CloseConnection(Connection);
+		return TWriteBuffer(NULL, 0);
+	}
+
+	TWriteBuffer WriteBuffer(Connection->Data->Buffer, Connection->Data->BufferSize);
 	WriteBuffer.Write16(0); // Encrypted Size
 	WriteBuffer.Write16(0); // Data Size
 	return WriteBuffer;
 }
 
 static void SendXTEAResponse(TConnection *Connection, TWriteBuffer *WriteBuffer){
+	if(Connection->Socket == -1){
+		return;
+	}
+
 	if(Connection->State != CONNECTION_PROCESSING){
 		LOG_ERR("Connection %s is not PROCESSING (State: %d)",
-				Connection->RemoteAddress, Connection->State);
+				Connection->Data->RemoteAddress, Connection->State);
 		CloseConnection(Connection);
 		return;
 	}
 
 	ASSERT(WriteBuffer != NULL
-		&& WriteBuffer->Buffer == Connection->Buffer
-		&& WriteBuffer->Size == sizeof(Connection->Buffer)
+		&& WriteBuffer->Buffer == Connection->Data->Buffer
+		&& WriteBuffer->Size == Connection->Data->BufferSize
 		&& WriteBuffer->Position > 4);
 
 	int DataSize = WriteBuffer->Position - 4;
 	int EncryptedSize = WriteBuffer->Position - 2;
 	while((EncryptedSize % 8) != 0){
-		WriteBuffer->Write8(rand_r(&Connection->RandomSeed));
+		WriteBuffer->Write8(rand_r(&Connection->Data->RandomSeed));
 		EncryptedSize += 1;
 	}
 
 	if(WriteBuffer->Overflowed()){
 		LOG_ERR("Write buffer overflowed when writing response to %s",
-				Connection->RemoteAddress);
+				Connection->Data->RemoteAddress);
 		CloseConnection(Connection);
 		return;
 	}
 
 	WriteBuffer->Rewrite16(0, EncryptedSize);
 	WriteBuffer->Rewrite16(2, DataSize);
-	XTEAEncrypt(Connection->XTEA,
+	XTEAEncrypt(Connection->Data->XTEA,
 			WriteBuffer->Buffer + 2,
 			WriteBuffer->Position - 2);
 	Connection->State = CONNECTION_WRITING;
@@ -477,7 +3014,8 @@ static void SendXTEAResponse(TConnection *Connection, TWriteBuffer *WriteBuffer)
 }
 
 static void SendLoginError(TConnection *Connection, const char *Message){
-	TWriteBuffer WriteBuffer = PrepareXTEAResponse(Connection);
+	int MaxPayloadSize = 1 + 2 + (int)strlen(Message);
+	TWriteBuffer WriteBuffer = PrepareXTEAResponse(Connection, MaxPayloadSize);
 	WriteBuffer.Write8(10); // LOGIN_ERROR
 	WriteBuffer.WriteString(Message);
 	SendXTEAResponse(Connection, &WriteBuffer);
@@ -485,17 +3023,25 @@ static void SendLoginError(TConnection *Connection, const char *Message){
 
 static void SendCharacterList(TConnection *Connection, int NumCharacters,
 		TCharacterLoginData *Characters, int PremiumDays){
-	TWriteBuffer WriteBuffer = PrepareXTEAResponse(Connection);
+	if(NumCharacters > UINT8_MAX){
+		NumCharacters = UINT8_MAX;
+	}
+
+	// NOTE(fusion): Strings are sized by their UTF-8 length, which is never
+	// smaller than what is actually written.
+	int MaxPayloadSize = 3 + (int)strlen(g_Config.Motd) + 2 + 2;
+	for(int i = 0; i < NumCharacters; i += 1){
+		MaxPayloadSize += 2 + (int)strlen(Characters[i].Name)
+				+ 2 + (int)strlen(Characters[i].WorldName) + 6;
+	}
 
+	TWriteBuffer WriteBuffer = PrepareXTEAResponse(Connection, MaxPayloadSize);
 	if(g_Config.Motd[0] != 0){
 		WriteBuffer.Write8(20); // MOTD
 		WriteBuffer.WriteString(g_Config.Motd);
 	}
 
 	WriteBuffer.Write8(100); // CHARACTER_LIST
-	if(NumCharacters > UINT8_MAX){
-		NumCharacters = UINT8_MAX;
-	}
 	WriteBuffer.Write8(NumCharacters);
 	for(int i = 0; i < NumCharacters; i += 1){
 		WriteBuffer.WriteString(Characters[i].Name);
@@ -508,15 +3054,73 @@ static void SendCharacterList(TConnection *Connection, int NumCharacters,
 	SendXTEAResponse(Connection, &WriteBuffer);
 }
 
+static void SendLoginResult(TConnection *Connection, int LoginCode,
+		int NumCharacters, TCharacterLoginData *Characters, int PremiumDays){
+	switch(LoginCode){
+		case 0:{
+			SendCharacterList(Connection, NumCharacters, Characters, PremiumDays);
+			break;
+		}
+
+		case 1:		// Invalid account number
+		case 2:{	// Invalid password
+			SendLoginError(Connection, "Accountnumber or password is not correct.");
+			break;
+		}
+
+		case 3:{
+			SendLoginError(Connection, "Account disabled for five minutes. Please wait.");
+			break;
+		}
+
+		case 4:{
+			SendLoginError(Connection, "IP address blocked for 30 minutes. Please wait.");
+			break;
+		}
+
+		case 5:{
+			SendLoginError(Connection, "Your account is banished.");
+			break;
+		}
+
+		case 6:{
+			SendLoginError(Connection, "Your IP address is banished.");
+			break;
+		}
+
+		default:{
+			if(LoginCode != -1){
+				LOG_ERR("Invalid login code %d", LoginCode);
+			}
+			SendLoginError(Connection, "Internal error, closing connection.");
+			break;
+		}
+	}
+}
+
+static void LoginQueryDone(TQuery *Query, int Status, TReadBuffer *Response){
+	TConnection *Connection = (TConnection*)Query->Data;
+	ASSERT(Connection->State == CONNECTION_QUERYING);
+	Connection->State = CONNECTION_PROCESSING;
+
+	int NumCharacters = 0;
+	int PremiumDays = 0;
+	TCharacterLoginData Characters[50];
+	int LoginCode = LoginAccountResult(Status, Response,
+			NARRAY(Characters), &NumCharacters, Characters, &PremiumDays);
+	SendLoginResult(Connection, LoginCode, NumCharacters, Characters, PremiumDays);
+	FinishConnectionRequest(Connection);
+}
+
 void ProcessLoginRequest(TConnection *Connection){
-	if(Connection->RWSize != 145){
-		LOG_ERR("Invalid login request size from %s (expected 145, got %d)",
-				Connection->RemoteAddress, Connection->RWSize);
-		CloseConnection(Connection);
+	if(Connection->RWSize != LOGIN_REQUEST_SIZE){
+		LOG_ERR("Invalid login request size from %s (expected %d, got %d)",
+				Connection->Data->RemoteAddress, LOGIN_REQUEST_SIZE, Connection->RWSize);
+		AbortConnection(Connection);
 		return;
 	}
 
-	TReadBuffer ReadBuffer(Connection->Buffer, Connection->RWSize);
+	TReadBuffer ReadBuffer(Connection->Data->Buffer, Connection->RWSize);
 	ReadBuffer.Read8(); // always 1 for a login request
 	int TerminalType = ReadBuffer.Read16();
 	int TerminalVersion = ReadBuffer.Read16();
@@ -528,7 +3132,18 @@ void ProcessLoginRequest(TConnection *Connection){
 	ReadBuffer.ReadBytes(AsymmetricData, sizeof(AsymmetricData));
 	if(ReadBuffer.Overflowed()){
 		LOG_ERR("Input buffer overflowed while reading login command from %s",
-				Connection->RemoteAddress);
+				Connection->Data->RemoteAddress);
+		AbortConnection(Connection);
+		return;
+	}
+
+	// NOTE(fusion): There is no point in decrypting a login that can't be
+	// processed. The client can't be told why without the XTEA key, so it's
+	// just disconnected, which is why this is optional. These are counted apart
+	// from rejected queries, which still get an error message.
+	TQueryManagerPool *Pool = &Connection->Worker->QueryManagers;
+	if(g_Config.QueryManagerBreakerEarlyReject && Pool->BreakerState != QUERY_BREAKER_CLOSED){
+		Pool->Stats.BreakerEarlyRejected += 1;
 		CloseConnection(Connection);
 		return;
 	}
@@ -538,24 +3153,24 @@ void ProcessLoginRequest(TConnection *Connection){
 	// plaintext byte is ZERO, but that alone isn't enough.
 	if(!RSADecrypt(g_PrivateKey, AsymmetricData, sizeof(AsymmetricData)) || AsymmetricData[0] != 0){
 		LOG_ERR("Failed to decrypt asymmetric data from %s",
-				Connection->RemoteAddress);
-		CloseConnection(Connection);
+				Connection->Data->RemoteAddress);
+		AbortConnection(Connection);
 		return;
 	}
 
 	ReadBuffer = TReadBuffer(AsymmetricData, sizeof(AsymmetricData));
 	ReadBuffer.Read8(); // always zero
-	Connection->XTEA[0] = ReadBuffer.Read32();
-	Connection->XTEA[1] = ReadBuffer.Read32();
-	Connection->XTEA[2] = ReadBuffer.Read32();
-	Connection->XTEA[3] = ReadBuffer.Read32();
+	Connection->Data->XTEA[0] = ReadBuffer.Read32();
+	Connection->Data->XTEA[1] = ReadBuffer.Read32();
+	Connection->Data->XTEA[2] = ReadBuffer.Read32();
+	Connection->Data->XTEA[3] = ReadBuffer.Read32();
 
 	char Password[30];
 	int AccountID = ReadBuffer.Read32();
 	ReadBuffer.ReadString(Password, sizeof(Password));
 	if(ReadBuffer.Overflowed()){
-		LOG_ERR("Malformed asymmetric data from %s", Connection->RemoteAddress);
-		CloseConnection(Connection);
+		LOG_ERR("Malformed asymmetric data from %s", Connection->Data->RemoteAddress);
+		AbortConnection(Connection);
 		return;
 	}
 
@@ -575,61 +3190,21 @@ void ProcessLoginRequest(TConnection *Connection){
 
 	char IPString[16];
 	StringBufFormat(IPString, "%d.%d.%d.%d",
-			((Connection->IPAddress >> 24) & 0xFF),
-			((Connection->IPAddress >> 16) & 0xFF),
-			((Connection->IPAddress >>  8) & 0xFF),
-			((Connection->IPAddress >>  0) & 0xFF));
-
-	int NumCharacters = 0;
-	int PremiumDays = 0;
-	TCharacterLoginData Characters[50];
-	int LoginCode = LoginAccount(AccountID, Password, IPString,
-			NARRAY(Characters), &NumCharacters, Characters, &PremiumDays);
-	switch(LoginCode){
-		case 0:{
-			SendCharacterList(Connection, NumCharacters, Characters, PremiumDays);
-			break;
-		}
-
-		case 1:		// Invalid account number
-		case 2:{	// Invalid password
-			SendLoginError(Connection, "Accountnumber or password is not correct.");
-			break;
-		}
-
-		case 3:{
-			SendLoginError(Connection, "Account disabled for five minutes. Please wait.");
-			break;
-		}
-
-		case 4:{
-			SendLoginError(Connection, "IP address blocked for 30 minutes. Please wait.");
-			break;
-		}
-
-		case 5:{
-			SendLoginError(Connection, "Your account is banished.");
-			break;
-		}
-
-		case 6:{
-			SendLoginError(Connection, "Your IP address is banished.");
-			break;
-		}
-
-		default:{
-			if(LoginCode != -1){
-				LOG_ERR("Invalid login code %d", LoginCode);
-			}
-			SendLoginError(Connection, "Internal error, closing connection.");
-			break;
-		}
+			((Connection->Data->IPAddress >> 24) & 0xFF),
+			((Connection->Data->IPAddress >> 16) & 0xFF),
+			((Connection->Data->IPAddress >>  8) & 0xFF),
+			((Connection->Data->IPAddress >>  0) & 0xFF));
+
+	PrepareLoginAccount(&Connection->Data->Query, AccountID, Password, IPString);
+	if(!SubmitConnectionQuery(Connection, LoginQueryDone)){
+		SendLoginResult(Connection, -1, 0, NULL, 0);
 	}
 }
 
 // Status Request
 //==============================================================================
 static bool AllowStatusRequest(int IPAddress){
+	pthread_mutex_lock(&g_StatusRecordsMutex);
 	TStatusRecord *Record = NULL;
 	int LeastRecentlyUsedIndex = 0;
 	int LeastRecentlyUsedTime = g_StatusRecords[0].Timestamp;
@@ -657,53 +3232,77 @@ static bool AllowStatusRequest(int IPAddress){
 		Result = true;
 	}
 
+	pthread_mutex_unlock(&g_StatusRecordsMutex);
 	return Result;
 }
 
-static void SendStatusString(TConnection *Connection, const char *StatusString){
+static void SendStatusString(TConnection *Connection){
 	if(Connection->State != CONNECTION_PROCESSING){
 		LOG_ERR("Connection %s is not PROCESSING (State: %d)",
-				Connection->RemoteAddress, Connection->State);
+				Connection->Data->RemoteAddress, Connection->State);
 		CloseConnection(Connection);
 		return;
 	}
 
-	int Length = (int)strlen(StatusString);
-	if(Length > (int)sizeof(Connection->Buffer)){
-		Length = (int)sizeof(Connection->Buffer);
+	if(!ConnectionReserveBuffer(Connection, KB(2))){
+		CloseConnection(Connection);
+		return;
 	}
 
-	Connection->RWSize = Length;
+	Connection->RWSize = GetStatusString((char*)Connection->Data->Buffer, Connection->Data->BufferSize);
 	Connection->RWPosition = 0;
-	memcpy(Connection->Buffer, StatusString, Length);
 	Connection->State = CONNECTION_WRITING;
 }
 
+static void StatusQueryDone(TQuery *Query, int Status, TReadBuffer *Response){
+	TConnection *Connection = (TConnection*)Query->Data;
+	ASSERT(Connection->State == CONNECTION_QUERYING);
+	Connection->State = CONNECTION_PROCESSING;
+
+	TWorld World;
+	if(GetWorldResult(Status, Response, g_Config.StatusWorld, &World) == 0){
+		FinishStatusRefresh(&World);
+	}else{
+		FinishStatusRefresh(NULL);
+	}
+
+	SendStatusString(Connection);
+	FinishConnectionRequest(Connection);
+}
+
 void ProcessStatusRequest(TConnection *Connection){
-	if(!AllowStatusRequest(Connection->IPAddress)){
-		LOG_ERR("Too many status requests from %s", Connection->RemoteAddress);
+	if(!AllowStatusRequest(Connection->Data->IPAddress)){
+		LOG_ERR("Too many status requests from %s", Connection->Data->RemoteAddress);
 		CloseConnection(Connection);
 		return;
 	}
 
-	TReadBuffer ReadBuffer(Connection->Buffer, Connection->RWSize);
+	TReadBuffer ReadBuffer(Connection->Data->Buffer, Connection->RWSize);
 	ReadBuffer.Read8(); // always 255 for a status request
 	int Format = (int)ReadBuffer.Read8();
 	if(Format == 255){ // XML
 		char Request[5] = {};
 		ReadBuffer.ReadBytes((uint8*)Request, 4);
 		if(StringEqCI(Request, "info")){
-			const char *StatusString = GetStatusString();
-			SendStatusString(Connection, StatusString);
+			// NOTE(fusion): Only the request that starts a refresh waits for it,
+			// others get the current status string right away.
+			if(BeginStatusRefresh()){
+				PrepareGetWorlds(&Connection->Data->Query);
+				if(SubmitConnectionQuery(Connection, StatusQueryDone)){
+					return;
+				}
+				FinishStatusRefresh(NULL);
+			}
+			SendStatusString(Connection);
 		}else{
 			LOG_WARN("Invalid status request \"%s\" from %s",
-					Request, Connection->RemoteAddress);
-			CloseConnection(Connection);
+					Request, Connection->Data->RemoteAddress);
+			AbortConnection(Connection);
 		}
 	}else{
 		LOG_WARN("Invalid status format %d from %s",
-				Format, Connection->RemoteAddress);
-		CloseConnection(Connection);
+				Format, Connection->Data->RemoteAddress);
+		AbortConnection(Connection);
 	}
 }
 
@@ -5,6 +5,7 @@
 
 int64   g_StartTimeMS    = 0;
 int     g_ShutdownSignal = 0;
+int     g_ReloadSignal   = 0;
 TConfig g_Config         = {};
 
 void LogAdd(const char *Prefix, const char *Format, ...){
@@ -429,6 +430,34 @@ bool ParseDuration(int *Dest, const char *String){
 	return true;
 }
 
+bool ParseDurationMS(int *Dest, const char *String){
+	ASSERT(Dest && String);
+	const char *Suffix;
+	*Dest = (int)strtol(String, (char**)&Suffix, 0);
+	if(Suffix == String){
+		return false;
+	}
+
+	while(Suffix[0] != 0 && isspace(Suffix[0])){
+		Suffix += 1;
+	}
+
+	// NOTE(fusion): Same as `ParseDuration` but in milliseconds, with an extra
+	// `ms` suffix. Values without a suffix are still taken as seconds to keep
+	// existing configs working.
+	if((Suffix[0] == 'M' || Suffix[0] == 'm') && (Suffix[1] == 'S' || Suffix[1] == 's')){
+		*Dest *= (1);
+	}else if(Suffix[0] == 'M' || Suffix[0] == 'm'){
+		*Dest *= (60 * 1000);
+	}else if(Suffix[0] == 'H' || Suffix[0] == 'h'){
+		*Dest *= (60 * 60 * 1000);
+	}else{
+		*Dest *= (1000);
+	}
+
+	return true;
+}
+
 bool ParseSize(int *Dest, const char *String){
 	ASSERT(Dest && String);
 	const char *Suffix;
@@ -576,10 +605,64 @@ bool ReadConfig(const char *FileName, TConfig *Config){
 
 		if(StringEqCI(Key, "LoginPort")){
 			ParseInteger(&Config->LoginPort, Val);
+		}else if(StringEqCI(Key, "IOEngine")){
+			ParseStringBuf(Config->IOEngine, Val);
+		}else if(StringEqCI(Key, "Workers")){
+			ParseInteger(&Config->Workers, Val);
+		}else if(StringEqCI(Key, "WorkerAffinity")){
+			ParseBoolean(&Config->WorkerAffinity, Val);
+		}else if(StringEqCI(Key, "ReusePortSteering")){
+			ParseBoolean(&Config->ReusePortSteering, Val);
+		}else if(StringEqCI(Key, "ListenBacklog")){
+			ParseInteger(&Config->ListenBacklog, Val);
+		}else if(StringEqCI(Key, "DeferAccept")){
+			ParseDuration(&Config->DeferAccept, Val);
+		}else if(StringEqCI(Key, "FastOpen")){
+			ParseInteger(&Config->FastOpen, Val);
+		}else if(StringEqCI(Key, "MaxAcceptsPerIteration")){
+			ParseInteger(&Config->MaxAcceptsPerIteration, Val);
+		}else if(StringEqCI(Key, "MaxRequestsPerIteration")){
+			ParseInteger(&Config->MaxRequestsPerIteration, Val);
+		}else if(StringEqCI(Key, "MaxProcessingTime")){
+			ParseDurationMS(&Config->MaxProcessingTime, Val);
+		}else if(StringEqCI(Key, "StatsInterval")){
+			ParseDuration(&Config->StatsInterval, Val);
 		}else if(StringEqCI(Key, "ConnectionTimeout")){
-			ParseDuration(&Config->ConnectionTimeout, Val);
+			ParseDurationMS(&Config->ConnectionTimeout, Val);
+		}else if(StringEqCI(Key, "HandoffPath")){
+			ParseStringBuf(Config->HandoffPath, Val);
+		}else if(StringEqCI(Key, "HandoffDrainTimeout")){
+			ParseDurationMS(&Config->HandoffDrainTimeout, Val);
+		}else if(StringEqCI(Key, "StatusPort")){
+			ParseInteger(&Config->StatusPort, Val);
+		}else if(StringEqCI(Key, "StatusMaxConnections")){
+			ParseInteger(&Config->StatusMaxConnections, Val);
+		}else if(StringEqCI(Key, "StatusTimeout")){
+			ParseDurationMS(&Config->StatusTimeout, Val);
+		}else if(StringEqCI(Key, "StatusMaxAcceptsPerIteration")){
+			ParseInteger(&Config->StatusMaxAcceptsPerIteration, Val);
+		}else if(StringEqCI(Key, "HeaderTimeout")){
+			ParseDurationMS(&Config->HeaderTimeout, Val);
+		}else if(StringEqCI(Key, "PayloadTimeout")){
+			ParseDurationMS(&Config->PayloadTimeout, Val);
+		}else if(StringEqCI(Key, "ProcessingTimeout")){
+			ParseDurationMS(&Config->ProcessingTimeout, Val);
+		}else if(StringEqCI(Key, "WriteTimeout")){
+			ParseDurationMS(&Config->WriteTimeout, Val);
+		}else if(StringEqCI(Key, "MinReadRate")){
+			ParseSize(&Config->MinReadRate, Val);
+		}else if(StringEqCI(Key, "AdaptiveTimeoutFloor")){
+			ParseInteger(&Config->AdaptiveTimeoutFloor, Val);
+		}else if(StringEqCI(Key, "TeardownMode")){
+			ParseStringBuf(Config->TeardownMode, Val);
+		}else if(StringEqCI(Key, "DrainTimeout")){
+			ParseDurationMS(&Config->DrainTimeout, Val);
+		}else if(StringEqCI(Key, "ResetOnError")){
+			ParseBoolean(&Config->ResetOnError, Val);
 		}else if(StringEqCI(Key, "MaxConnections")){
 			ParseInteger(&Config->MaxConnections, Val);
+		}else if(StringEqCI(Key, "LoginReservePercent")){
+			ParseInteger(&Config->LoginReservePercent, Val);
 		}else if(StringEqCI(Key, "MaxStatusRecords")){
 			ParseInteger(&Config->MaxStatusRecords, Val);
 		}else if(StringEqCI(Key, "MinStatusInterval")){
@@ -590,6 +673,24 @@ bool ReadConfig(const char *FileName, TConfig *Config){
 			ParseInteger(&Config->QueryManagerPort, Val);
 		}else if(StringEqCI(Key, "QueryManagerPassword")){
 			ParseStringBuf(Config->QueryManagerPassword, Val);
+		}else if(StringEqCI(Key, "QueryManagerConnections")){
+			ParseInteger(&Config->QueryManagerConnections, Val);
+		}else if(StringEqCI(Key, "QueryManagerPipelineDepth")){
+			ParseInteger(&Config->QueryManagerPipelineDepth, Val);
+		}else if(StringEqCI(Key, "QueryManagerBatchSize")){
+			ParseInteger(&Config->QueryManagerBatchSize, Val);
+		}else if(StringEqCI(Key, "QueryManagerConnectTimeout")){
+			ParseDurationMS(&Config->QueryManagerConnectTimeout, Val);
+		}else if(StringEqCI(Key, "QueryManagerQueryTimeout")){
+			ParseDurationMS(&Config->QueryManagerQueryTimeout, Val);
+		}else if(StringEqCI(Key, "QueryManagerClientDeadline")){
+			ParseBoolean(&Config->QueryManagerClientDeadline, Val);
+		}else if(StringEqCI(Key, "QueryManagerBreakerThreshold")){
+			ParseInteger(&Config->QueryManagerBreakerThreshold, Val);
+		}else if(StringEqCI(Key, "QueryManagerBreakerMaxBackoff")){
+			ParseDurationMS(&Config->QueryManagerBreakerMaxBackoff, Val);
+		}else if(StringEqCI(Key, "QueryManagerBreakerEarlyReject")){
+			ParseBoolean(&Config->QueryManagerBreakerEarlyReject, Val);
 		}else if(StringEqCI(Key, "StatusWorld")){
 			ParseStringBuf(Config->StatusWorld, Val);
 		}else if(StringEqCI(Key, "URL")){
@@ -627,7 +728,145 @@ static bool SigHandler(int SigNr, sighandler_t Handler){
 
 static void ShutdownHandler(int SigNr){
 	g_ShutdownSignal = SigNr;
-	//WakeConnections?
+	WakeConnections();
+}
+
+static void ReloadHandler(int SigNr){
+	(void)SigNr;
+	g_ReloadSignal = 1;
+	WakeConnections();
+}
+
+static void KeepConfigInt(const char *Name, int *NewValue, int OldValue){
+	if(*NewValue != OldValue){
+		LOG_WARN("%s can't be changed without a restart (%d -> %d)",
+				Name, OldValue, *NewValue);
+		*NewValue = OldValue;
+	}
+}
+
+static void KeepConfigBool(const char *Name, bool *NewValue, bool OldValue){
+	if(*NewValue != OldValue){
+		LOG_WARN("%s can't be changed without a restart (%s -> %s)",
+				Name, (OldValue ? "true" : "false"), (*NewValue ? "true" : "false"));
+		*NewValue = OldValue;
+	}
+}
+
+static void KeepConfigString(const char *Name, char *NewValue, int NewValueSize, const char *OldValue){
+	if(!StringEq(NewValue, OldValue)){
+		LOG_WARN("%s can't be changed without a restart (\"%s\" -> \"%s\")",
+				Name, OldValue, NewValue);
+		StringCopy(NewValue, NewValueSize, OldValue);
+	}
+}
+
+static void LogConfigInt(const char *Name, int OldValue, int NewValue){
+	if(NewValue != OldValue){
+		LOG("%s changed (%d -> %d)", Name, OldValue, NewValue);
+	}
+}
+
+static void LogConfigBool(const char *Name, bool OldValue, bool NewValue){
+	if(NewValue != OldValue){
+		LOG("%s changed (%s -> %s)", Name,
+				(OldValue ? "true" : "false"), (NewValue ? "true" : "false"));
+	}
+}
+
+static void LogConfigString(const char *Name, const char *OldValue, const char *NewValue){
+	if(!StringEq(NewValue, OldValue)){
+		LOG("%s changed (\"%s\" -> \"%s\")", Name, OldValue, NewValue);
+	}
+}
+
+// NOTE(fusion): Config reloads start from the current config, so keys that
+// were removed from the file keep their current value. Anything related to
+// listeners, workers, or the query manager connection is only set up at startup
+// and can't be changed without a restart (or a listener handoff).
+static void ReloadConfig(void){
+	LOG("Reloading config...");
+	TConfig OldConfig = g_Config;
+	TConfig NewConfig = g_Config;
+	if(!ReadConfig("config.cfg", &NewConfig)){
+		LOG_ERR("Failed to reload config, keeping current values");
+		return;
+	}
+
+	KeepConfigInt("LoginPort", &NewConfig.LoginPort, OldConfig.LoginPort);
+	KeepConfigInt("StatusPort", &NewConfig.StatusPort, OldConfig.StatusPort);
+	KeepConfigString("HandoffPath", NewConfig.HandoffPath,
+			sizeof(NewConfig.HandoffPath), OldConfig.HandoffPath);
+	KeepConfigString("IOEngine", NewConfig.IOEngine,
+			sizeof(NewConfig.IOEngine), OldConfig.IOEngine);
+	KeepConfigInt("Workers", &NewConfig.Workers, OldConfig.Workers);
+	KeepConfigBool("WorkerAffinity", &NewConfig.WorkerAffinity, OldConfig.WorkerAffinity);
+	KeepConfigBool("ReusePortSteering", &NewConfig.ReusePortSteering, OldConfig.ReusePortSteering);
+	KeepConfigInt("ListenBacklog", &NewConfig.ListenBacklog, OldConfig.ListenBacklog);
+	KeepConfigInt("DeferAccept", &NewConfig.DeferAccept, OldConfig.DeferAccept);
+	KeepConfigInt("FastOpen", &NewConfig.FastOpen, OldConfig.FastOpen);
+	KeepConfigString("QueryManagerHost", NewConfig.QueryManagerHost,
+			sizeof(NewConfig.QueryManagerHost), OldConfig.QueryManagerHost);
+	KeepConfigInt("QueryManagerPort", &NewConfig.QueryManagerPort, OldConfig.QueryManagerPort);
+	KeepConfigString("QueryManagerPassword", NewConfig.QueryManagerPassword,
+			sizeof(NewConfig.QueryManagerPassword), OldConfig.QueryManagerPassword);
+	KeepConfigInt("QueryManagerConnections", &NewConfig.QueryManagerConnections,
+			OldConfig.QueryManagerConnections);
+
+	if(!ReloadConnections(&NewConfig)){
+		LOG_ERR("Failed to apply config, keeping current values");
+		return;
+	}
+
+	LogConfigInt("StatusMaxConnections", OldConfig.StatusMaxConnections, g_Config.StatusMaxConnections);
+	LogConfigInt("StatusTimeout", OldConfig.StatusTimeout, g_Config.StatusTimeout);
+	LogConfigInt("StatusMaxAcceptsPerIteration", OldConfig.StatusMaxAcceptsPerIteration,
+			g_Config.StatusMaxAcceptsPerIteration);
+	LogConfigInt("HandoffDrainTimeout", OldConfig.HandoffDrainTimeout, g_Config.HandoffDrainTimeout);
+	LogConfigInt("MaxAcceptsPerIteration", OldConfig.MaxAcceptsPerIteration,
+			g_Config.MaxAcceptsPerIteration);
+	LogConfigInt("MaxRequestsPerIteration", OldConfig.MaxRequestsPerIteration,
+			g_Config.MaxRequestsPerIteration);
+	LogConfigInt("MaxProcessingTime", OldConfig.MaxProcessingTime, g_Config.MaxProcessingTime);
+	LogConfigInt("StatsInterval", OldConfig.StatsInterval, g_Config.StatsInterval);
+	LogConfigInt("ConnectionTimeout", OldConfig.ConnectionTimeout, g_Config.ConnectionTimeout);
+	LogConfigInt("HeaderTimeout", OldConfig.HeaderTimeout, g_Config.HeaderTimeout);
+	LogConfigInt("PayloadTimeout", OldConfig.PayloadTimeout, g_Config.PayloadTimeout);
+	LogConfigInt("ProcessingTimeout", OldConfig.ProcessingTimeout, g_Config.ProcessingTimeout);
+	LogConfigInt("WriteTimeout", OldConfig.WriteTimeout, g_Config.WriteTimeout);
+	LogConfigInt("MinReadRate", OldConfig.MinReadRate, g_Config.MinReadRate);
+	LogConfigInt("AdaptiveTimeoutFloor", OldConfig.AdaptiveTimeoutFloor, g_Config.AdaptiveTimeoutFloor);
+	LogConfigString("TeardownMode", OldConfig.TeardownMode, g_Config.TeardownMode);
+	LogConfigInt("DrainTimeout", OldConfig.DrainTimeout, g_Config.DrainTimeout);
+	LogConfigBool("ResetOnError", OldConfig.ResetOnError, g_Config.ResetOnError);
+	LogConfigInt("MaxConnections", OldConfig.MaxConnections, g_Config.MaxConnections);
+	LogConfigInt("LoginReservePercent", OldConfig.LoginReservePercent, g_Config.LoginReservePercent);
+	LogConfigInt("QueryManagerPipelineDepth", OldConfig.QueryManagerPipelineDepth,
+			g_Config.QueryManagerPipelineDepth);
+	LogConfigInt("QueryManagerBatchSize", OldConfig.QueryManagerBatchSize,
+			g_Config.QueryManagerBatchSize);
+	LogConfigInt("QueryManagerConnectTimeout", OldConfig.QueryManagerConnectTimeout,
+			g_Config.QueryManagerConnectTimeout);
+	LogConfigInt("QueryManagerQueryTimeout", OldConfig.QueryManagerQueryTimeout,
+			g_Config.QueryManagerQueryTimeout);
+	LogConfigBool("QueryManagerClientDeadline", OldConfig.QueryManagerClientDeadline,
+			g_Config.QueryManagerClientDeadline);
+	LogConfigInt("QueryManagerBreakerThreshold", OldConfig.QueryManagerBreakerThreshold,
+			g_Config.QueryManagerBreakerThreshold);
+	LogConfigInt("QueryManagerBreakerMaxBackoff", OldConfig.QueryManagerBreakerMaxBackoff,
+			g_Config.QueryManagerBreakerMaxBackoff);
+	LogConfigBool("QueryManagerBreakerEarlyReject", OldConfig.QueryManagerBreakerEarlyReject,
+			g_Config.QueryManagerBreakerEarlyReject);
+	LogConfigInt("MaxStatusRecords", OldConfig.MaxStatusRecords, g_Config.MaxStatusRecords);
+	LogConfigInt("MinStatusInterval", OldConfig.MinStatusInterval, g_Config.MinStatusInterval);
+	LogConfigString("StatusWorld", OldConfig.StatusWorld, g_Config.StatusWorld);
+	LogConfigString("URL", OldConfig.Url, g_Config.Url);
+	LogConfigString("Location", OldConfig.Location, g_Config.Location);
+	LogConfigString("ServerType", OldConfig.ServerType, g_Config.ServerType);
+	LogConfigString("ServerVersion", OldConfig.ServerVersion, g_Config.ServerVersion);
+	LogConfigString("ClientVersion", OldConfig.ClientVersion, g_Config.ClientVersion);
+	LogConfigString("MOTD", OldConfig.Motd, g_Config.Motd);
+	LOG("Config reloaded");
 }
 
 int main(int argc, const char **argv){
@@ -638,19 +877,56 @@ int main(int argc, const char **argv){
 	g_ShutdownSignal = 0;
 	if(!SigHandler(SIGPIPE, SIG_IGN)
 	|| !SigHandler(SIGINT, ShutdownHandler)
-	|| !SigHandler(SIGTERM, ShutdownHandler)){
+	|| !SigHandler(SIGTERM, ShutdownHandler)
+	|| !SigHandler(SIGHUP, ReloadHandler)){
 		return EXIT_FAILURE;
 	}
 
 	// Service Config
 	g_Config.LoginPort         = 7171;
-	g_Config.ConnectionTimeout = 5;   // seconds
+	StringBufCopy(g_Config.IOEngine, "epoll");
+	g_Config.Workers           = 1;
+	g_Config.WorkerAffinity    = false;
+	g_Config.ReusePortSteering = false;
+	g_Config.ListenBacklog     = 128;
+	g_Config.DeferAccept       = 0; // seconds
+	g_Config.FastOpen          = 0;
+	g_Config.MaxAcceptsPerIteration = 64;
+	g_Config.MaxRequestsPerIteration = 16;
+	g_Config.MaxProcessingTime = 20; // milliseconds
+	g_Config.StatsInterval     = 0; // seconds
+	g_Config.ConnectionTimeout = 5000; // milliseconds
+	g_Config.HeaderTimeout     = 3000; // milliseconds
+	g_Config.PayloadTimeout    = 3000; // milliseconds
+	g_Config.ProcessingTimeout = 0;    // milliseconds
+	g_Config.WriteTimeout      = 3000; // milliseconds
+	g_Config.MinReadRate       = 64;   // bytes per second
+	g_Config.AdaptiveTimeoutFloor = 25;
+	StringBufCopy(g_Config.TeardownMode, "close");
+	g_Config.DrainTimeout      = 1000; // milliseconds
+	g_Config.ResetOnError      = false;
 	g_Config.MaxConnections    = 10;
+	StringBufCopy(g_Config.HandoffPath, "");
+	g_Config.HandoffDrainTimeout = 10000; // milliseconds
+	g_Config.StatusPort        = 0;
+	g_Config.StatusMaxConnections = 16;
+	g_Config.StatusTimeout     = 2000; // milliseconds
+	g_Config.StatusMaxAcceptsPerIteration = 16;
+	g_Config.LoginReservePercent = 25;
 	g_Config.MaxStatusRecords  = 1024;
 	g_Config.MinStatusInterval = 300; // seconds
 	StringBufCopy(g_Config.QueryManagerHost, "127.0.0.1");
 	g_Config.QueryManagerPort  = 7173;
 	StringBufCopy(g_Config.QueryManagerPassword, "");
+	g_Config.QueryManagerConnections = 2;
+	g_Config.QueryManagerPipelineDepth = 4;
+	g_Config.QueryManagerBatchSize = 8;
+	g_Config.QueryManagerConnectTimeout = 2000; // milliseconds
+	g_Config.QueryManagerQueryTimeout = 5000; // milliseconds
+	g_Config.QueryManagerClientDeadline = true;
+	g_Config.QueryManagerBreakerThreshold = 3;
+	g_Config.QueryManagerBreakerMaxBackoff = 30000; // milliseconds
+	g_Config.QueryManagerBreakerEarlyReject = false;
 
 	// Service Info
 	StringBufCopy(g_Config.StatusWorld,   "");
@@ -667,12 +943,48 @@ int main(int argc, const char **argv){
 	}
 
 	LOG("Login port:          %d",     g_Config.LoginPort);
-	LOG("Connection timeout:  %ds",    g_Config.ConnectionTimeout);
+	LOG("IO engine:           \"%s\"", g_Config.IOEngine);
+	LOG("Workers:             %d",     g_Config.Workers);
+	LOG("Worker affinity:     %s",     (g_Config.WorkerAffinity ? "yes" : "no"));
+	LOG("Reuseport steering:  %s",     (g_Config.ReusePortSteering ? "yes" : "no"));
+	LOG("Listen backlog:      %d",     g_Config.ListenBacklog);
+	LOG("Defer accept:        %ds",    g_Config.DeferAccept);
+	LOG("Fast open queue:     %d",     g_Config.FastOpen);
+	LOG("Max accepts:         %d per iteration", g_Config.MaxAcceptsPerIteration);
+	LOG("Max requests:        %d per iteration", g_Config.MaxRequestsPerIteration);
+	LOG("Max processing time: %dms per iteration", g_Config.MaxProcessingTime);
+	LOG("Stats interval:      %ds",    g_Config.StatsInterval);
+	LOG("Connection timeout:  %dms",   g_Config.ConnectionTimeout);
+	LOG("Header timeout:      %dms",   g_Config.HeaderTimeout);
+	LOG("Payload timeout:     %dms",   g_Config.PayloadTimeout);
+	LOG("Processing timeout:  %dms",   g_Config.ProcessingTimeout);
+	LOG("Write timeout:       %dms",   g_Config.WriteTimeout);
+	LOG("Min read rate:       %dB/s",  g_Config.MinReadRate);
+	LOG("Timeout floor:       %d%%",   g_Config.AdaptiveTimeoutFloor);
+	LOG("Teardown mode:       \"%s\"", g_Config.TeardownMode);
+	LOG("Drain timeout:       %dms",   g_Config.DrainTimeout);
+	LOG("Reset on error:      %s",     (g_Config.ResetOnError ? "yes" : "no"));
 	LOG("Max connections:     %d",     g_Config.MaxConnections);
+	LOG("Login reserve:       %d%%",   g_Config.LoginReservePercent);
+	LOG("Handoff path:        \"%s\"", g_Config.HandoffPath);
+	LOG("Handoff drain:       %dms",   g_Config.HandoffDrainTimeout);
+	LOG("Status port:         %d",     g_Config.StatusPort);
+	LOG("Status connections:  %d",     g_Config.StatusMaxConnections);
+	LOG("Status timeout:      %dms",   g_Config.StatusTimeout);
+	LOG("Status accepts:      %d per iteration", g_Config.StatusMaxAcceptsPerIteration);
 	LOG("Max status records:  %d",     g_Config.MaxStatusRecords);
 	LOG("Min status interval: %ds",    g_Config.MinStatusInterval);
 	LOG("Query manager host:  \"%s\"", g_Config.QueryManagerHost);
 	LOG("Query manager port:  %d",     g_Config.QueryManagerPort);
+	LOG("Query manager conns: %d per worker", g_Config.QueryManagerConnections);
+	LOG("Query pipeline:      %d per connection", g_Config.QueryManagerPipelineDepth);
+	LOG("Login batch size:    %d", g_Config.QueryManagerBatchSize);
+	LOG("QM connect timeout:  %dms", g_Config.QueryManagerConnectTimeout);
+	LOG("QM query timeout:    %dms", g_Config.QueryManagerQueryTimeout);
+	LOG("QM client deadline:  %s", (g_Config.QueryManagerClientDeadline ? "yes" : "no"));
+	LOG("QM breaker:          %d failures, %dms max backoff%s",
+			g_Config.QueryManagerBreakerThreshold, g_Config.QueryManagerBreakerMaxBackoff,
+			(g_Config.QueryManagerBreakerEarlyReject ? ", early reject" : ""));
 	LOG("Status world:        \"%s\"", g_Config.StatusWorld);
 	LOG("URL:                 \"%s\"", g_Config.Url);
 	LOG("Location:            \"%s\"", g_Config.Location);
@@ -691,19 +1003,35 @@ int main(int argc, const char **argv){
 		}
 	}
 
-	atexit(ExitQuery);
+	InitStatus();
 	atexit(ExitConnections);
-	if(!InitQuery() || !InitConnections()){
+	if(!InitConnections()){
 		return EXIT_FAILURE;
 	}
 
 	LOG("Running...");
-	while(g_ShutdownSignal == 0){
+	while(g_ShutdownSignal == 0 && !ConnectionsHandedOff()){
 		ProcessConnections();
+		if(g_ReloadSignal != 0){
+			g_ReloadSignal = 0;
+			ReloadConfig();
+		}
+	}
+
+	if(g_ShutdownSignal == 0){
+		LOG("Listeners handed off, draining connections...");
+		DrainConnections();
+		while(g_ShutdownSignal == 0 && !ConnectionsDrained()){
+			ProcessConnections();
+		}
 	}
 
-	LOG("Received signal %d (%s), shutting down...",
-			g_ShutdownSignal, sigdescr_np(g_ShutdownSignal));
+	if(g_ShutdownSignal != 0){
+		LOG("Received signal %d (%s), shutting down...",
+				g_ShutdownSignal, sigdescr_np(g_ShutdownSignal));
+	}else{
+		LOG("Shutting down...");
+	}
 	return EXIT_SUCCESS;
 }
 
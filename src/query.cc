@@ -2,11 +2,14 @@
 
 #include <errno.h>
 #include <netdb.h>
+#include <poll.h>
+#include <pthread.h>
+#include <signal.h>
+#include <sys/epoll.h>
 #include <sys/socket.h>
+#include <sys/un.h>
 #include <unistd.h>
 
-static TQueryManagerConnection *g_QueryManagerConnection;
-
 static bool ResolveHostName(const char *HostName, in_addr_t *OutAddr){
 	ASSERT(HostName != NULL && OutAddr != NULL);
 	addrinfo *Result = NULL;
@@ -34,85 +37,430 @@ static bool ResolveHostName(const char *HostName, in_addr_t *OutAddr){
 	return Resolved;
 }
 
-static bool WriteExact(int Fd, const uint8 *Buffer, int Size){
+// Address Resolution
+//==============================================================================
+// NOTE(fusion): The query manager's address is resolved on startup and then
+// kept up to date by a background thread, so connecting never blocks on name
+// resolution. Workers ask for a refresh when a connection attempt fails, in
+// case the address changed, and it's also refreshed periodically. The host
+// and port can't be reloaded, so the thread keeps its own copy of them.
+//  A host in the form `unix:/path` refers to a unix domain socket, which avoids
+// going through the TCP stack when the query manager runs on the same machine.
+// There is nothing to resolve in that case and the port is ignored.
+static const int QUERY_MANAGER_RESOLVE_INTERVAL = 60000;
+static const int QUERY_MANAGER_MIN_RESOLVE_INTERVAL = 1000;
+
+static pthread_mutex_t g_ResolverMutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t g_ResolverCond;
+static pthread_t g_ResolverThread;
+static bool g_ResolverThreadStarted;
+static bool g_ResolverStop;
+static bool g_ResolverRefresh;
+static char g_ResolverHostName[100];
+static int g_ResolverPort;
+static sockaddr_storage g_QueryManagerAddress;
+static socklen_t g_QueryManagerAddressLen;
+
+static bool ResolveQueryManagerAddress(sockaddr_storage *OutAddr, socklen_t *OutAddrLen){
+	const char *HostName = g_ResolverHostName;
+	memset(OutAddr, 0, sizeof(sockaddr_storage));
+	if(strncmp(HostName, "unix:", 5) == 0){
+		const char *Path = HostName + 5;
+		sockaddr_un *Addr = (sockaddr_un*)OutAddr;
+		if(Path[0] == 0 || strlen(Path) >= sizeof(Addr->sun_path)){
+			LOG_ERR("Invalid query manager socket path \"%s\"", Path);
+			return false;
+		}
+
+		Addr->sun_family = AF_UNIX;
+		StringBufCopy(Addr->sun_path, Path);
+		*OutAddrLen = sizeof(sockaddr_un);
+		return true;
+	}
+
+	in_addr_t InAddr;
+	if(!ResolveHostName(HostName, &InAddr)){
+		LOG_ERR("Failed to resolve query manager's host name \"%s\"", HostName);
+		return false;
+	}
+
+	sockaddr_in *Addr = (sockaddr_in*)OutAddr;
+	Addr->sin_family = AF_INET;
+	Addr->sin_port = htons((uint16)g_ResolverPort);
+	Addr->sin_addr.s_addr = InAddr;
+	*OutAddrLen = sizeof(sockaddr_in);
+	return true;
+}
+
+static void GetQueryManagerAddress(sockaddr_storage *OutAddr, socklen_t *OutAddrLen){
+	pthread_mutex_lock(&g_ResolverMutex);
+	*OutAddr = g_QueryManagerAddress;
+	*OutAddrLen = g_QueryManagerAddressLen;
+	pthread_mutex_unlock(&g_ResolverMutex);
+}
+
+static void *ResolverThread(void *Argument){
+	(void)Argument;
+	int64 LastResolve = GetClockMonotonicMS();
+	pthread_mutex_lock(&g_ResolverMutex);
+	while(!g_ResolverStop){
+		int64 Now = GetClockMonotonicMS();
+		int64 NextResolve = LastResolve + QUERY_MANAGER_RESOLVE_INTERVAL;
+		if(g_ResolverRefresh){
+			NextResolve = LastResolve + QUERY_MANAGER_MIN_RESOLVE_INTERVAL;
+		}
+
+		if(Now < NextResolve){
+			timespec Deadline;
+			clock_gettime(CLOCK_MONOTONIC, &Deadline);
+			int64 Wait = NextResolve - Now;
+			Deadline.tv_sec += (time_t)(Wait / 1000);
+			Deadline.tv_nsec += (long)((Wait % 1000) * 1000000);
+			if(Deadline.tv_nsec >= 1000000000){
+				Deadline.tv_sec += 1;
+				Deadline.tv_nsec -= 1000000000;
+			}
+			pthread_cond_timedwait(&g_ResolverCond, &g_ResolverMutex, &Deadline);
+			continue;
+		}
+
+		g_ResolverRefresh = false;
+		pthread_mutex_unlock(&g_ResolverMutex);
+
+		sockaddr_storage Addr;
+		socklen_t AddrLen;
+		bool Resolved = ResolveQueryManagerAddress(&Addr, &AddrLen);
+		LastResolve = GetClockMonotonicMS();
+
+		pthread_mutex_lock(&g_ResolverMutex);
+		if(!Resolved){
+			LOG_WARN("Keeping previous query manager address");
+		}else if(AddrLen != g_QueryManagerAddressLen
+				|| memcmp(&Addr, &g_QueryManagerAddress, AddrLen) != 0){
+			LOG("Query manager address changed");
+			g_QueryManagerAddress = Addr;
+			g_QueryManagerAddressLen = AddrLen;
+		}
+	}
+	pthread_mutex_unlock(&g_ResolverMutex);
+	return NULL;
+}
+
+bool InitQueryManagerResolver(void){
+	ASSERT(!g_ResolverThreadStarted);
+	StringBufCopy(g_ResolverHostName, g_Config.QueryManagerHost);
+	g_ResolverPort = g_Config.QueryManagerPort;
+	g_ResolverStop = false;
+	g_ResolverRefresh = false;
+	if(!ResolveQueryManagerAddress(&g_QueryManagerAddress, &g_QueryManagerAddressLen)){
+		return false;
+	}
+
+	if(strncmp(g_ResolverHostName, "unix:", 5) == 0){
+		return true;
+	}
+
+	pthread_condattr_t CondAttr;
+	pthread_condattr_init(&CondAttr);
+	pthread_condattr_setclock(&CondAttr, CLOCK_MONOTONIC);
+	pthread_cond_init(&g_ResolverCond, &CondAttr);
+	pthread_condattr_destroy(&CondAttr);
+
+	// NOTE(fusion): Signals should only be handled by the main thread.
+	sigset_t SignalSet, OldSignalSet;
+	sigfillset(&SignalSet);
+	pthread_sigmask(SIG_BLOCK, &SignalSet, &OldSignalSet);
+	int ErrCode = pthread_create(&g_ResolverThread, NULL, ResolverThread, NULL);
+	pthread_sigmask(SIG_SETMASK, &OldSignalSet, NULL);
+	if(ErrCode != 0){
+		LOG_ERR("Failed to start resolver thread: (%d) %s",
+				ErrCode, strerrordesc_np(ErrCode));
+		pthread_cond_destroy(&g_ResolverCond);
+		return false;
+	}
+
+	g_ResolverThreadStarted = true;
+	return true;
+}
+
+void ExitQueryManagerResolver(void){
+	if(g_ResolverThreadStarted){
+		pthread_mutex_lock(&g_ResolverMutex);
+		g_ResolverStop = true;
+		pthread_cond_signal(&g_ResolverCond);
+		pthread_mutex_unlock(&g_ResolverMutex);
+		pthread_join(g_ResolverThread, NULL);
+		pthread_cond_destroy(&g_ResolverCond);
+		g_ResolverThreadStarted = false;
+	}
+}
+
+void RefreshQueryManagerAddress(void){
+	if(g_ResolverThreadStarted){
+		pthread_mutex_lock(&g_ResolverMutex);
+		g_ResolverRefresh = true;
+		pthread_cond_signal(&g_ResolverCond);
+		pthread_mutex_unlock(&g_ResolverMutex);
+	}
+}
+
+// Query Manager Connection
+//==============================================================================
+// NOTE(fusion): Blocking queries still use a non-blocking socket, waiting on it
+// with `poll` up to the query's deadline, so a query manager that stops halfway
+// through a response can't hang us.
+static int WaitSocket(int Fd, int Events, int64 Deadline){
+	while(true){
+		int64 Timeout = Deadline - GetClockMonotonicMS();
+		if(Timeout <= 0){
+			return QUERY_STATUS_TIMEOUT;
+		}
+
+		pollfd PollFd = {};
+		PollFd.fd = Fd;
+		PollFd.events = (short)Events;
+		int Ret = poll(&PollFd, 1, (Timeout < 1000 ? (int)Timeout : 1000));
+		if(Ret > 0){
+			return QUERY_STATUS_OK;
+		}else if(Ret == -1 && errno != EINTR){
+			return QUERY_STATUS_FAILED;
+		}
+	}
+}
+
+static int WriteExact(int Fd, const uint8 *Buffer, int Size, int64 Deadline){
 	int BytesToWrite = Size;
 	const uint8 *WritePtr = Buffer;
 	while(BytesToWrite > 0){
 		int Ret = (int)write(Fd, WritePtr, BytesToWrite);
 		if(Ret == -1){
-			return false;
+			if(errno != EAGAIN){
+				return QUERY_STATUS_FAILED;
+			}
+
+			int Status = WaitSocket(Fd, POLLOUT, Deadline);
+			if(Status != QUERY_STATUS_OK){
+				return Status;
+			}
+			continue;
 		}
 		BytesToWrite -= Ret;
 		WritePtr += Ret;
 	}
-	return true;
+	return QUERY_STATUS_OK;
 }
 
-static bool ReadExact(int Fd, uint8 *Buffer, int Size){
+static int ReadExact(int Fd, uint8 *Buffer, int Size, int64 Deadline){
 	int BytesToRead = Size;
 	uint8 *ReadPtr = Buffer;
 	while(BytesToRead > 0){
 		int Ret = (int)read(Fd, ReadPtr, BytesToRead);
+		if(Ret == -1 && errno == EAGAIN){
+			int Status = WaitSocket(Fd, POLLIN, Deadline);
+			if(Status != QUERY_STATUS_OK){
+				return Status;
+			}
+			continue;
+		}
+
 		if(Ret == -1 || Ret == 0){
-			return false;
+			return QUERY_STATUS_FAILED;
 		}
 		BytesToRead -= Ret;
 		ReadPtr += Ret;
 	}
-	return true;
+	return QUERY_STATUS_OK;
+}
+
+static TWriteBuffer PrepareLogin(uint8 *Buffer, int BufferSize){
+	TWriteBuffer WriteBuffer = PrepareQuery(QUERY_LOGIN, Buffer, BufferSize);
+	WriteBuffer.Write8((uint8)APPLICATION_TYPE_LOGIN);
+	WriteBuffer.WriteString(g_Config.QueryManagerPassword);
+	return WriteBuffer;
+}
+
+// NOTE(fusion): Batched logins are probed with an empty batch. Query managers
+// that don't know the query should just fail it, but in case one drops the
+// connection instead, `Disconnect` makes sure we don't probe it again.
+static TWriteBuffer PrepareBatchProbe(uint8 *Buffer, int BufferSize){
+	TWriteBuffer WriteBuffer = PrepareQuery(QUERY_LOGIN_ACCOUNT_BATCH, Buffer, BufferSize);
+	WriteBuffer.Write8(0);
+	return WriteBuffer;
 }
 
+// NOTE(fusion): This is the blocking version, which is only used on startup,
+// before there is anything else to do. Reconnects use `StartConnect`. Both are
+// bounded by `QueryManagerConnectTimeout`.
 bool Connect(TQueryManagerConnection *Connection){
 	if(Connection->Socket != -1){
 		LOG_ERR("Already connected");
 		return false;
 	}
 
-	in_addr_t Addr;
-	if(!ResolveHostName(g_Config.QueryManagerHost, &Addr)){
-		LOG_ERR("Failed to resolve query manager's host name \"%s\"", g_Config.QueryManagerHost);
-		return false;
-	}
-
-	Connection->Socket = socket(AF_INET, SOCK_STREAM, 0);
+	sockaddr_storage QueryManagerAddress;
+	socklen_t QueryManagerAddressLen;
+	GetQueryManagerAddress(&QueryManagerAddress, &QueryManagerAddressLen);
+	Connection->Socket = socket(QueryManagerAddress.ss_family, SOCK_STREAM | SOCK_NONBLOCK, 0);
 	if(Connection->Socket == -1){
 		LOG_ERR("Failed to create socket: (%d) %s", errno, strerrordesc_np(errno));
 		return false;
 	}
 
-	sockaddr_in QueryManagerAddress = {};
-	QueryManagerAddress.sin_family = AF_INET;
-	QueryManagerAddress.sin_port = htons((uint16)g_Config.QueryManagerPort);
-	QueryManagerAddress.sin_addr.s_addr = Addr;
-	if(connect(Connection->Socket, (sockaddr*)&QueryManagerAddress, sizeof(QueryManagerAddress)) == -1){
-		LOG_ERR("Failed to connect: (%d) %s", errno, strerrordesc_np(errno));
-		Disconnect(Connection);
-		return false;
+	Connection->State = QUERY_MANAGER_CONNECTING;
+	Connection->ConnectDeadline = GetClockMonotonicMS() + g_Config.QueryManagerConnectTimeout;
+	if(connect(Connection->Socket, (sockaddr*)&QueryManagerAddress, QueryManagerAddressLen) == -1){
+		if(errno != EINPROGRESS){
+			LOG_ERR("Failed to connect: (%d) %s", errno, strerrordesc_np(errno));
+			Disconnect(Connection);
+			return false;
+		}
+
+		int Error = 0;
+		socklen_t ErrorLen = sizeof(Error);
+		if(WaitSocket(Connection->Socket, POLLOUT, Connection->ConnectDeadline) != QUERY_STATUS_OK){
+			LOG_ERR("Timed out connecting to query manager");
+			Disconnect(Connection);
+			return false;
+		}else if(getsockopt(Connection->Socket, SOL_SOCKET, SO_ERROR, &Error, &ErrorLen) == -1 || Error != 0){
+			LOG_ERR("Failed to connect: (%d) %s", Error, strerrordesc_np(Error));
+			Disconnect(Connection);
+			return false;
+		}
 	}
 
-	uint8 LoginBuffer[1024];
-	TWriteBuffer WriteBuffer = PrepareQuery(QUERY_LOGIN, LoginBuffer, sizeof(LoginBuffer));
-	WriteBuffer.Write8((uint8)APPLICATION_TYPE_LOGIN);
-	WriteBuffer.WriteString(g_Config.QueryManagerPassword);
-	int Status = ExecuteQuery(Connection, false, &WriteBuffer, NULL);
+	uint8 HandshakeBuffer[1024];
+	TWriteBuffer WriteBuffer = PrepareLogin(HandshakeBuffer, sizeof(HandshakeBuffer));
+	Connection->State = QUERY_MANAGER_LOGGING_IN;
+	int Status = ExecuteQuery(Connection, Connection->ConnectDeadline, &WriteBuffer, NULL);
 	if(Status != QUERY_STATUS_OK){
 		LOG_ERR("Failed to login to query manager (%d)", Status);
 		Disconnect(Connection);
 		return false;
 	}
 
+	Connection->BatchLogins = false;
+	if(!Connection->Pool->SkipBatchProbe){
+		WriteBuffer = PrepareBatchProbe(HandshakeBuffer, sizeof(HandshakeBuffer));
+		Connection->State = QUERY_MANAGER_PROBING;
+		Status = ExecuteQuery(Connection, Connection->ConnectDeadline, &WriteBuffer, NULL);
+		if(Connection->Socket == -1){
+			return Connect(Connection);
+		}
+		Connection->BatchLogins = (Status == QUERY_STATUS_OK);
+	}
+
+	// NOTE(fusion): Everything after the handshake is driven by the event loop.
+	Connection->State = QUERY_MANAGER_READY;
+	Connection->Generation += 1;
 	return true;
 }
 
+// NOTE(fusion): Connecting and the handshake are driven by the event loop from
+// here on, through `ProcessQueryManager`. The whole thing must complete before
+// the deadline, which the event loop enforces.
+bool StartConnect(TQueryManagerConnection *Connection, int64 Deadline){
+	if(Connection->Socket != -1){
+		LOG_ERR("Already connected");
+		return false;
+	}
+
+	sockaddr_storage QueryManagerAddress;
+	socklen_t QueryManagerAddressLen;
+	GetQueryManagerAddress(&QueryManagerAddress, &QueryManagerAddressLen);
+	Connection->Socket = socket(QueryManagerAddress.ss_family, SOCK_STREAM | SOCK_NONBLOCK, 0);
+	if(Connection->Socket == -1){
+		LOG_ERR("Failed to create socket: (%d) %s", errno, strerrordesc_np(errno));
+		return false;
+	}
+
+	Connection->State = QUERY_MANAGER_CONNECTING;
+	Connection->ConnectDeadline = Deadline;
+	Connection->Generation += 1;
+	if(connect(Connection->Socket, (sockaddr*)&QueryManagerAddress, QueryManagerAddressLen) == -1
+			&& errno != EINPROGRESS){
+		LOG_ERR("Failed to connect: (%d) %s", errno, strerrordesc_np(errno));
+		Disconnect(Connection);
+		RefreshQueryManagerAddress();
+		return false;
+	}
+
+	// NOTE(fusion): Even if the connection completed right away, which is usual
+	// with unix sockets, the socket will still be reported as writable, so the
+	// handshake always starts from `ProcessQueryManager`.
+	return true;
+}
+
+static void ReplayQuery(TQueryManagerPool *Pool, TQuery *Query);
+
 void Disconnect(TQueryManagerConnection *Connection){
 	if(Connection->Socket != -1){
+		// NOTE(fusion): A poll armed by the io_uring engine holds its own
+		// reference to the socket, so closing the descriptor alone wouldn't
+		// tear it down.
+		shutdown(Connection->Socket, SHUT_RDWR);
 		close(Connection->Socket);
 		Connection->Socket = -1;
 	}
+
+	if(Connection->State == QUERY_MANAGER_PROBING && !Connection->Pool->SkipBatchProbe){
+		LOG_WARN("Query manager dropped the connection when probing for"
+				" batched logins, reconnecting without them");
+		Connection->Pool->SkipBatchProbe = true;
+	}
+	Connection->State = QUERY_MANAGER_DISCONNECTED;
+	Connection->BatchLogins = false;
+
+	// NOTE(fusion): Queries that weren't fully written can't have been seen by
+	// the query manager, so they're put back in front of the pool's queue to be
+	// sent on another connection. The others may have already been processed
+	// and aren't safe to replay, since logins aren't idempotent (e.g. failed
+	// attempts are recorded).
+	TQuery *Failed[QUERY_MAX_PIPELINE_DEPTH * QUERY_MAX_BATCH_SIZE];
+	int NumFailed = 0;
+	int64 Written = Connection->WriteOffset + Connection->WritePosition;
+	for(int i = Connection->NumInFlight - 1; i >= 0; i -= 1){
+		int Index = (Connection->InFlightHead + i) % QUERY_MAX_PIPELINE_DEPTH;
+		TQueryInFlight *Entry = &Connection->InFlight[Index];
+		for(int j = Entry->NumQueries - 1; j >= 0; j -= 1){
+			TQuery *Query = Entry->Queries[j];
+			if(Query == NULL){
+				continue;
+			}
+
+			if(Entry->WriteEnd > Written){
+				ReplayQuery(Connection->Pool, Query);
+			}else{
+				Failed[NumFailed] = Query;
+				NumFailed += 1;
+			}
+			Entry->Queries[j] = NULL;
+		}
+		Entry->NumQueries = 0;
+	}
+
+	if(Connection->NumInFlight > 0){
+		Connection->Pool->Stats.BusyTime += GetClockMonotonicMS() - Connection->BusySince;
+	}
+
+	Connection->InFlightHead = 0;
+	Connection->NumInFlight = 0;
+	Connection->WriteOffset = 0;
+	Connection->WriteSize = 0;
+	Connection->WritePosition = 0;
+	Connection->ReadPosition = 0;
+
+	for(int i = NumFailed - 1; i >= 0; i -= 1){
+		Failed[i]->Callback(Failed[i], QUERY_STATUS_FAILED, NULL);
+	}
 }
 
 bool IsConnected(TQueryManagerConnection *Connection){
-	return Connection->Socket != -1;
+	return Connection->State == QUERY_MANAGER_READY;
+}
+
+bool IsConnecting(TQueryManagerConnection *Connection){
+	return Connection->State != QUERY_MANAGER_DISCONNECTED
+		&& Connection->State != QUERY_MANAGER_READY;
 }
 
 TWriteBuffer PrepareQuery(int QueryType, uint8 *Buffer, int BufferSize){
@@ -122,14 +470,8 @@ TWriteBuffer PrepareQuery(int QueryType, uint8 *Buffer, int BufferSize){
 	return WriteBuffer;
 }
 
-int ExecuteQuery(TQueryManagerConnection *Connection, bool AutoReconnect,
-		TWriteBuffer *WriteBuffer, TReadBuffer *OutReadBuffer){
-	// IMPORTANT(fusion): This is similar to the Go version where there is no
-	// connection buffer, and the response is read into the same buffer used
-	// by `WriteBuffer. This helps prevent allocating and moving data around
-	// when reconnecting in the middle of a query.
+static bool FinishQuery(TWriteBuffer *WriteBuffer){
 	ASSERT(WriteBuffer != NULL && WriteBuffer->Position > 2);
-
 	int RequestSize = WriteBuffer->Position - 2;
 	if(RequestSize < 0xFFFF){
 		WriteBuffer->Rewrite16(0, (uint16)RequestSize);
@@ -140,129 +482,935 @@ int ExecuteQuery(TQueryManagerConnection *Connection, bool AutoReconnect,
 
 	if(WriteBuffer->Overflowed()){
 		LOG_ERR("Write buffer overflowed when writing request");
+		return false;
+	}
+
+	return true;
+}
+
+int ExecuteQuery(TQueryManagerConnection *Connection,
+		int64 Deadline, TWriteBuffer *WriteBuffer, TReadBuffer *OutReadBuffer){
+	// IMPORTANT(fusion): This is similar to the Go version where there is no
+	// connection buffer, and the response is read into the same buffer used
+	// by `WriteBuffer. This helps prevent allocating and moving data around.
+	if(!FinishQuery(WriteBuffer)){
 		return QUERY_STATUS_FAILED;
 	}
 
-	const int MaxAttempts = 2;
+	if(Connection->Socket == -1){
+		return QUERY_STATUS_FAILED;
+	}
+
+	// NOTE(fusion): A query that timed out may still be answered later, which
+	// would leave the stream out of sync, so the connection is always dropped
+	// and the query is never retried.
 	uint8 *Buffer = WriteBuffer->Buffer;
 	int BufferSize = WriteBuffer->Size;
 	int WriteSize = WriteBuffer->Position;
-	for(int Attempt = 1; true; Attempt += 1){
-		if(!IsConnected(Connection) && (!AutoReconnect || !Connect(Connection))){
-			return QUERY_STATUS_FAILED;
+	int Status = WriteExact(Connection->Socket, Buffer, WriteSize, Deadline);
+	if(Status != QUERY_STATUS_OK){
+		Disconnect(Connection);
+		if(Status == QUERY_STATUS_TIMEOUT){
+			LOG_ERR("Timed out writing request");
+		}else{
+			LOG_ERR("Failed to write request");
 		}
+		return Status;
+	}
 
-		if(!WriteExact(Connection->Socket, Buffer, WriteSize)){
+	uint8 Help[4];
+	Status = ReadExact(Connection->Socket, Help, 2, Deadline);
+	if(Status != QUERY_STATUS_OK){
+		Disconnect(Connection);
+		if(Status == QUERY_STATUS_TIMEOUT){
+			LOG_ERR("Timed out reading response size");
+		}else{
+			LOG_ERR("Failed to read response size");
+		}
+		return Status;
+	}
+
+	int ResponseSize = BufferRead16LE(Help);
+	if(ResponseSize == 0xFFFF){
+		Status = ReadExact(Connection->Socket, Help, 4, Deadline);
+		if(Status != QUERY_STATUS_OK){
 			Disconnect(Connection);
-			if(Attempt >= MaxAttempts){
-				LOG_ERR("Failed to write request");
-				return QUERY_STATUS_FAILED;
+			LOG_ERR("Failed to read response extended size (%d)", Status);
+			return Status;
+		}
+		ResponseSize = BufferRead32LE(Help);
+	}
+
+	if(ResponseSize <= 0 || ResponseSize > BufferSize){
+		Disconnect(Connection);
+		LOG_ERR("Invalid response size %d (BufferSize: %d)",
+				ResponseSize, BufferSize);
+		return QUERY_STATUS_FAILED;
+	}
+
+	Status = ReadExact(Connection->Socket, Buffer, ResponseSize, Deadline);
+	if(Status != QUERY_STATUS_OK){
+		Disconnect(Connection);
+		LOG_ERR("Failed to read response (%d)", Status);
+		return Status;
+	}
+
+	TReadBuffer ReadBuffer(Buffer, ResponseSize);
+	Status = ReadBuffer.Read8();
+	if(OutReadBuffer){
+		*OutReadBuffer = ReadBuffer;
+	}
+	return Status;
+}
+
+// Asynchronous Queries
+//==============================================================================
+// NOTE(fusion): Each worker has its own pool of query manager connections,
+// which are driven by its event loop, so it never blocks waiting for a
+// response. Queries are handed to connections in submission order, and each
+// connection may have up to `QueryManagerPipelineDepth` of them written back
+// to back, since the query manager answers them in order. Logins waiting on
+// them are parked in the QUERYING state until their callback is called.
+//  Every query has a deadline, and so does every request in flight, which
+// `ExpireQueries` enforces from the event loop.
+bool InitQueryManagerPool(TQueryManagerPool *Pool, int NumConnections){
+	ASSERT(NumConnections > 0);
+	memset(Pool, 0, sizeof(TQueryManagerPool));
+	Pool->Connections = (TQueryManagerConnection*)calloc(
+			NumConnections, sizeof(TQueryManagerConnection));
+	if(Pool->Connections == NULL){
+		LOG_ERR("Failed to allocate query manager connections");
+		return false;
+	}
+
+	Pool->NumConnections = NumConnections;
+	for(int i = 0; i < NumConnections; i += 1){
+		Pool->Connections[i].Pool = Pool;
+		Pool->Connections[i].Socket = -1;
+	}
+
+	Pool->NextDeadline = INT64_MAX;
+	Pool->RandomSeed = (uint32)rand() ^ (uint32)GetClockMonotonicMS();
+	Pool->Stats.StartTime = GetClockMonotonicMS();
+	return true;
+}
+
+void ExitQueryManagerPool(TQueryManagerPool *Pool){
+	// NOTE(fusion): Whoever owns the queries is also going away, so there is no
+	// point in calling their callbacks.
+	while(Pool->PendingHead != NULL){
+		CancelQuery(Pool, Pool->PendingHead);
+	}
+
+	if(Pool->Connections != NULL){
+		for(int i = 0; i < Pool->NumConnections; i += 1){
+			TQueryManagerConnection *Connection = &Pool->Connections[i];
+			for(int j = 0; j < QUERY_MAX_PIPELINE_DEPTH; j += 1){
+				Connection->InFlight[j].NumQueries = 0;
 			}
+			Disconnect(Connection);
+		}
+
+		free(Pool->Connections);
+		Pool->Connections = NULL;
+	}
+
+	Pool->NumConnections = 0;
+}
+
+int NumConnectedQueryManagers(TQueryManagerPool *Pool){
+	int Result = 0;
+	for(int i = 0; i < Pool->NumConnections; i += 1){
+		if(IsConnected(&Pool->Connections[i])){
+			Result += 1;
+		}
+	}
+	return Result;
+}
+
+int NumConnectingQueryManagers(TQueryManagerPool *Pool){
+	int Result = 0;
+	for(int i = 0; i < Pool->NumConnections; i += 1){
+		if(IsConnecting(&Pool->Connections[i])){
+			Result += 1;
+		}
+	}
+	return Result;
+}
+
+int NumBusyQueryManagers(TQueryManagerPool *Pool){
+	int Result = 0;
+	for(int i = 0; i < Pool->NumConnections; i += 1){
+		if(Pool->Connections[i].NumInFlight > 0){
+			Result += 1;
+		}
+	}
+	return Result;
+}
+
+int NumInFlightQueries(TQueryManagerPool *Pool){
+	int Result = 0;
+	for(int i = 0; i < Pool->NumConnections; i += 1){
+		TQueryManagerConnection *Connection = &Pool->Connections[i];
+		for(int j = 0; j < Connection->NumInFlight; j += 1){
+			int Index = (Connection->InFlightHead + j) % QUERY_MAX_PIPELINE_DEPTH;
+			Result += Connection->InFlight[Index].NumQueries;
+		}
+	}
+	return Result;
+}
+
+// NOTE(fusion): Busy time is only added when a connection goes idle, which a
+// connection with a full pipeline may never do, so ongoing busy periods are
+// added here, before stats are reported.
+void UpdateQueryManagerStats(TQueryManagerPool *Pool){
+	int64 Now = GetClockMonotonicMS();
+	for(int i = 0; i < Pool->NumConnections; i += 1){
+		TQueryManagerConnection *Connection = &Pool->Connections[i];
+		if(Connection->NumInFlight > 0){
+			Pool->Stats.BusyTime += Now - Connection->BusySince;
+			Connection->BusySince = Now;
+		}
+	}
+}
+
+void ResetQueryManagerStats(TQueryManagerPool *Pool){
+	memset(&Pool->Stats, 0, sizeof(TQueryManagerStats));
+	Pool->Stats.StartTime = GetClockMonotonicMS();
+}
+
+static void LinkPendingQuery(TQueryManagerPool *Pool, TQuery *Query){
+	ASSERT(!Query->Pending);
+	Query->Prev = Pool->PendingTail;
+	Query->Next = NULL;
+	if(Pool->PendingTail != NULL){
+		Pool->PendingTail->Next = Query;
+	}else{
+		Pool->PendingHead = Query;
+	}
+	Pool->PendingTail = Query;
+	Pool->NumPending += 1;
+	Query->Pending = true;
+}
+
+static void UnlinkPendingQuery(TQueryManagerPool *Pool, TQuery *Query){
+	ASSERT(Query->Pending);
+	if(Query->Prev != NULL){
+		Query->Prev->Next = Query->Next;
+	}else{
+		Pool->PendingHead = Query->Next;
+	}
+
+	if(Query->Next != NULL){
+		Query->Next->Prev = Query->Prev;
+	}else{
+		Pool->PendingTail = Query->Prev;
+	}
+
+	Query->Prev = NULL;
+	Query->Next = NULL;
+	Query->Pending = false;
+	Pool->NumPending -= 1;
+}
+
+static void ReplayQuery(TQueryManagerPool *Pool, TQuery *Query){
+	ASSERT(!Query->Pending);
+	Query->Prev = NULL;
+	Query->Next = Pool->PendingHead;
+	if(Pool->PendingHead != NULL){
+		Pool->PendingHead->Prev = Query;
+	}else{
+		Pool->PendingTail = Query;
+	}
+	Pool->PendingHead = Query;
+	Pool->NumPending += 1;
+	Pool->Stats.Replayed += 1;
+	Query->Pending = true;
+}
+
+static void WriteLoginAccount(TWriteBuffer *WriteBuffer, TQuery *Query){
+	WriteBuffer->Write32((uint32)Query->AccountID);
+	WriteBuffer->WriteString(Query->Password);
+	WriteBuffer->WriteString(Query->IPAddress);
+}
+
+static bool WriteQueryRequest(TQuery *Query, uint8 *Buffer, int BufferSize, int *OutSize){
+	TWriteBuffer WriteBuffer = PrepareQuery(Query->Type, Buffer, BufferSize);
+	switch(Query->Type){
+		case QUERY_LOGIN_ACCOUNT:{
+			WriteLoginAccount(&WriteBuffer, Query);
+			break;
+		}
+
+		case QUERY_GET_WORLDS:{
+			break;
+		}
+
+		default:{
+			LOG_ERR("Unknown query type %d", Query->Type);
+			return false;
+		}
+	}
+
+	if(!FinishQuery(&WriteBuffer)){
+		return false;
+	}
+
+	*OutSize = WriteBuffer.Position;
+	return true;
+}
+
+static bool WriteBatchRequest(TQuery **Queries, int NumQueries,
+		uint8 *Buffer, int BufferSize, int *OutSize){
+	TWriteBuffer WriteBuffer = PrepareQuery(QUERY_LOGIN_ACCOUNT_BATCH, Buffer, BufferSize);
+	WriteBuffer.Write8((uint8)NumQueries);
+	for(int i = 0; i < NumQueries; i += 1){
+		ASSERT(Queries[i]->Type == QUERY_LOGIN_ACCOUNT);
+		WriteLoginAccount(&WriteBuffer, Queries[i]);
+	}
+
+	if(!FinishQuery(&WriteBuffer)){
+		return false;
+	}
+
+	*OutSize = WriteBuffer.Position;
+	return true;
+}
+
+static void PopInFlight(TQueryManagerConnection *Connection){
+	ASSERT(Connection->NumInFlight > 0);
+	Connection->InFlight[Connection->InFlightHead].NumQueries = 0;
+	Connection->InFlightHead = (Connection->InFlightHead + 1) % QUERY_MAX_PIPELINE_DEPTH;
+	Connection->NumInFlight -= 1;
+	if(Connection->NumInFlight == 0){
+		Connection->Pool->Stats.BusyTime += GetClockMonotonicMS() - Connection->BusySince;
+	}
+}
+
+static void FlushQueryManager(TQueryManagerConnection *Connection){
+	while(Connection->Socket != -1 && Connection->WritePosition < Connection->WriteSize){
+		int BytesWritten = (int)write(Connection->Socket,
+				(Connection->WriteBuffer + Connection->WritePosition),
+				(Connection->WriteSize - Connection->WritePosition));
+		if(BytesWritten == -1){
+			if(errno != EAGAIN){
+				LOG_ERR("Failed to write to query manager: (%d) %s",
+						errno, strerrordesc_np(errno));
+				Disconnect(Connection);
+			}
+			break;
+		}
+
+		Connection->WritePosition += BytesWritten;
+	}
+}
+
+// NOTE(fusion): Every byte left in the write buffer belongs to a request in
+// flight, so it must hold a full pipeline of the largest requests.
+STATIC_ASSERT(QUERY_WRITE_BUFFER_SIZE >= QUERY_MAX_PIPELINE_DEPTH
+		* (16 + QUERY_MAX_BATCH_SIZE * (8 + sizeof(TQuery::Password) + sizeof(TQuery::IPAddress))));
+
+static void SendRequest(TQueryManagerConnection *Connection,
+		TQuery **Queries, int NumQueries, bool Batch){
+	ASSERT(NumQueries > 0 && NumQueries <= QUERY_MAX_BATCH_SIZE);
+	if(Connection->WritePosition > 0){
+		int Remaining = Connection->WriteSize - Connection->WritePosition;
+		memmove(Connection->WriteBuffer,
+				Connection->WriteBuffer + Connection->WritePosition,
+				Remaining);
+		Connection->WriteOffset += Connection->WritePosition;
+		Connection->WriteSize = Remaining;
+		Connection->WritePosition = 0;
+	}
+
+	int WriteSize;
+	uint8 *Buffer = Connection->WriteBuffer + Connection->WriteSize;
+	int BufferSize = (int)sizeof(Connection->WriteBuffer) - Connection->WriteSize;
+	bool Written = Batch
+		? WriteBatchRequest(Queries, NumQueries, Buffer, BufferSize, &WriteSize)
+		: WriteQueryRequest(Queries[0], Buffer, BufferSize, &WriteSize);
+	if(!Written){
+		for(int i = 0; i < NumQueries; i += 1){
+			Queries[i]->Callback(Queries[i], QUERY_STATUS_FAILED, NULL);
+		}
+		return;
+	}
+
+	TQueryManagerStats *Stats = &Connection->Pool->Stats;
+	int64 Now = GetClockMonotonicMS();
+	for(int i = 0; i < NumQueries; i += 1){
+		int64 WaitTime = Now - Queries[i]->SubmitTime;
+		Stats->Sent += 1;
+		Stats->WaitTime += WaitTime;
+		if(WaitTime > Stats->MaxWaitTime){
+			Stats->MaxWaitTime = WaitTime;
+		}
+	}
+
+	if(Batch){
+		Stats->Batches += 1;
+		Stats->Batched += NumQueries;
+	}
+
+	ASSERT(Connection->NumInFlight < QUERY_MAX_PIPELINE_DEPTH);
+	int Index = (Connection->InFlightHead + Connection->NumInFlight) % QUERY_MAX_PIPELINE_DEPTH;
+	TQueryInFlight *Entry = &Connection->InFlight[Index];
+	Connection->WriteSize += WriteSize;
+	Entry->Batch = Batch;
+	Entry->NumQueries = NumQueries;
+	memcpy(Entry->Queries, Queries, NumQueries * sizeof(TQuery*));
+	Entry->WriteEnd = Connection->WriteOffset + Connection->WriteSize;
+	Entry->Deadline = Now + g_Config.QueryManagerQueryTimeout;
+	if(Entry->Deadline < Connection->Pool->NextDeadline){
+		Connection->Pool->NextDeadline = Entry->Deadline;
+	}
+	if(Connection->NumInFlight == 0){
+		Connection->BusySince = Now;
+	}
+	Connection->NumInFlight += 1;
+}
+
+// NOTE(fusion): Logins that are waiting together are sent as a single batch,
+// if the connection supports it. They're picked from anywhere in the queue,
+// which may reorder them with other query types, but never among themselves.
+static void SendNextRequest(TQueryManagerConnection *Connection, int MaxBatchSize){
+	TQueryManagerPool *Pool = Connection->Pool;
+	TQuery *Queries[QUERY_MAX_BATCH_SIZE];
+	int NumQueries = 0;
+	if(Connection->BatchLogins && MaxBatchSize > 1
+			&& Pool->PendingHead->Type == QUERY_LOGIN_ACCOUNT){
+		TQuery *Query = Pool->PendingHead;
+		while(Query != NULL && NumQueries < MaxBatchSize){
+			TQuery *Next = Query->Next;
+			if(Query->Type == QUERY_LOGIN_ACCOUNT){
+				UnlinkPendingQuery(Pool, Query);
+				Queries[NumQueries] = Query;
+				NumQueries += 1;
+			}
+			Query = Next;
+		}
+	}else{
+		Queries[0] = Pool->PendingHead;
+		UnlinkPendingQuery(Pool, Queries[0]);
+		NumQueries = 1;
+	}
+
+	SendRequest(Connection, Queries, NumQueries, (NumQueries > 1));
+}
+
+void SendQueries(TQueryManagerPool *Pool){
+	int MaxDepth = g_Config.QueryManagerPipelineDepth;
+	if(MaxDepth < 1){
+		MaxDepth = 1;
+	}else if(MaxDepth > QUERY_MAX_PIPELINE_DEPTH){
+		MaxDepth = QUERY_MAX_PIPELINE_DEPTH;
+	}
+
+	int MaxBatchSize = g_Config.QueryManagerBatchSize;
+	if(MaxBatchSize > QUERY_MAX_BATCH_SIZE){
+		MaxBatchSize = QUERY_MAX_BATCH_SIZE;
+	}
+
+	// NOTE(fusion): Fill the shallowest pipelines first, so queries don't pile
+	// up behind a slow response while other connections are idle.
+	for(int Depth = 1; Depth <= MaxDepth && Pool->PendingHead != NULL; Depth += 1){
+		for(int i = 0; i < Pool->NumConnections && Pool->PendingHead != NULL; i += 1){
+			TQueryManagerConnection *Connection = &Pool->Connections[i];
+			if(IsConnected(Connection) && Connection->NumInFlight < Depth){
+				SendNextRequest(Connection, MaxBatchSize);
+			}
+		}
+	}
+
+	// NOTE(fusion): Requests are only flushed once they're all in, so a full
+	// pipeline usually goes out in a single write. Failed connections put
+	// their unsent queries back in the queue for the next call.
+	for(int i = 0; i < Pool->NumConnections; i += 1){
+		FlushQueryManager(&Pool->Connections[i]);
+	}
+}
+
+// NOTE(fusion): Submitted queries are only sent by `SendQueries`, which the
+// event loop calls once per iteration, so callbacks are never called from
+// inside `SubmitQuery`. The query's deadline is `QueryManagerQueryTimeout`
+// from now, unless the caller needs it sooner.
+void SubmitQuery(TQueryManagerPool *Pool, TQuery *Query, int64 Deadline){
+	ASSERT(Query->Callback != NULL);
+	Query->SubmitTime = GetClockMonotonicMS();
+	Query->Deadline = Query->SubmitTime + g_Config.QueryManagerQueryTimeout;
+	if(Deadline < Query->Deadline){
+		Query->Deadline = Deadline;
+	}
+
+	if(Query->Deadline < Pool->NextDeadline){
+		Pool->NextDeadline = Query->Deadline;
+	}
+
+	LinkPendingQuery(Pool, Query);
+}
+
+void CancelQuery(TQueryManagerPool *Pool, TQuery *Query){
+	if(Query->Pending){
+		UnlinkPendingQuery(Pool, Query);
+		return;
+	}
+
+	for(int i = 0; i < Pool->NumConnections; i += 1){
+		TQueryManagerConnection *Connection = &Pool->Connections[i];
+		for(int j = 0; j < Connection->NumInFlight; j += 1){
+			int Index = (Connection->InFlightHead + j) % QUERY_MAX_PIPELINE_DEPTH;
+			TQueryInFlight *Entry = &Connection->InFlight[Index];
+			for(int k = 0; k < Entry->NumQueries; k += 1){
+				if(Entry->Queries[k] == Query){
+					Entry->Queries[k] = NULL;
+					return;
+				}
+			}
+		}
+	}
+}
+
+void FailPendingQueries(TQueryManagerPool *Pool){
+	while(Pool->PendingHead != NULL){
+		TQuery *Query = Pool->PendingHead;
+		UnlinkPendingQuery(Pool, Query);
+		Query->Callback(Query, QUERY_STATUS_FAILED, NULL);
+	}
+}
+
+static void CountTimeout(TQueryManagerPool *Pool, TQuery *Query){
+	switch(Query->Type){
+		case QUERY_LOGIN_ACCOUNT:	Pool->Stats.LoginTimeouts += 1; break;
+		case QUERY_GET_WORLDS:		Pool->Stats.GetWorldsTimeouts += 1; break;
+		default:					break;
+	}
+}
+
+static bool CompleteQuery(TQueryManagerConnection *Connection,
+		TQueryInFlight *Entry, int Index, int Status, TReadBuffer *Response);
+
+static int64 NextQueryDeadline(TQueryManagerPool *Pool){
+	int64 Result = INT64_MAX;
+	for(int i = 0; i < Pool->NumConnections; i += 1){
+		TQueryManagerConnection *Connection = &Pool->Connections[i];
+		if(!IsConnected(Connection) || Connection->NumInFlight == 0){
 			continue;
 		}
 
-		uint8 Help[4];
-		if(!ReadExact(Connection->Socket, Help, 2)){
-			Disconnect(Connection);
-			if(Attempt >= MaxAttempts){
-				LOG_ERR("Failed to read response size");
-				return QUERY_STATUS_FAILED;
+		TQueryInFlight *Head = &Connection->InFlight[Connection->InFlightHead];
+		if(Head->Deadline < Result){
+			Result = Head->Deadline;
+		}
+
+		for(int j = 0; j < Connection->NumInFlight; j += 1){
+			int Index = (Connection->InFlightHead + j) % QUERY_MAX_PIPELINE_DEPTH;
+			TQueryInFlight *Entry = &Connection->InFlight[Index];
+			for(int k = 0; k < Entry->NumQueries; k += 1){
+				TQuery *Query = Entry->Queries[k];
+				if(Query != NULL && Query->Deadline < Result){
+					Result = Query->Deadline;
+				}
 			}
+		}
+	}
+
+	for(TQuery *Query = Pool->PendingHead; Query != NULL; Query = Query->Next){
+		if(Query->Deadline < Result){
+			Result = Query->Deadline;
+		}
+	}
+
+	return Result;
+}
+
+// NOTE(fusion): Responses come back in order, so only the oldest request in
+// flight on each connection needs to be checked. If it's late, the connection
+// is dropped, because its response may still arrive and there's no way to tell
+// it apart from the next one. Requests behind it are then replayed or failed by
+// `Disconnect`, as usual. Otherwise, queries that are past their own deadline
+// are failed right away, leaving their responses to be discarded when they
+// arrive. This is called on every iteration of the event loop, but it only
+// does any work once the earliest deadline has passed.
+void ExpireQueries(TQueryManagerPool *Pool, int64 Now){
+	if(Now < Pool->NextDeadline){
+		return;
+	}
+
+	for(int i = 0; i < Pool->NumConnections; i += 1){
+		TQueryManagerConnection *Connection = &Pool->Connections[i];
+		if(!IsConnected(Connection) || Connection->NumInFlight == 0){
 			continue;
 		}
 
-		int ResponseSize = BufferRead16LE(Help);
-		if(ResponseSize == 0xFFFF){
-			if(!ReadExact(Connection->Socket, Help, 4)){
-				Disconnect(Connection);
-				LOG_ERR("Failed to read response extended size");
-				return QUERY_STATUS_FAILED;
+		TQueryInFlight *Head = &Connection->InFlight[Connection->InFlightHead];
+		if(Now >= Head->Deadline){
+			LOG_ERR("Query manager didn't answer within %dms, dropping connection (%d/%d)",
+					g_Config.QueryManagerQueryTimeout, (i + 1), Pool->NumConnections);
+			Pool->Stats.StalledStreams += 1;
+			Pool->ConsecutiveFailures += 1;
+			for(int j = 0; j < Head->NumQueries; j += 1){
+				if(Head->Queries[j] != NULL){
+					CountTimeout(Pool, Head->Queries[j]);
+				}
+
+				if(!CompleteQuery(Connection, Head, j, QUERY_STATUS_TIMEOUT, NULL)){
+					break;
+				}
+			}
+			Disconnect(Connection);
+			continue;
+		}
+
+		for(int j = 0; j < Connection->NumInFlight && Connection->Socket != -1; j += 1){
+			int Index = (Connection->InFlightHead + j) % QUERY_MAX_PIPELINE_DEPTH;
+			TQueryInFlight *Entry = &Connection->InFlight[Index];
+			for(int k = 0; k < Entry->NumQueries; k += 1){
+				TQuery *Query = Entry->Queries[k];
+				if(Query != NULL && Now >= Query->Deadline){
+					CountTimeout(Pool, Query);
+					if(!CompleteQuery(Connection, Entry, k, QUERY_STATUS_TIMEOUT, NULL)){
+						break;
+					}
+				}
 			}
-			ResponseSize = BufferRead32LE(Help);
 		}
+	}
 
-		if(ResponseSize <= 0 || ResponseSize > BufferSize){
+	// NOTE(fusion): Expired queries are unlinked before any callback is called,
+	// since callbacks may submit or cancel other queries.
+	TQuery *ExpiredHead = NULL;
+	TQuery *ExpiredTail = NULL;
+	TQuery *Query = Pool->PendingHead;
+	while(Query != NULL){
+		TQuery *Next = Query->Next;
+		if(Now >= Query->Deadline){
+			UnlinkPendingQuery(Pool, Query);
+			if(ExpiredTail != NULL){
+				ExpiredTail->Next = Query;
+			}else{
+				ExpiredHead = Query;
+			}
+			ExpiredTail = Query;
+		}
+		Query = Next;
+	}
+
+	while(ExpiredHead != NULL){
+		Query = ExpiredHead;
+		ExpiredHead = Query->Next;
+		Query->Next = NULL;
+		CountTimeout(Pool, Query);
+		Query->Callback(Query, QUERY_STATUS_TIMEOUT, NULL);
+	}
+
+	Pool->NextDeadline = NextQueryDeadline(Pool);
+}
+
+bool HasPendingQueries(TQueryManagerPool *Pool){
+	return Pool->PendingHead != NULL;
+}
+
+bool QueryManagerWantsWrite(TQueryManagerConnection *Connection){
+	return Connection->Socket != -1
+		&& (Connection->State == QUERY_MANAGER_CONNECTING
+			|| Connection->WritePosition < Connection->WriteSize);
+}
+
+static bool CompleteQuery(TQueryManagerConnection *Connection,
+		TQueryInFlight *Entry, int Index, int Status, TReadBuffer *Response){
+	TQuery *Query = Entry->Queries[Index];
+	Entry->Queries[Index] = NULL;
+	if(Query != NULL){
+		Query->Callback(Query, Status, Response);
+	}
+
+	// NOTE(fusion): The callback may have caused the connection to be reset, in
+	// which case the rest of the entry has already been failed.
+	return Connection->Socket != -1;
+}
+
+// NOTE(fusion): The entry is kept in place while callbacks are called, so the
+// queries it still holds may be cancelled or failed along the way.
+static bool CompleteInFlight(TQueryManagerConnection *Connection, TReadBuffer *Response){
+	TQueryInFlight *Entry = &Connection->InFlight[Connection->InFlightHead];
+	Connection->Pool->ConsecutiveFailures = 0;
+	int Status = Response->Read8();
+	if(!Entry->Batch){
+		return CompleteQuery(Connection, Entry, 0, Status, Response);
+	}
+
+	if(Status != QUERY_STATUS_OK){
+		LOG_ERR("Login batch failed (%d)", Status);
+		for(int i = 0; i < Entry->NumQueries; i += 1){
+			if(!CompleteQuery(Connection, Entry, i, QUERY_STATUS_FAILED, NULL)){
+				return false;
+			}
+		}
+		return true;
+	}
+
+	int NumResults = Response->Read8();
+	if(NumResults != Entry->NumQueries){
+		LOG_ERR("Expected %d results in login batch, got %d",
+				Entry->NumQueries, NumResults);
+		Disconnect(Connection);
+		return false;
+	}
+
+	for(int i = 0; i < Entry->NumQueries; i += 1){
+		int ResultSize = Response->Read16();
+		if(ResultSize <= 0 || !Response->CanRead(ResultSize)){
+			LOG_ERR("Invalid login batch result size %d", ResultSize);
 			Disconnect(Connection);
+			return false;
+		}
+
+		TReadBuffer Result(Response->Buffer + Response->Position, ResultSize);
+		Response->Position += ResultSize;
+		int ResultStatus = Result.Read8();
+		if(!CompleteQuery(Connection, Entry, i, ResultStatus, &Result)){
+			return false;
+		}
+	}
+
+	return true;
+}
+
+// NOTE(fusion): Handshake requests are written on their own, before anything
+// else, so they don't need to be tracked as queries in flight.
+static bool WriteHandshake(TQueryManagerConnection *Connection, bool Probe){
+	ASSERT(Connection->WritePosition == Connection->WriteSize);
+	Connection->WriteOffset += Connection->WriteSize;
+	Connection->WriteSize = 0;
+	Connection->WritePosition = 0;
+
+	TWriteBuffer WriteBuffer = Probe
+		? PrepareBatchProbe(Connection->WriteBuffer, sizeof(Connection->WriteBuffer))
+		: PrepareLogin(Connection->WriteBuffer, sizeof(Connection->WriteBuffer));
+	if(!FinishQuery(&WriteBuffer)){
+		Disconnect(Connection);
+		return false;
+	}
+
+	Connection->WriteSize = WriteBuffer.Position;
+	FlushQueryManager(Connection);
+	return Connection->Socket != -1;
+}
+
+static bool ProcessHandshakeResponse(TQueryManagerConnection *Connection, TReadBuffer *Response){
+	int Status = Response->Read8();
+	if(Connection->State == QUERY_MANAGER_LOGGING_IN){
+		if(Status != QUERY_STATUS_OK){
+			LOG_ERR("Failed to login to query manager (%d)", Status);
+			Disconnect(Connection);
+			return false;
+		}
+
+		if(!Connection->Pool->SkipBatchProbe){
+			Connection->State = QUERY_MANAGER_PROBING;
+			return WriteHandshake(Connection, true);
+		}
+	}else if(Connection->State == QUERY_MANAGER_PROBING){
+		Connection->BatchLogins = (Status == QUERY_STATUS_OK);
+	}else{
+		LOG_ERR("Unexpected response from query manager");
+		Disconnect(Connection);
+		return false;
+	}
+
+	Connection->State = QUERY_MANAGER_READY;
+	return true;
+}
+
+static void ProcessQueryResponses(TQueryManagerConnection *Connection){
+	int Offset = 0;
+	while(true){
+		uint8 *Data = Connection->ReadBuffer + Offset;
+		int Available = Connection->ReadPosition - Offset;
+		if(Available < 2){
+			break;
+		}
+
+		int HeaderSize = 2;
+		int ResponseSize = BufferRead16LE(Data);
+		if(ResponseSize == 0xFFFF){
+			if(Available < 6){
+				break;
+			}
+
+			HeaderSize = 6;
+			ResponseSize = BufferRead32LE(Data + 2);
+		}
+
+		if(ResponseSize <= 0 || ResponseSize > (QUERY_READ_BUFFER_SIZE - HeaderSize)){
 			LOG_ERR("Invalid response size %d (BufferSize: %d)",
-					ResponseSize, BufferSize);
-			return QUERY_STATUS_FAILED;
+					ResponseSize, QUERY_READ_BUFFER_SIZE);
+			Disconnect(Connection);
+			return;
+		}
+
+		if(Available < (HeaderSize + ResponseSize)){
+			break;
+		}
+
+		TReadBuffer ReadBuffer(Data + HeaderSize, ResponseSize);
+		Offset += HeaderSize + ResponseSize;
+		if(Connection->State != QUERY_MANAGER_READY){
+			if(!ProcessHandshakeResponse(Connection, &ReadBuffer)){
+				return;
+			}
+			continue;
 		}
 
-		if(!ReadExact(Connection->Socket, Buffer, ResponseSize)){
+		if(Connection->NumInFlight == 0){
+			LOG_ERR("Unexpected response from query manager");
 			Disconnect(Connection);
-			LOG_ERR("Failed to read response");
-			return QUERY_STATUS_FAILED;
+			return;
 		}
 
-		TReadBuffer ReadBuffer(Buffer, ResponseSize);
-		int Status = ReadBuffer.Read8();
-		if(OutReadBuffer){
-			*OutReadBuffer = ReadBuffer;
+		if(!CompleteInFlight(Connection, &ReadBuffer)){
+			return;
 		}
-		return Status;
+		PopInFlight(Connection);
+	}
+
+	if(Offset > 0){
+		memmove(Connection->ReadBuffer, Connection->ReadBuffer + Offset,
+				Connection->ReadPosition - Offset);
+		Connection->ReadPosition -= Offset;
 	}
+
+	SendQueries(Connection->Pool);
 }
 
-int LoginAccount(int AccountID, const char *Password, const char *IPAddress,
+void ProcessQueryManager(TQueryManagerConnection *Connection, int Events){
+	// NOTE(fusion): A pending connect completes when the socket is reported as
+	// writable, or failed, after which the handshake starts.
+	if(Connection->State == QUERY_MANAGER_CONNECTING){
+		if((Events & (EPOLLOUT | EPOLLERR | EPOLLHUP)) == 0){
+			return;
+		}
+
+		int ErrCode = 0;
+		socklen_t ErrCodeLen = sizeof(ErrCode);
+		if(getsockopt(Connection->Socket, SOL_SOCKET, SO_ERROR, &ErrCode, &ErrCodeLen) == -1){
+			ErrCode = errno;
+		}
+
+		if(ErrCode != 0){
+			LOG_ERR("Failed to connect: (%d) %s", ErrCode, strerrordesc_np(ErrCode));
+			Disconnect(Connection);
+			RefreshQueryManagerAddress();
+			return;
+		}
+
+		Connection->State = QUERY_MANAGER_LOGGING_IN;
+		if(!WriteHandshake(Connection, false)){
+			return;
+		}
+	}
+
+	// NOTE(fusion): The socket is registered in edge-triggered mode, so both
+	// input and output need to be consumed until `EAGAIN`. Errors and hangups
+	// are reported by `read` as well.
+	if((Events & EPOLLOUT) != 0){
+		FlushQueryManager(Connection);
+	}
+
+	if((Events & (EPOLLIN | EPOLLERR | EPOLLHUP)) == 0){
+		return;
+	}
+
+	while(Connection->Socket != -1){
+		int ReadSize = QUERY_READ_BUFFER_SIZE - Connection->ReadPosition;
+		int BytesRead = (int)read(Connection->Socket,
+				(Connection->ReadBuffer + Connection->ReadPosition), ReadSize);
+		if(BytesRead == -1){
+			if(errno != EAGAIN){
+				LOG_ERR("Failed to read from query manager: (%d) %s",
+						errno, strerrordesc_np(errno));
+				Disconnect(Connection);
+			}
+			break;
+		}else if(BytesRead == 0){
+			LOG_WARN("Query manager closed the connection");
+			Disconnect(Connection);
+			break;
+		}
+
+		Connection->ReadPosition += BytesRead;
+		ProcessQueryResponses(Connection);
+		if(BytesRead < ReadSize){
+			break;
+		}
+	}
+}
+
+// Queries
+//==============================================================================
+void PrepareLoginAccount(TQuery *Query, int AccountID,
+		const char *Password, const char *IPAddress){
+	Query->Type = QUERY_LOGIN_ACCOUNT;
+	Query->AccountID = AccountID;
+	StringBufCopy(Query->Password, Password);
+	StringBufCopy(Query->IPAddress, IPAddress);
+}
+
+int LoginAccountResult(int Status, TReadBuffer *Response,
 		int MaxCharacters, int *NumCharacters, TCharacterLoginData *Characters,
 		int *PremiumDays){
-	uint8 Buffer[KB(4)];
-	TWriteBuffer WriteBuffer = PrepareQuery(QUERY_LOGIN_ACCOUNT, Buffer, sizeof(Buffer));
-	WriteBuffer.Write32((uint32)AccountID);
-	WriteBuffer.WriteString(Password);
-	WriteBuffer.WriteString(IPAddress);
-
-	TReadBuffer ReadBuffer;
-	int Status = ExecuteQuery(g_QueryManagerConnection, true, &WriteBuffer, &ReadBuffer);
 	int Result = (Status == QUERY_STATUS_OK ? 0 : -1);
 	if(Status == QUERY_STATUS_OK){
-		*NumCharacters = ReadBuffer.Read8();
+		*NumCharacters = Response->Read8();
 		if(*NumCharacters > MaxCharacters){
 			LOG_ERR("Too many characters");
 			return -1;
 		}
 
 		for(int i = 0; i < *NumCharacters; i += 1){
-			ReadBuffer.ReadString(Characters[i].Name, sizeof(Characters[i].Name));
-			ReadBuffer.ReadString(Characters[i].WorldName, sizeof(Characters[i].WorldName));
-			Characters[i].WorldAddress = ReadBuffer.Read32BE();
-			Characters[i].WorldPort = ReadBuffer.Read16();
+			Response->ReadString(Characters[i].Name, sizeof(Characters[i].Name));
+			Response->ReadString(Characters[i].WorldName, sizeof(Characters[i].WorldName));
+			Characters[i].WorldAddress = Response->Read32BE();
+			Characters[i].WorldPort = Response->Read16();
 		}
 
-		*PremiumDays = ReadBuffer.Read16();
+		*PremiumDays = Response->Read16();
 	}else if(Status == QUERY_STATUS_ERROR){
-		int ErrorCode = ReadBuffer.Read8();
+		int ErrorCode = Response->Read8();
 		if(ErrorCode >= 1 && ErrorCode <= 6){
 			Result = ErrorCode;
 		}else{
 			LOG_ERR("Invalid error code %d", ErrorCode);
 		}
+	}else if(Status == QUERY_STATUS_TIMEOUT){
+		LOG_ERR("Request timed out");
 	}else{
 		LOG_ERR("Request failed");
 	}
 	return Result;
 }
 
-int GetWorld(const char *WorldName, TWorld *OutWorld){
+void PrepareGetWorlds(TQuery *Query){
+	Query->Type = QUERY_GET_WORLDS;
+}
+
+int GetWorldResult(int Status, TReadBuffer *Response,
+		const char *WorldName, TWorld *OutWorld){
 	ASSERT(WorldName && OutWorld);
-	uint8 Buffer[4096];
-	TReadBuffer ReadBuffer;
-	TWriteBuffer WriteBuffer = PrepareQuery(QUERY_GET_WORLDS, Buffer, sizeof(Buffer));
-	int Status = ExecuteQuery(g_QueryManagerConnection, true, &WriteBuffer, &ReadBuffer);
 	int Result = (Status == QUERY_STATUS_OK ? 0 : -1);
 	memset(OutWorld, 0, sizeof(TWorld));
 	if(Status == QUERY_STATUS_OK){
-		int NumWorlds = (int)ReadBuffer.Read8();
+		int NumWorlds = (int)Response->Read8();
 		for(int i = 0; i < NumWorlds; i += 1){
 			TWorld World = {};
-			ReadBuffer.ReadString(World.Name, sizeof(World.Name));
-			World.Type = (int)ReadBuffer.Read8();
-			World.NumPlayers = (int)ReadBuffer.Read16();
-			World.MaxPlayers = (int)ReadBuffer.Read16();
-			World.OnlinePeak = (int)ReadBuffer.Read16();
-			World.OnlinePeakTimestamp = (int)ReadBuffer.Read32();
-			World.LastStartup = (int)ReadBuffer.Read32();
-			World.LastShutdown = (int)ReadBuffer.Read32();
+			Response->ReadString(World.Name, sizeof(World.Name));
+			World.Type = (int)Response->Read8();
+			World.NumPlayers = (int)Response->Read16();
+			World.MaxPlayers = (int)Response->Read16();
+			World.OnlinePeak = (int)Response->Read16();
+			World.OnlinePeakTimestamp = (int)Response->Read32();
+			World.LastStartup = (int)Response->Read32();
+			World.LastShutdown = (int)Response->Read32();
 
 			if(StringEmpty(WorldName)){
 				// NOTE(fusion): Pick the world with the most players.
@@ -274,28 +1422,10 @@ int GetWorld(const char *WorldName, TWorld *OutWorld){
 				break;
 			}
 		}
+	}else if(Status == QUERY_STATUS_TIMEOUT){
+		LOG_ERR("Request timed out");
 	}else{
 		LOG_ERR("Request failed");
 	}
 	return Result;
 }
-
-bool InitQuery(void){
-	ASSERT(g_QueryManagerConnection == NULL);
-	g_QueryManagerConnection = (TQueryManagerConnection*)calloc(1, sizeof(TQueryManagerConnection));
-	g_QueryManagerConnection->Socket = -1;
-	if(!Connect(g_QueryManagerConnection)){
-		LOG_ERR("Failed to connect to query manager");
-		return false;
-	}
-	return true;
-}
-
-void ExitQuery(void){
-	if(g_QueryManagerConnection != NULL){
-		Disconnect(g_QueryManagerConnection);
-		free(g_QueryManagerConnection);
-		g_QueryManagerConnection = NULL;
-	}
-}
-
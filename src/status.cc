@@ -1,6 +1,14 @@
 #include "common.hh"
 
+#include <pthread.h>
+
+// NOTE(fusion): The status string is shared between all workers, and is only
+// refreshed once every `MinStatusInterval`. The world data is queried without
+// holding the lock, by a single request at a time, while other requests keep
+// getting the current string.
+static pthread_mutex_t g_StatusMutex = PTHREAD_MUTEX_INITIALIZER;
 static int g_LastStatusRefresh;
+static bool g_StatusRefreshing;
 static char g_StatusString[KB(2)];
 
 struct XMLBuffer{
@@ -147,69 +155,109 @@ static void XMLAppendStringF(XMLBuffer *Buffer, const char *Format, ...){
 	va_end(Args);
 }
 
-const char *GetStatusString(void){
-	int TimeNow = (int)time(NULL);
-	if((TimeNow - g_LastStatusRefresh) >= g_Config.MinStatusInterval){
-		const char *WorldName = "";
-		int Uptime = 0;
-		int NumPlayers = 0;
-		int MaxPlayers = 0;
-		int OnlinePeak = 0;
-
-		TWorld World = {};
-		if(GetWorld(g_Config.StatusWorld, &World) == 0){
-			WorldName = World.Name;
-			if(World.LastStartup != 0 && World.LastStartup > World.LastShutdown){
-				Uptime = TimeNow - World.LastStartup;
-			}
-			NumPlayers = World.NumPlayers;
-			MaxPlayers = World.MaxPlayers;
-			OnlinePeak = World.OnlinePeak;
-
-			// IMPORTANT(fusion): This could be a common behaviour but, on OTSERVLIST,
-			// the server will show as OFFLINE if the the online peak is less than
-			// the number of online players. This shouldn't usually be a problem since
-			// the online character list and online peak are updated together in the
-			// same CREATE_PLAYERLIST query, but is something to keep in mind.
-			if(OnlinePeak < NumPlayers){
-				OnlinePeak = NumPlayers;
-			}
-		}else{
-			LOG_ERR("Failed to query world data...");
+// NOTE(fusion): Must be called with the status mutex held.
+static void BuildStatusString(const char *WorldName, int Uptime,
+		int NumPlayers, int MaxPlayers, int OnlinePeak){
+	// NOTE(fusion): Skip line with MOTD hash.
+	const char *Motd = g_Config.Motd;
+	while(Motd[0]){
+		if(Motd[0] == '\n'){
+			Motd += 1;
+			break;
 		}
+		Motd += 1;
+	}
 
-		// NOTE(fusion): Skip line with MOTD hash.
-		const char *Motd = g_Config.Motd;
-		while(Motd[0]){
-			if(Motd[0] == '\n'){
-				Motd += 1;
-				break;
-			}
-			Motd += 1;
+	XMLBuffer Buffer = {};
+	Buffer.Data = g_StatusString;
+	Buffer.Size = sizeof(g_StatusString);
+	XMLAppendString(&Buffer, "<?xml version=\"1.0\" encoding=\"UTF-8\"?>");
+	XMLAppendString(&Buffer, "<tsqp version=\"1.0\">");
+	XMLAppendStringF(&Buffer,
+			"<serverinfo servername=\"%s\" uptime=\"%d\" url=\"%s\""
+				" location=\"%s\" server=\"%s\" version=\"%s\""
+				" client=\"%s\"/>",
+			WorldName, Uptime, g_Config.Url, g_Config.Location,
+			g_Config.ServerType, g_Config.ServerVersion,
+			g_Config.ClientVersion);
+	XMLAppendStringF(&Buffer,
+			"<players online=\"%d\" max=\"%d\" peak=\"%d\"/>",
+			NumPlayers, MaxPlayers, OnlinePeak);
+	XMLAppendStringF(&Buffer, "<motd>%s</motd>", Motd);
+	XMLAppendString(&Buffer, "</tsqp>");
+	XMLNullTerminate(&Buffer);
+}
+
+// NOTE(fusion): Builds a status string from the config alone, so requests that
+// arrive while the first refresh is still waiting on the query manager don't
+// get an empty response. The refresh time is left untouched, so the first
+// request still starts a refresh.
+void InitStatus(void){
+	pthread_mutex_lock(&g_StatusMutex);
+	BuildStatusString(g_Config.StatusWorld, 0, 0, 0, 0);
+	pthread_mutex_unlock(&g_StatusMutex);
+}
+
+bool BeginStatusRefresh(void){
+	pthread_mutex_lock(&g_StatusMutex);
+	bool Result = false;
+	int TimeNow = (int)time(NULL);
+	if(!g_StatusRefreshing && (TimeNow - g_LastStatusRefresh) >= g_Config.MinStatusInterval){
+		g_StatusRefreshing = true;
+		Result = true;
+	}
+	pthread_mutex_unlock(&g_StatusMutex);
+	return Result;
+}
+
+void AbortStatusRefresh(void){
+	pthread_mutex_lock(&g_StatusMutex);
+	g_StatusRefreshing = false;
+	pthread_mutex_unlock(&g_StatusMutex);
+}
+
+void FinishStatusRefresh(const TWorld *World){
+	pthread_mutex_lock(&g_StatusMutex);
+	int TimeNow = (int)time(NULL);
+	const char *WorldName = "";
+	int Uptime = 0;
+	int NumPlayers = 0;
+	int MaxPlayers = 0;
+	int OnlinePeak = 0;
+	if(World != NULL){
+		WorldName = World->Name;
+		if(World->LastStartup != 0 && World->LastStartup > World->LastShutdown){
+			Uptime = TimeNow - World->LastStartup;
 		}
+		NumPlayers = World->NumPlayers;
+		MaxPlayers = World->MaxPlayers;
+		OnlinePeak = World->OnlinePeak;
 
-		XMLBuffer Buffer = {};
-		Buffer.Data = g_StatusString;
-		Buffer.Size = sizeof(g_StatusString);
-		XMLAppendString(&Buffer, "<?xml version=\"1.0\" encoding=\"UTF-8\"?>");
-		XMLAppendString(&Buffer, "<tsqp version=\"1.0\">");
-		XMLAppendStringF(&Buffer,
-				"<serverinfo servername=\"%s\" uptime=\"%d\" url=\"%s\""
-					" location=\"%s\" server=\"%s\" version=\"%s\""
-					" client=\"%s\"/>",
-				WorldName, Uptime, g_Config.Url, g_Config.Location,
-				g_Config.ServerType, g_Config.ServerVersion,
-				g_Config.ClientVersion);
-		XMLAppendStringF(&Buffer,
-				"<players online=\"%d\" max=\"%d\" peak=\"%d\"/>",
-				NumPlayers, MaxPlayers, OnlinePeak);
-		XMLAppendStringF(&Buffer, "<motd>%s</motd>", Motd);
-		XMLAppendString(&Buffer, "</tsqp>");
-		XMLNullTerminate(&Buffer);
-
-		g_LastStatusRefresh = TimeNow;
+		// IMPORTANT(fusion): This could be a common behaviour but, on OTSERVLIST,
+		// the server will show as OFFLINE if the the online peak is less than
+		// the number of online players. This shouldn't usually be a problem since
+		// the online character list and online peak are updated together in the
+		// same CREATE_PLAYERLIST query, but is something to keep in mind.
+		if(OnlinePeak < NumPlayers){
+			OnlinePeak = NumPlayers;
+		}
+	}else{
+		LOG_ERR("Failed to query world data...");
 	}
 
-	return g_StatusString;
+	BuildStatusString(WorldName, Uptime, NumPlayers, MaxPlayers, OnlinePeak);
+	g_LastStatusRefresh = TimeNow;
+	g_StatusRefreshing = false;
+	pthread_mutex_unlock(&g_StatusMutex);
 }
 
+int GetStatusString(char *Dest, int DestCapacity){
+	pthread_mutex_lock(&g_StatusMutex);
+	int Length = (int)strlen(g_StatusString);
+	if(Length > DestCapacity){
+		Length = DestCapacity;
+	}
+	memcpy(Dest, g_StatusString, Length);
+	pthread_mutex_unlock(&g_StatusMutex);
+	return Length;
+}
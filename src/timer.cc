@@ -0,0 +1,179 @@
+#include "common.hh"
+
+// NOTE(fusion): This is a hierarchical timer wheel with millisecond ticks. Each
+// level has 64 slots, with each slot spanning 64 times more ticks than a slot
+// from the level below. Timers are placed in the lowest level that can hold
+// their deadline and are cascaded down as the wheel advances, so starting and
+// stopping timers is O(1) and advancing is O(expired) plus the cascades, which
+// amortize to O(1) per timer per level.
+//  Each level also keeps a bitmap of occupied slots so finding the next timer
+// to expire doesn't need to look at empty slots.
+
+STATIC_ASSERT(TIMER_SLOTS == 64);
+
+static int TimerLevelShift(int Level){
+	return Level * 6;
+}
+
+static void TimerLink(TTimerWheel *Wheel, TTimer *Timer){
+	// NOTE(fusion): Timers that are already due are placed in the next tick,
+	// since the current one has already been processed.
+	int64 Deadline = Timer->Deadline;
+	if(Deadline <= Wheel->Time){
+		Deadline = Wheel->Time + 1;
+	}
+
+	int Level = 0;
+	int64 Delta = Deadline - Wheel->Time;
+	while(Level < (TIMER_LEVELS - 1)
+			&& Delta >= ((int64)1 << TimerLevelShift(Level + 1))){
+		Level += 1;
+	}
+
+	// NOTE(fusion): Clamp deadlines that don't fit in the wheel. They'll be
+	// cascaded down again when the last level wraps around.
+	int64 MaxDelta = ((int64)1 << TimerLevelShift(TIMER_LEVELS)) - 1;
+	if(Delta > MaxDelta){
+		Deadline = Wheel->Time + MaxDelta;
+	}
+
+	int Slot = (int)((Deadline >> TimerLevelShift(Level)) & (TIMER_SLOTS - 1));
+	TTimer **Head = &Wheel->Slots[Level][Slot];
+	Timer->Prev = NULL;
+	Timer->Next = *Head;
+	if(*Head != NULL){
+		(*Head)->Prev = Timer;
+	}
+	*Head = Timer;
+
+	Timer->Level = (uint8)Level;
+	Timer->Slot = (uint8)Slot;
+	Timer->Active = true;
+	Wheel->Occupied[Level] |= ((uint64)1 << Slot);
+}
+
+static void TimerUnlink(TTimerWheel *Wheel, TTimer *Timer){
+	ASSERT(Timer->Active);
+	TTimer **Head = &Wheel->Slots[Timer->Level][Timer->Slot];
+	if(Timer->Prev != NULL){
+		Timer->Prev->Next = Timer->Next;
+	}else{
+		*Head = Timer->Next;
+	}
+
+	if(Timer->Next != NULL){
+		Timer->Next->Prev = Timer->Prev;
+	}
+
+	if(*Head == NULL){
+		Wheel->Occupied[Timer->Level] &= ~((uint64)1 << Timer->Slot);
+	}
+
+	Timer->Prev = NULL;
+	Timer->Next = NULL;
+	Timer->Active = false;
+}
+
+void TimerWheelInit(TTimerWheel *Wheel, int64 Time){
+	memset(Wheel, 0, sizeof(TTimerWheel));
+	Wheel->Time = Time;
+}
+
+void TimerStart(TTimerWheel *Wheel, TTimer *Timer, int64 Deadline){
+	if(Timer->Active){
+		TimerUnlink(Wheel, Timer);
+		Wheel->Count -= 1;
+	}
+
+	Timer->Deadline = Deadline;
+	TimerLink(Wheel, Timer);
+	Wheel->Count += 1;
+}
+
+void TimerStop(TTimerWheel *Wheel, TTimer *Timer){
+	if(Timer->Active){
+		TimerUnlink(Wheel, Timer);
+		Wheel->Count -= 1;
+	}
+}
+
+void TimerWheelAdvance(TTimerWheel *Wheel, int64 Time){
+	// NOTE(fusion): There is nothing to cascade or expire in an empty wheel, so
+	// we can skip ahead, which is important after long idle periods.
+	if(Wheel->Count == 0 && Time > Wheel->Time){
+		Wheel->Time = Time;
+		return;
+	}
+
+	while(Wheel->Time < Time){
+		Wheel->Time += 1;
+		int64 Tick = Wheel->Time;
+
+		// NOTE(fusion): Cascade from the highest level that crossed a slot
+		// boundary, so timers can keep moving down in the same tick.
+		int CascadeLevel = 0;
+		while((CascadeLevel + 1) < TIMER_LEVELS
+				&& (Tick & (((int64)1 << TimerLevelShift(CascadeLevel + 1)) - 1)) == 0){
+			CascadeLevel += 1;
+		}
+
+		for(int Level = CascadeLevel; Level > 0; Level -= 1){
+			int Slot = (int)((Tick >> TimerLevelShift(Level)) & (TIMER_SLOTS - 1));
+			TTimer *Timer = Wheel->Slots[Level][Slot];
+			Wheel->Slots[Level][Slot] = NULL;
+			Wheel->Occupied[Level] &= ~((uint64)1 << Slot);
+			while(Timer != NULL){
+				TTimer *Next = Timer->Next;
+				TimerLink(Wheel, Timer);
+				Timer = Next;
+			}
+		}
+
+		int Slot = (int)(Tick & (TIMER_SLOTS - 1));
+		while(Wheel->Slots[0][Slot] != NULL){
+			TTimer *Timer = Wheel->Slots[0][Slot];
+			TimerUnlink(Wheel, Timer);
+			Wheel->Count -= 1;
+			Timer->Callback(Timer);
+		}
+
+		if(Wheel->Count == 0){
+			Wheel->Time = Time;
+		}
+	}
+}
+
+int TimerWheelNextTimeout(TTimerWheel *Wheel, int64 Time){
+	if(Wheel->Count == 0){
+		return -1;
+	}
+
+	// NOTE(fusion): For the first level, this is the exact expiration time. For
+	// higher levels, it's when the slot will be cascaded down, which may wake
+	// us up a bit early but never late.
+	int64 Next = INT64_MAX;
+	for(int Level = 0; Level < TIMER_LEVELS; Level += 1){
+		uint64 Occupied = Wheel->Occupied[Level];
+		if(Occupied == 0){
+			continue;
+		}
+
+		int Shift = TimerLevelShift(Level);
+		int64 Boundary = ((Wheel->Time >> Shift) + 1) << Shift;
+		int Start = (int)((Boundary >> Shift) & (TIMER_SLOTS - 1));
+		uint64 Rotated = (Occupied >> Start) | (Start > 0 ? (Occupied << (TIMER_SLOTS - Start)) : 0);
+		int Offset = __builtin_ctzll(Rotated);
+		int64 Candidate = Boundary + ((int64)Offset << Shift);
+		if(Candidate < Next){
+			Next = Candidate;
+		}
+	}
+
+	int64 Timeout = Next - Time;
+	if(Timeout < 0){
+		Timeout = 0;
+	}else if(Timeout > INT32_MAX){
+		Timeout = INT32_MAX;
+	}
+	return (int)Timeout;
+}
@@ -0,0 +1,277 @@
+#include "common.hh"
+
+#include <errno.h>
+#include <linux/io_uring.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+// NOTE(fusion): This is a minimal wrapper around the raw io_uring interface,
+// similar to what liburing does, but only with what we actually use. We don't
+// use SQPOLL, so the kernel will only consume submissions inside `io_uring_enter`.
+
+static int SysIOUringSetup(uint32 Entries, io_uring_params *Params){
+	return (int)syscall(__NR_io_uring_setup, Entries, Params);
+}
+
+static int SysIOUringEnter(int Fd, uint32 ToSubmit, uint32 MinComplete,
+		uint32 Flags, void *Arg, size_t ArgSize){
+	return (int)syscall(__NR_io_uring_enter, Fd, ToSubmit, MinComplete, Flags, Arg, ArgSize);
+}
+
+static int SysIOUringRegister(int Fd, uint32 Opcode, void *Arg, uint32 NumArgs){
+	return (int)syscall(__NR_io_uring_register, Fd, Opcode, Arg, NumArgs);
+}
+
+bool IOUringInit(TIOUring *Ring, int Entries){
+	ASSERT(Ring != NULL && ISPOW2(Entries));
+	memset(Ring, 0, sizeof(TIOUring));
+	Ring->Fd = -1;
+
+	// NOTE(fusion): `COOP_TASKRUN` avoids interrupting the thread to run task
+	// work, which we don't need since we always enter the kernel to wait for
+	// completions anyway. It's only available on newer kernels so we fallback
+	// to no flags at all if setup fails.
+	io_uring_params Params = {};
+	Params.flags = IORING_SETUP_SUBMIT_ALL | IORING_SETUP_COOP_TASKRUN;
+	Ring->Fd = SysIOUringSetup((uint32)Entries, &Params);
+	if(Ring->Fd == -1 && errno == EINVAL){
+		Params = {};
+		Ring->Fd = SysIOUringSetup((uint32)Entries, &Params);
+	}
+
+	if(Ring->Fd == -1){
+		LOG_ERR("Failed to setup io_uring: (%d) %s", errno, strerrordesc_np(errno));
+		return false;
+	}
+
+	// NOTE(fusion): We need `EXT_ARG` to wait with a timeout, without having to
+	// submit timeout requests, and `NODROP` to make sure completions are never
+	// lost if the completion queue overflows.
+	uint32 RequiredFeatures = IORING_FEAT_SINGLE_MMAP
+			| IORING_FEAT_NODROP
+			| IORING_FEAT_EXT_ARG;
+	if((Params.features & RequiredFeatures) != RequiredFeatures){
+		LOG_ERR("Kernel is missing required io_uring features (Features: %08X, Required: %08X)",
+				Params.features, RequiredFeatures);
+		IOUringExit(Ring);
+		return false;
+	}
+
+	size_t SQRingSize = Params.sq_off.array + Params.sq_entries * sizeof(uint32);
+	size_t CQRingSize = Params.cq_off.cqes + Params.cq_entries * sizeof(io_uring_cqe);
+	Ring->RingSize = (SQRingSize > CQRingSize ? SQRingSize : CQRingSize);
+	Ring->RingPtr = mmap(NULL, Ring->RingSize, PROT_READ | PROT_WRITE,
+			MAP_SHARED | MAP_POPULATE, Ring->Fd, IORING_OFF_SQ_RING);
+	if(Ring->RingPtr == MAP_FAILED){
+		LOG_ERR("Failed to map io_uring rings: (%d) %s", errno, strerrordesc_np(errno));
+		Ring->RingPtr = NULL;
+		IOUringExit(Ring);
+		return false;
+	}
+
+	Ring->SQEsSize = Params.sq_entries * sizeof(io_uring_sqe);
+	Ring->SQEs = (io_uring_sqe*)mmap(NULL, Ring->SQEsSize, PROT_READ | PROT_WRITE,
+			MAP_SHARED | MAP_POPULATE, Ring->Fd, IORING_OFF_SQES);
+	if(Ring->SQEs == MAP_FAILED){
+		LOG_ERR("Failed to map io_uring submission entries: (%d) %s", errno, strerrordesc_np(errno));
+		Ring->SQEs = NULL;
+		IOUringExit(Ring);
+		return false;
+	}
+
+	uint8 *RingPtr = (uint8*)Ring->RingPtr;
+	Ring->SQHead = (uint32*)(RingPtr + Params.sq_off.head);
+	Ring->SQTail = (uint32*)(RingPtr + Params.sq_off.tail);
+	Ring->SQMask = *(uint32*)(RingPtr + Params.sq_off.ring_mask);
+	Ring->SQEntries = *(uint32*)(RingPtr + Params.sq_off.ring_entries);
+	Ring->SQLocalTail = *Ring->SQTail;
+	Ring->CQHead = (uint32*)(RingPtr + Params.cq_off.head);
+	Ring->CQTail = (uint32*)(RingPtr + Params.cq_off.tail);
+	Ring->CQMask = *(uint32*)(RingPtr + Params.cq_off.ring_mask);
+	Ring->CQEs = (io_uring_cqe*)(RingPtr + Params.cq_off.cqes);
+
+	// NOTE(fusion): Use an identity mapping for the submission array so we can
+	// index submission entries directly with the ring tail.
+	uint32 *SQArray = (uint32*)(RingPtr + Params.sq_off.array);
+	for(uint32 i = 0; i < Ring->SQEntries; i += 1){
+		SQArray[i] = i;
+	}
+
+	return true;
+}
+
+void IOUringExit(TIOUring *Ring){
+	if(Ring->SQEs != NULL){
+		munmap(Ring->SQEs, Ring->SQEsSize);
+		Ring->SQEs = NULL;
+	}
+
+	if(Ring->RingPtr != NULL){
+		munmap(Ring->RingPtr, Ring->RingSize);
+		Ring->RingPtr = NULL;
+	}
+
+	if(Ring->Fd != -1){
+		close(Ring->Fd);
+		Ring->Fd = -1;
+	}
+}
+
+io_uring_sqe *IOUringGetSQE(TIOUring *Ring){
+	uint32 Head = __atomic_load_n(Ring->SQHead, __ATOMIC_ACQUIRE);
+	if((Ring->SQLocalTail - Head) >= Ring->SQEntries){
+		// NOTE(fusion): The submission queue is full. Flush it without waiting
+		// for completions, which are processed by the caller later anyways.
+		if(IOUringSubmit(Ring, 0, 0) == -1){
+			return NULL;
+		}
+
+		Head = __atomic_load_n(Ring->SQHead, __ATOMIC_ACQUIRE);
+		if((Ring->SQLocalTail - Head) >= Ring->SQEntries){
+			return NULL;
+		}
+	}
+
+	io_uring_sqe *SQE = &Ring->SQEs[Ring->SQLocalTail & Ring->SQMask];
+	memset(SQE, 0, sizeof(io_uring_sqe));
+	Ring->SQLocalTail += 1;
+	return SQE;
+}
+
+bool IOUringReserve(TIOUring *Ring, int Count){
+	// NOTE(fusion): Linked submissions must be queued together, because flushing
+	// the queue in the middle of a chain would terminate it prematurely.
+	ASSERT(Count > 0 && (uint32)Count <= Ring->SQEntries);
+	uint32 Head = __atomic_load_n(Ring->SQHead, __ATOMIC_ACQUIRE);
+	if((Ring->SQLocalTail - Head + (uint32)Count) > Ring->SQEntries){
+		if(IOUringSubmit(Ring, 0, 0) == -1){
+			return false;
+		}
+
+		Head = __atomic_load_n(Ring->SQHead, __ATOMIC_ACQUIRE);
+		if((Ring->SQLocalTail - Head + (uint32)Count) > Ring->SQEntries){
+			return false;
+		}
+	}
+	return true;
+}
+
+int IOUringSubmit(TIOUring *Ring, int WaitCount, int TimeoutMS){
+	__atomic_store_n(Ring->SQTail, Ring->SQLocalTail, __ATOMIC_RELEASE);
+	uint32 ToSubmit = Ring->SQLocalTail - __atomic_load_n(Ring->SQHead, __ATOMIC_ACQUIRE);
+	if(ToSubmit == 0 && WaitCount == 0){
+		return 0;
+	}
+
+	uint32 Flags = 0;
+	io_uring_getevents_arg Arg = {};
+	__kernel_timespec Timeout = {};
+	if(WaitCount > 0){
+		Flags |= IORING_ENTER_GETEVENTS | IORING_ENTER_EXT_ARG;
+		if(TimeoutMS >= 0){
+			Timeout.tv_sec = TimeoutMS / 1000;
+			Timeout.tv_nsec = (TimeoutMS % 1000) * 1000000;
+			Arg.ts = (uint64)(uintptr_t)&Timeout;
+		}
+	}
+
+	int Result = SysIOUringEnter(Ring->Fd, ToSubmit, (uint32)WaitCount,
+			Flags, (Flags != 0 ? &Arg : NULL), (Flags != 0 ? sizeof(Arg) : 0));
+	if(Result == -1 && errno != ETIME && errno != EINTR){
+		LOG_ERR("Failed to enter io_uring: (%d) %s", errno, strerrordesc_np(errno));
+	}
+	return Result;
+}
+
+io_uring_cqe *IOUringPeekCQE(TIOUring *Ring){
+	uint32 Head = *Ring->CQHead;
+	uint32 Tail = __atomic_load_n(Ring->CQTail, __ATOMIC_ACQUIRE);
+	if(Head == Tail){
+		return NULL;
+	}
+	return &Ring->CQEs[Head & Ring->CQMask];
+}
+
+void IOUringAdvanceCQ(TIOUring *Ring){
+	__atomic_store_n(Ring->CQHead, *Ring->CQHead + 1, __ATOMIC_RELEASE);
+}
+
+bool IOBufferRingInit(TIOUring *Ring, TIOBufferRing *BufferRing,
+		int GroupID, int NumBuffers, int BufferSize){
+	ASSERT(Ring != NULL && BufferRing != NULL);
+	ASSERT(ISPOW2(NumBuffers) && NumBuffers <= 0x8000);
+	memset(BufferRing, 0, sizeof(TIOBufferRing));
+
+	// NOTE(fusion): The ring itself must be page aligned, which is why we're
+	// mapping it directly. Buffer memory doesn't have the same requirement.
+	BufferRing->RingSize = NumBuffers * sizeof(io_uring_buf);
+	BufferRing->Ring = (io_uring_buf_ring*)mmap(NULL, BufferRing->RingSize,
+			PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+	if(BufferRing->Ring == MAP_FAILED){
+		LOG_ERR("Failed to map buffer ring: (%d) %s", errno, strerrordesc_np(errno));
+		BufferRing->Ring = NULL;
+		return false;
+	}
+
+	BufferRing->Memory = (uint8*)calloc(NumBuffers, BufferSize);
+	if(BufferRing->Memory == NULL){
+		LOG_ERR("Failed to allocate %d buffers of %d bytes", NumBuffers, BufferSize);
+		IOBufferRingExit(BufferRing);
+		return false;
+	}
+
+	BufferRing->NumBuffers = NumBuffers;
+	BufferRing->BufferSize = BufferSize;
+	BufferRing->GroupID = GroupID;
+
+	io_uring_buf_reg Reg = {};
+	Reg.ring_addr = (uint64)(uintptr_t)BufferRing->Ring;
+	Reg.ring_entries = (uint32)NumBuffers;
+	Reg.bgid = (uint16)GroupID;
+	if(SysIOUringRegister(Ring->Fd, IORING_REGISTER_PBUF_RING, &Reg, 1) == -1){
+		LOG_ERR("Failed to register buffer ring: (%d) %s", errno, strerrordesc_np(errno));
+		IOBufferRingExit(BufferRing);
+		return false;
+	}
+
+	for(int BufferID = 0; BufferID < NumBuffers; BufferID += 1){
+		IOBufferRingRecycle(BufferRing, BufferID);
+	}
+
+	return true;
+}
+
+void IOBufferRingExit(TIOBufferRing *BufferRing){
+	// NOTE(fusion): The buffer ring is unregistered automatically when the
+	// ring is closed, so we only need to release memory here.
+	if(BufferRing->Ring != NULL){
+		munmap(BufferRing->Ring, BufferRing->RingSize);
+		BufferRing->Ring = NULL;
+	}
+
+	if(BufferRing->Memory != NULL){
+		free(BufferRing->Memory);
+		BufferRing->Memory = NULL;
+	}
+}
+
+uint8 *IOBufferRingGet(TIOBufferRing *BufferRing, int BufferID){
+	ASSERT(BufferID >= 0 && BufferID < BufferRing->NumBuffers);
+	return BufferRing->Memory + (size_t)BufferID * BufferRing->BufferSize;
+}
+
+void IOBufferRingRecycle(TIOBufferRing *BufferRing, int BufferID){
+	ASSERT(BufferID >= 0 && BufferID < BufferRing->NumBuffers);
+	// IMPORTANT(fusion): We can't use `io_uring_buf_ring::bufs` because the
+	// flexible array wrapper from the kernel headers has an empty struct that
+	// takes one byte in C++, shifting the whole array. The ring is just an array
+	// of `io_uring_buf` with the tail overlaid on the first entry's `resv`.
+	io_uring_buf *Bufs = (io_uring_buf*)BufferRing->Ring;
+	io_uring_buf *Buf = &Bufs[BufferRing->Tail & (BufferRing->NumBuffers - 1)];
+	Buf->addr = (uint64)(uintptr_t)IOBufferRingGet(BufferRing, BufferID);
+	Buf->len = (uint32)BufferRing->BufferSize;
+	Buf->bid = (uint16)BufferID;
+	BufferRing->Tail += 1;
+	__atomic_store_n(&Bufs[0].resv, BufferRing->Tail, __ATOMIC_RELEASE);
+}
@@ -0,0 +1,60 @@
+#!/bin/bash
+# Runs logins through the stand-in query manager with batched logins answered,
+# unknown, and dropping the connection, and checks that logins come out the same
+# in every case. The first two make sure batches are only sent when the probe
+# succeeds. The last one makes sure a query manager that drops the connection
+# on the probe gets reconnected to without it.
+#
+# Usage: tools/batchtest.sh (after `make && make tools`)
+# Environment: PORT (default 17371), QMPORT (default 17373), WORKERS (default 2)
+
+set -u
+PORT=${PORT:-17371}
+QMPORT=${QMPORT:-17373}
+WORKERS=${WORKERS:-2}
+source "$(dirname "$0")/lib.sh"
+
+EXPECTED='login: 399 ok, 1 rejected, 0 error, 0 empty, 0 mismatch'
+
+# run_logins LABEL FAKEQM_OPTIONS...
+# Sets Probes and Batches from the query manager's log.
+# NOTE(fusion): Logins are only batched when they queue up behind a full
+# pipeline, so there's a single query manager connection with a short pipeline,
+# and the query manager answers with a delay.
+run_logins(){
+	local Label=$1
+	shift
+
+	start_fakeqm -d 5 "$@"
+	start_login "Workers = $WORKERS" "QueryManagerConnections = 1" \
+		"QueryManagerPipelineDepth = 1" "QueryManagerBatchSize = 16"
+	client -a 1 -n 400 -c 32 login > "$WORKDIR/client.out"
+	stop_login
+	stop_fakeqm
+
+	# NOTE(fusion): Probes are empty batches, or unknown query 240 when the
+	# query manager doesn't answer batches.
+	Probes=$(grep -c -e "^batch 0$" -e "^unknown query 240$" "$WORKDIR/fakeqm.log")
+	Batches=$(grep -c "^batch [1-9]" "$WORKDIR/fakeqm.log")
+	echo "$Label: $(cat "$WORKDIR/client.out"), $Probes probes, $Batches batches"
+	[ "$(cat "$WORKDIR/client.out")" = "$EXPECTED" ] || fail "unexpected $Label results"
+}
+
+check_binaries
+
+run_logins "batched" -b
+[ "$Probes" -eq "$WORKERS" ] || fail "expected one probe per worker"
+[ "$Batches" -gt 0 ] || fail "no batches were sent"
+
+run_logins "unbatched"
+[ "$Probes" -eq "$WORKERS" ] || fail "expected one probe per worker"
+[ "$Batches" -eq 0 ] || fail "batches were sent without a successful probe"
+
+# NOTE(fusion): Each worker's first connection is made on startup, where the
+# dropped probe makes `Connect` retry without it.
+run_logins "dropped probe" -x
+[ "$Probes" -eq "$WORKERS" ] || fail "expected one probe per worker"
+[ "$Batches" -eq 0 ] || fail "batches were sent after a dropped probe"
+grep -q "dropped the connection when probing" "$WORKDIR/login.log" \
+	|| fail "dropped probe wasn't noticed"
+echo "PASS"
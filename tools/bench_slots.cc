@@ -0,0 +1,145 @@
+// Measures the cost of scanning connection state, the way timeout and drain
+// checks walk the connection table, with the hot and cold parts of each
+// connection either interleaved in a single array (the layout before they were
+// split) or kept in parallel arrays (the current layout).
+//
+// Usage: bench_slots [SLOTS...] (default 10000 100000)
+#include "../src/common.hh"
+
+#include <inttypes.h>
+
+// NOTE(fusion): Same data as a connection slot, but interleaved, which is how
+// the hot fields used to sit next to the buffer, keys, and address.
+struct TCombinedSlot {
+	TConnection Hot;
+	TConnectionData Cold;
+};
+
+static int64 GetTimeNS(void){
+	timespec Time;
+	clock_gettime(CLOCK_MONOTONIC, &Time);
+	return (int64)Time.tv_sec * 1000000000 + (int64)Time.tv_nsec;
+}
+
+static void *AllocSlots(int64 Size){
+	Size = (Size + 63) & ~(int64)63;
+	void *Memory = aligned_alloc(64, (size_t)Size);
+	if(Memory == NULL){
+		fprintf(stderr, "failed to allocate %" PRId64 " bytes\n", Size);
+		exit(EXIT_FAILURE);
+	}
+
+	// NOTE(fusion): Touch every page up front so page faults don't end up in
+	// the first scan.
+	memset(Memory, 0, (size_t)Size);
+	return Memory;
+}
+
+// NOTE(fusion): About half the slots are in use, with start times spread so
+// that some of them are past the timeout. The scans are branchless so that
+// mispredictions on this random pattern don't hide the memory cost.
+static void FillSlot(TConnection *Connection, int Index){
+	uint32 Hash = (uint32)Index * 2654435761U;
+	Connection->State = ((Hash >> 16) & 1) ? CONNECTION_READING : CONNECTION_FREE;
+	Connection->StartTime = (int64)((Hash >> 8) % 10000);
+}
+
+static int ScanSplit(TConnection *Connections, int NumSlots, int64 Now, int64 Timeout){
+	int Expired = 0;
+	for(int i = 0; i < NumSlots; i += 1){
+		Expired += (int)(Connections[i].State != CONNECTION_FREE)
+				& (int)((Now - Connections[i].StartTime) >= Timeout);
+	}
+	return Expired;
+}
+
+static int ScanCombined(TCombinedSlot *Slots, int NumSlots, int64 Now, int64 Timeout){
+	int Expired = 0;
+	for(int i = 0; i < NumSlots; i += 1){
+		Expired += (int)(Slots[i].Hot.State != CONNECTION_FREE)
+				& (int)((Now - Slots[i].Hot.StartTime) >= Timeout);
+	}
+	return Expired;
+}
+
+// NOTE(fusion): Scans are repeated until they add up to at least 20ms, and the
+// best average over a few rounds is reported, to filter out noise. The current
+// time changes between scans so they can't be folded together.
+template<typename T, typename F>
+static double MeasureScan(T *Slots, int NumSlots, F Scan){
+	volatile int Sink = 0;
+	int Repeat = 1;
+	while(true){
+		int64 Start = GetTimeNS();
+		for(int i = 0; i < Repeat; i += 1){
+			Sink += Scan(Slots, NumSlots, 10000 + i, 5000);
+		}
+		int64 Elapsed = GetTimeNS() - Start;
+		if(Elapsed >= 20000000 || Repeat >= (1 << 20)){
+			break;
+		}
+		Repeat *= 2;
+	}
+
+	double Best = 0.0;
+	for(int Round = 0; Round < 10; Round += 1){
+		int64 Start = GetTimeNS();
+		for(int i = 0; i < Repeat; i += 1){
+			Sink += Scan(Slots, NumSlots, 10000 + i, 5000);
+		}
+		double NSPerSlot = (double)(GetTimeNS() - Start) / ((double)Repeat * NumSlots);
+		if(Round == 0 || NSPerSlot < Best){
+			Best = NSPerSlot;
+		}
+	}
+	return Best;
+}
+
+static void RunBenchmark(int NumSlots){
+	TConnection *Connections = (TConnection*)AllocSlots((int64)NumSlots * sizeof(TConnection));
+	TConnectionData *Data = (TConnectionData*)AllocSlots((int64)NumSlots * sizeof(TConnectionData));
+	TCombinedSlot *Combined = (TCombinedSlot*)AllocSlots((int64)NumSlots * sizeof(TCombinedSlot));
+	for(int i = 0; i < NumSlots; i += 1){
+		Connections[i].Data = &Data[i];
+		FillSlot(&Connections[i], i);
+		FillSlot(&Combined[i].Hot, i);
+		Combined[i].Hot.Data = &Combined[i].Cold;
+	}
+
+	int SplitExpired = ScanSplit(Connections, NumSlots, 10000, 5000);
+	int CombinedExpired = ScanCombined(Combined, NumSlots, 10000, 5000);
+	if(SplitExpired != CombinedExpired){
+		fprintf(stderr, "scan results differ (%d vs %d)\n", SplitExpired, CombinedExpired);
+		exit(EXIT_FAILURE);
+	}
+
+	double SplitNS = MeasureScan(Connections, NumSlots, ScanSplit);
+	double CombinedNS = MeasureScan(Combined, NumSlots, ScanCombined);
+	printf("%8d  %-8s  %10d  %12.1f  %8.2f  %10.1f\n", NumSlots, "combined",
+			(int)sizeof(TCombinedSlot), (double)NumSlots * sizeof(TCombinedSlot) / KB(1),
+			CombinedNS, CombinedNS * NumSlots / 1000.0);
+	printf("%8d  %-8s  %10d  %12.1f  %8.2f  %10.1f\n", NumSlots, "split",
+			(int)sizeof(TConnection), (double)NumSlots * sizeof(TConnection) / KB(1),
+			SplitNS, SplitNS * NumSlots / 1000.0);
+
+	free(Connections);
+	free(Data);
+	free(Combined);
+}
+
+int main(int argc, char **argv){
+	printf("%8s  %-8s  %10s  %12s  %8s  %10s\n",
+			"slots", "layout", "bytes/slot", "table KB", "ns/slot", "us/scan");
+	if(argc > 1){
+		for(int i = 1; i < argc; i += 1){
+			int NumSlots = atoi(argv[i]);
+			if(NumSlots > 0){
+				RunBenchmark(NumSlots);
+			}
+		}
+	}else{
+		RunBenchmark(10000);
+		RunBenchmark(100000);
+	}
+	return EXIT_SUCCESS;
+}
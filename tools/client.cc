@@ -0,0 +1,546 @@
+// Test client and load generator for the login server, used by the scripts in
+// this directory. It speaks the same protocol as the game client and checks
+// every reply against what `fakeqm` answers, so it can tell a correct login
+// apart from an error, a mismatched reply, or a connection closed without a
+// reply.
+//
+// Usage: client [OPTIONS] login|status|connect
+//	-h	server address (default 127.0.0.1)
+//	-p	server port (default 7171)
+//	-n	number of exchanges (default 1), each login with its own account
+//	-d	run for this many seconds instead, reporting rate and latency
+//	-c	number of exchanges in flight at once (default 1)
+//	-i	connections opened at start that never send anything
+//	-f	send requests with TCP Fast Open
+//	-a	first account number (default 10)
+//	-t	terminal version (default 770)
+//	-k	private key file, whose public half encrypts logins (default tibia.pem)
+//	-v	print every reply
+//
+// The `connect` mode just connects and closes, to measure accepts alone. It
+// prints a summary line and exits with success only if every exchange got the
+// expected reply. For status, the players element of the first valid reply is
+// also printed, which is stable for the same world. Timed runs also print how
+// many sockets to or from the server port are left in TIME_WAIT, on each side.
+#include "../src/common.hh"
+
+#include <errno.h>
+#include <poll.h>
+#include <pthread.h>
+#include <unistd.h>
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <sys/socket.h>
+
+#include <openssl/pem.h>
+#include <openssl/rsa.h>
+
+enum : int {
+	MODE_LOGIN = 0,
+	MODE_STATUS,
+	MODE_CONNECT,
+};
+
+static const char *MODE_NAMES[] = {
+	"login",
+	"status",
+	"connect",
+};
+
+enum : int {
+	RESULT_OK = 0,
+	RESULT_REJECTED,
+	RESULT_ERROR,
+	RESULT_EMPTY,
+	RESULT_MISMATCH,
+	RESULT_COUNT,
+};
+
+static const char *RESULT_NAMES[RESULT_COUNT] = {
+	"ok",
+	"rejected",
+	"error",
+	"empty",
+	"mismatch",
+};
+
+// NOTE(fusion): Latencies are kept in a histogram with 100us buckets, up to
+// the receive timeout, which is plenty for percentiles.
+static const int LATENCY_BUCKET_US = 100;
+static const int LATENCY_BUCKETS = 100000;
+
+static const char *g_Host = "127.0.0.1";
+static int g_Port = 7171;
+static int g_Mode = MODE_LOGIN;
+static int g_Count = 1;
+static int g_Duration = 0;
+static int g_Concurrency = 1;
+static int g_Idle = 0;
+static bool g_FastOpen = false;
+static int g_FirstAccount = 10;
+static int g_TerminalVersion = 770;
+static bool g_Verbose = false;
+static RSA *g_Key = NULL;
+static int64 g_EndTime = 0;
+
+static pthread_mutex_t g_Mutex = PTHREAD_MUTEX_INITIALIZER;
+static int g_NextIndex = 0;
+static int g_Results[RESULT_COUNT];
+static int64 *g_Latencies = NULL;
+static char g_Players[256];
+
+static int64 GetTimeUS(void){
+	timespec Time;
+	clock_gettime(CLOCK_MONOTONIC, &Time);
+	return (int64)Time.tv_sec * 1000000 + (int64)Time.tv_nsec / 1000;
+}
+
+// NOTE(fusion): Same as the one in `crypto.cc`, which can't be linked in
+// without pulling the rest of the server with it.
+void XTEADecrypt(const uint32 *Key, uint8 *Data, int Size){
+	while(Size >= 8){
+		uint32 Sum = 0xC6EF3720UL;
+		uint32 Delta = 0x9E3779B9UL;
+		uint32 V0 = BufferRead32LE(&Data[0]);
+		uint32 V1 = BufferRead32LE(&Data[4]);
+		for(int i = 0; i < 32; i += 1){
+			V1 -= (((V0 << 4) ^ (V0 >> 5)) + V0) ^ (Sum + Key[(Sum >> 11) & 3]);
+			Sum -= Delta;
+			V0 -= (((V1 << 4) ^ (V1 >> 5)) + V1) ^ (Sum + Key[Sum & 3]);
+		}
+		BufferWrite32LE(&Data[0], V0);
+		BufferWrite32LE(&Data[4], V1);
+		Data += 8;
+		Size -= 8;
+	}
+}
+
+static void ReadString(TReadBuffer *ReadBuffer, char *Dest, int DestCapacity){
+	int Length = (int)ReadBuffer->Read16();
+	int Written = 0;
+	if(ReadBuffer->CanRead(Length) && Length < DestCapacity){
+		memcpy(Dest, ReadBuffer->Buffer + ReadBuffer->Position, Length);
+		Written = Length;
+	}
+	Dest[Written] = 0;
+	ReadBuffer->Position += Length;
+}
+
+// NOTE(fusion): Connects and sends the request, if any. With Fast Open, the
+// request goes out with the SYN when the server has given us a cookie.
+static int ConnectServer(const uint8 *Request, int RequestSize){
+	int Socket = socket(AF_INET, SOCK_STREAM, 0);
+	if(Socket == -1){
+		return -1;
+	}
+
+	timeval Timeout = {};
+	Timeout.tv_sec = 10;
+	setsockopt(Socket, SOL_SOCKET, SO_RCVTIMEO, &Timeout, sizeof(Timeout));
+	setsockopt(Socket, SOL_SOCKET, SO_SNDTIMEO, &Timeout, sizeof(Timeout));
+
+	sockaddr_in Addr = {};
+	Addr.sin_family = AF_INET;
+	Addr.sin_port = htons((uint16)g_Port);
+	if(inet_pton(AF_INET, g_Host, &Addr.sin_addr) != 1){
+		close(Socket);
+		return -1;
+	}
+
+	int Sent = 0;
+	if(g_FastOpen && RequestSize > 0){
+		Sent = (int)sendto(Socket, Request, RequestSize,
+				MSG_FASTOPEN | MSG_NOSIGNAL, (sockaddr*)&Addr, sizeof(Addr));
+	}else if(connect(Socket, (sockaddr*)&Addr, sizeof(Addr)) == 0){
+		Sent = (RequestSize > 0) ? (int)send(Socket, Request, RequestSize, MSG_NOSIGNAL) : 0;
+	}else{
+		Sent = -1;
+	}
+
+	if(Sent != RequestSize){
+		close(Socket);
+		return -1;
+	}
+
+	return Socket;
+}
+
+// NOTE(fusion): Reads until the server closes the connection, the buffer is
+// full, or a 2-byte length prefixed reply is complete (if `Framed`). Returns
+// the number of bytes read.
+static int ReadReply(int Socket, uint8 *Buffer, int Size, bool Framed){
+	int Position = 0;
+	while(Position < Size){
+		if(Framed && Position >= 2 && Position >= (2 + (int)BufferRead16LE(Buffer))){
+			break;
+		}
+
+		int Ret = (int)read(Socket, Buffer + Position, Size - Position);
+		if(Ret <= 0){
+			if(Ret == -1 && errno == EINTR){
+				continue;
+			}
+			break;
+		}
+		Position += Ret;
+	}
+	return Position;
+}
+
+static int DoLogin(int AccountID, unsigned int *Seed){
+	uint32 XTEA[4];
+	for(int i = 0; i < 4; i += 1){
+		XTEA[i] = ((uint32)rand_r(Seed) << 16) ^ (uint32)rand_r(Seed);
+	}
+
+	uint8 Plaintext[128] = {};
+	TWriteBuffer Asymmetric(Plaintext, sizeof(Plaintext));
+	Asymmetric.Write8(0);
+	for(int i = 0; i < 4; i += 1){
+		Asymmetric.Write32(XTEA[i]);
+	}
+	Asymmetric.Write32((uint32)AccountID);
+	Asymmetric.Write16(4);
+	memcpy(Plaintext + Asymmetric.Position, "test", 4);
+
+	uint8 Request[2 + 145];
+	TWriteBuffer WriteBuffer(Request, sizeof(Request));
+	WriteBuffer.Write16(145);
+	WriteBuffer.Write8(1);		// login request
+	WriteBuffer.Write16(0);		// terminal type
+	WriteBuffer.Write16((uint16)g_TerminalVersion);
+	WriteBuffer.Write32(0);		// DATSIGNATURE
+	WriteBuffer.Write32(0);		// SPRSIGNATURE
+	WriteBuffer.Write32(0);		// PICSIGNATURE
+	if(RSA_public_encrypt(sizeof(Plaintext), Plaintext,
+			Request + WriteBuffer.Position, g_Key, RSA_NO_PADDING) != 128){
+		return RESULT_ERROR;
+	}
+
+	int Socket = ConnectServer(Request, sizeof(Request));
+	if(Socket == -1){
+		return RESULT_EMPTY;
+	}
+
+	uint8 Reply[KB(4)];
+	int ReplySize = ReadReply(Socket, Reply, sizeof(Reply), true);
+	close(Socket);
+
+	int EncryptedSize = (ReplySize >= 2) ? (int)BufferRead16LE(Reply) : 0;
+	if(EncryptedSize == 0 || (EncryptedSize % 8) != 0 || (2 + EncryptedSize) > ReplySize){
+		if(g_Verbose){
+			printf("%d: empty (%d bytes)\n", AccountID, ReplySize);
+		}
+		return RESULT_EMPTY;
+	}
+
+	XTEADecrypt(XTEA, Reply + 2, EncryptedSize);
+	TReadBuffer ReadBuffer(Reply + 4, (int)BufferRead16LE(Reply + 2));
+	if(ReadBuffer.Size > (EncryptedSize - 2)){
+		return RESULT_MISMATCH;
+	}
+
+	char Expected[32], String[256];
+	snprintf(Expected, sizeof(Expected), "Char%d", AccountID);
+	int Result = RESULT_MISMATCH;
+	while(ReadBuffer.CanRead(1)){
+		int Opcode = ReadBuffer.Read8();
+		if(Opcode == 20){ // MOTD
+			ReadString(&ReadBuffer, String, sizeof(String));
+		}else if(Opcode == 10){ // LOGIN_ERROR
+			ReadString(&ReadBuffer, String, sizeof(String));
+			Result = (AccountID == 2) ? RESULT_REJECTED : RESULT_ERROR;
+			if(g_Verbose){
+				printf("%d: error \"%s\"\n", AccountID, String);
+			}
+			break;
+		}else if(Opcode == 100){ // CHARACTER_LIST
+			int NumCharacters = ReadBuffer.Read8();
+			ReadString(&ReadBuffer, String, sizeof(String));
+			if(NumCharacters == 1 && strcmp(String, Expected) == 0){
+				Result = RESULT_OK;
+			}
+			if(g_Verbose){
+				printf("%d: %d characters, first \"%s\"\n", AccountID, NumCharacters, String);
+			}
+			break;
+		}else{
+			break;
+		}
+	}
+
+	return Result;
+}
+
+static int DoStatus(void){
+	const uint8 Request[] = {0x06, 0x00, 0xFF, 0xFF, 'i', 'n', 'f', 'o'};
+	int Socket = ConnectServer(Request, sizeof(Request));
+	if(Socket == -1){
+		return RESULT_EMPTY;
+	}
+
+	char Reply[KB(4)];
+	int ReplySize = ReadReply(Socket, (uint8*)Reply, sizeof(Reply) - 1, false);
+	close(Socket);
+	Reply[ReplySize] = 0;
+
+	if(g_Verbose){
+		printf("%s\n", Reply);
+	}
+
+	const char *Players = strstr(Reply, "<players ");
+	const char *PlayersEnd = (Players != NULL) ? strstr(Players, "/>") : NULL;
+	if(ReplySize == 0){
+		return RESULT_EMPTY;
+	}else if(strncmp(Reply, "<?xml", 5) != 0 || PlayersEnd == NULL){
+		return RESULT_MISMATCH;
+	}
+
+	pthread_mutex_lock(&g_Mutex);
+	if(g_Players[0] == 0){
+		snprintf(g_Players, sizeof(g_Players), "%.*s",
+				(int)(PlayersEnd + 2 - Players), Players);
+	}
+	pthread_mutex_unlock(&g_Mutex);
+	return RESULT_OK;
+}
+
+static int DoConnect(void){
+	int Socket = ConnectServer(NULL, 0);
+	if(Socket == -1){
+		return RESULT_EMPTY;
+	}
+	close(Socket);
+	return RESULT_OK;
+}
+
+static void *ExchangeThread(void *Data){
+	unsigned int Seed = (unsigned int)(uintptr_t)Data ^ (unsigned int)time(NULL);
+	while(true){
+		pthread_mutex_lock(&g_Mutex);
+		int Index = g_NextIndex;
+		g_NextIndex += 1;
+		pthread_mutex_unlock(&g_Mutex);
+		if(g_Duration > 0 ? (GetTimeUS() >= g_EndTime) : (Index >= g_Count)){
+			break;
+		}
+
+		int64 Start = GetTimeUS();
+		int Result = RESULT_ERROR;
+		switch(g_Mode){
+			case MODE_LOGIN:	Result = DoLogin(g_FirstAccount + Index, &Seed); break;
+			case MODE_STATUS:	Result = DoStatus(); break;
+			case MODE_CONNECT:	Result = DoConnect(); break;
+		}
+
+		int Bucket = (int)((GetTimeUS() - Start) / LATENCY_BUCKET_US);
+		if(Bucket >= LATENCY_BUCKETS){
+			Bucket = LATENCY_BUCKETS - 1;
+		}
+
+		pthread_mutex_lock(&g_Mutex);
+		g_Results[Result] += 1;
+		g_Latencies[Bucket] += 1;
+		pthread_mutex_unlock(&g_Mutex);
+	}
+	return NULL;
+}
+
+static double LatencyPercentile(int64 Total, double Percentile){
+	int64 Target = (int64)(Total * Percentile);
+	int64 Seen = 0;
+	for(int i = 0; i < LATENCY_BUCKETS; i += 1){
+		Seen += g_Latencies[i];
+		if(Seen > Target){
+			return (double)((i + 1) * LATENCY_BUCKET_US) / 1000.0;
+		}
+	}
+	return (double)(LATENCY_BUCKETS * LATENCY_BUCKET_US) / 1000.0;
+}
+
+// NOTE(fusion): Idle connections never send anything. A server that accepts
+// them right away will hold a slot for each until its header timeout closes
+// them, which is visible here as connections closed by the server.
+static int *OpenIdleConnections(void){
+	int *Sockets = (int*)calloc(g_Idle > 0 ? g_Idle : 1, sizeof(int));
+	for(int i = 0; i < g_Idle; i += 1){
+		Sockets[i] = ConnectServer(NULL, 0);
+	}
+	return Sockets;
+}
+
+static void CloseIdleConnections(int *Sockets){
+	int Opened = 0, Closed = 0;
+	for(int i = 0; i < g_Idle; i += 1){
+		if(Sockets[i] == -1){
+			continue;
+		}
+
+		Opened += 1;
+		pollfd Poll = {};
+		Poll.fd = Sockets[i];
+		Poll.events = POLLIN | POLLRDHUP;
+		if(poll(&Poll, 1, 0) > 0){
+			Closed += 1;
+		}
+		close(Sockets[i]);
+	}
+
+	if(g_Idle > 0){
+		printf("idle: %d of %d opened, %d closed by the server\n", Opened, g_Idle, Closed);
+	}
+	free(Sockets);
+}
+
+// NOTE(fusion): Counts TIME_WAIT sockets on the server port from
+// /proc/net/tcp, split by which side closed first. The server side has the
+// port as its local port, the client side as its remote port.
+static void CountTimeWait(int *OutServer, int *OutClient){
+	*OutServer = 0;
+	*OutClient = 0;
+	FILE *File = fopen("/proc/net/tcp", "r");
+	if(File == NULL){
+		return;
+	}
+
+	char Line[256];
+	while(fgets(Line, sizeof(Line), File) != NULL){
+		unsigned int LocalPort, RemotePort, State;
+		if(sscanf(Line, " %*d: %*x:%x %*x:%x %x", &LocalPort, &RemotePort, &State) != 3
+				|| State != 0x06){ // TCP_TIME_WAIT
+			continue;
+		}
+
+		if((int)LocalPort == g_Port){
+			*OutServer += 1;
+		}else if((int)RemotePort == g_Port){
+			*OutClient += 1;
+		}
+	}
+	fclose(File);
+}
+
+static bool RunExchanges(void){
+	g_Latencies = (int64*)calloc(LATENCY_BUCKETS, sizeof(int64));
+	int *IdleSockets = OpenIdleConnections();
+
+	int NumThreads = g_Concurrency;
+	if(g_Duration == 0 && NumThreads > g_Count){
+		NumThreads = g_Count;
+	}
+
+	int64 StartTime = GetTimeUS();
+	g_EndTime = StartTime + (int64)g_Duration * 1000000;
+	pthread_t *Threads = (pthread_t*)calloc(NumThreads, sizeof(pthread_t));
+	for(int i = 0; i < NumThreads; i += 1){
+		if(pthread_create(&Threads[i], NULL, ExchangeThread, (void*)(uintptr_t)i) != 0){
+			fprintf(stderr, "failed to create exchange thread\n");
+			exit(EXIT_FAILURE);
+		}
+	}
+
+	for(int i = 0; i < NumThreads; i += 1){
+		pthread_join(Threads[i], NULL);
+	}
+	free(Threads);
+	double Elapsed = (double)(GetTimeUS() - StartTime) / 1000000.0;
+
+	CloseIdleConnections(IdleSockets);
+
+	int Total = 0;
+	for(int i = 0; i < RESULT_COUNT; i += 1){
+		Total += g_Results[i];
+	}
+
+	if(g_Mode == MODE_STATUS && g_Players[0] != 0){
+		printf("status: %s\n", g_Players);
+	}
+
+	printf("%s:", MODE_NAMES[g_Mode]);
+	for(int i = 0; i < RESULT_COUNT; i += 1){
+		printf(" %d %s%s", g_Results[i], RESULT_NAMES[i],
+				(i + 1) < RESULT_COUNT ? "," : "\n");
+	}
+
+	if(g_Duration > 0){
+		printf("rate: %d in %.1fs, %.0f/s, latency p50 %.1fms, p99 %.1fms\n",
+				Total, Elapsed, (double)Total / Elapsed,
+				LatencyPercentile(Total, 0.50), LatencyPercentile(Total, 0.99));
+
+		int ServerTimeWait, ClientTimeWait;
+		CountTimeWait(&ServerTimeWait, &ClientTimeWait);
+		printf("time-wait: %d server side, %d client side\n", ServerTimeWait, ClientTimeWait);
+	}
+
+	free(g_Latencies);
+	return Total > 0 && (g_Results[RESULT_OK] + g_Results[RESULT_REJECTED]) == Total;
+}
+
+int main(int argc, char **argv){
+	const char *KeyFile = "tibia.pem";
+	const char *Mode = NULL;
+	for(int i = 1; i < argc; i += 1){
+		if(strcmp(argv[i], "-h") == 0 && (i + 1) < argc){
+			g_Host = argv[++i];
+		}else if(strcmp(argv[i], "-p") == 0 && (i + 1) < argc){
+			g_Port = atoi(argv[++i]);
+		}else if(strcmp(argv[i], "-n") == 0 && (i + 1) < argc){
+			g_Count = atoi(argv[++i]);
+		}else if(strcmp(argv[i], "-d") == 0 && (i + 1) < argc){
+			g_Duration = atoi(argv[++i]);
+		}else if(strcmp(argv[i], "-c") == 0 && (i + 1) < argc){
+			g_Concurrency = atoi(argv[++i]);
+		}else if(strcmp(argv[i], "-i") == 0 && (i + 1) < argc){
+			g_Idle = atoi(argv[++i]);
+		}else if(strcmp(argv[i], "-f") == 0){
+			g_FastOpen = true;
+		}else if(strcmp(argv[i], "-a") == 0 && (i + 1) < argc){
+			g_FirstAccount = atoi(argv[++i]);
+		}else if(strcmp(argv[i], "-t") == 0 && (i + 1) < argc){
+			g_TerminalVersion = atoi(argv[++i]);
+		}else if(strcmp(argv[i], "-k") == 0 && (i + 1) < argc){
+			KeyFile = argv[++i];
+		}else if(strcmp(argv[i], "-v") == 0){
+			g_Verbose = true;
+		}else if(Mode == NULL && argv[i][0] != '-'){
+			Mode = argv[i];
+		}else{
+			Mode = NULL;
+			break;
+		}
+	}
+
+	g_Mode = -1;
+	for(int i = 0; Mode != NULL && i < NARRAY(MODE_NAMES); i += 1){
+		if(strcmp(Mode, MODE_NAMES[i]) == 0){
+			g_Mode = i;
+		}
+	}
+
+	if(g_Mode == -1 || g_Count < 1 || g_Duration < 0 || g_Concurrency < 1 || g_Idle < 0){
+		fprintf(stderr, "usage: %s [-h HOST] [-p PORT] [-n COUNT | -d SECONDS]"
+				" [-c CONCURRENCY] [-i IDLE] [-f] [-a ACCOUNT] [-t VERSION]"
+				" [-k KEYFILE] [-v] login|status|connect\n", argv[0]);
+		return EXIT_FAILURE;
+	}
+
+	if(g_Mode == MODE_LOGIN){
+		FILE *File = fopen(KeyFile, "rb");
+		if(File != NULL){
+			g_Key = PEM_read_RSAPrivateKey(File, NULL, NULL, NULL);
+			fclose(File);
+		}
+
+		if(g_Key == NULL){
+			fprintf(stderr, "failed to load key from \"%s\"\n", KeyFile);
+			return EXIT_FAILURE;
+		}
+	}
+
+	bool Result = RunExchanges();
+	if(g_Key != NULL){
+		RSA_free(g_Key);
+	}
+	return Result ? EXIT_SUCCESS : EXIT_FAILURE;
+}
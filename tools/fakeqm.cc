@@ -0,0 +1,294 @@
+// Minimal stand-in for the query manager, used by the scripts in this
+// directory. It only answers the queries the login server makes: the login
+// handshake, account logins (batched or not), and the world list. Account N
+// logs in with a single character named "CharN", except for account 2 which
+// always fails with an invalid password.
+//
+// Usage: fakeqm [-p PORT | -u PATH] [-d DELAY_MS] [-b] [-x]
+//	-p	TCP port on 127.0.0.1 (default 7173)
+//	-u	unix socket path, used instead of the TCP port
+//	-d	delay before answering each query
+//	-b	answer batched login queries (otherwise they're unknown)
+//	-x	drop the connection on unknown queries instead of answering FAILED
+#include "../src/common.hh"
+
+#include <errno.h>
+#include <pthread.h>
+#include <signal.h>
+#include <unistd.h>
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+
+static int g_Delay = 0;
+static bool g_Batch = false;
+static bool g_DropUnknown = false;
+
+static bool ReadExact(int Socket, uint8 *Buffer, int Size){
+	int Position = 0;
+	while(Position < Size){
+		int Ret = (int)read(Socket, Buffer + Position, Size - Position);
+		if(Ret <= 0){
+			if(Ret == -1 && errno == EINTR){
+				continue;
+			}
+			return false;
+		}
+		Position += Ret;
+	}
+	return true;
+}
+
+static bool WriteExact(int Socket, const uint8 *Buffer, int Size){
+	int Position = 0;
+	while(Position < Size){
+		int Ret = (int)send(Socket, Buffer + Position, Size - Position, MSG_NOSIGNAL);
+		if(Ret <= 0){
+			if(Ret == -1 && errno == EINTR){
+				continue;
+			}
+			return false;
+		}
+		Position += Ret;
+	}
+	return true;
+}
+
+static void WriteString(TWriteBuffer *WriteBuffer, const char *String){
+	int Length = (int)strlen(String);
+	WriteBuffer->Write16((uint16)Length);
+	if(WriteBuffer->CanWrite(Length)){
+		memcpy(WriteBuffer->Buffer + WriteBuffer->Position, String, Length);
+	}
+	WriteBuffer->Position += Length;
+}
+
+static void SkipString(TReadBuffer *ReadBuffer){
+	int Length = (int)ReadBuffer->Read16();
+	if(Length == 0xFFFF){
+		Length = (int)ReadBuffer->Read32();
+	}
+	ReadBuffer->Position += Length;
+}
+
+static void WriteLoginResult(TWriteBuffer *WriteBuffer, int AccountID){
+	if(AccountID == 2){
+		WriteBuffer->Write8(QUERY_STATUS_ERROR);
+		WriteBuffer->Write8(2); // invalid password
+		return;
+	}
+
+	char Name[32];
+	snprintf(Name, sizeof(Name), "Char%d", AccountID);
+	WriteBuffer->Write8(QUERY_STATUS_OK);
+	WriteBuffer->Write8(1);
+	WriteString(WriteBuffer, Name);
+	WriteString(WriteBuffer, "World");
+	WriteBuffer->Write32BE(0x7F000001);
+	WriteBuffer->Write16(7172);
+	WriteBuffer->Write16(5); // premium days
+}
+
+static void WriteBatchResult(TReadBuffer *Request, TWriteBuffer *Response){
+	int NumLogins = Request->Read8();
+	printf("batch %d\n", NumLogins);
+	Response->Write8(QUERY_STATUS_OK);
+	Response->Write8(NumLogins);
+	for(int i = 0; i < NumLogins; i += 1){
+		int AccountID = (int)Request->Read32();
+		SkipString(Request); // password
+		SkipString(Request); // ip address
+
+		int SizePosition = Response->Position;
+		Response->Write16(0);
+		WriteLoginResult(Response, AccountID);
+		Response->Rewrite16(SizePosition,
+				(uint16)(Response->Position - SizePosition - 2));
+	}
+}
+
+// NOTE(fusion): Returns false if the connection should be dropped.
+static bool HandleQuery(TReadBuffer *Request, TWriteBuffer *Response){
+	int QueryType = Request->Read8();
+	switch(QueryType){
+		case QUERY_LOGIN:{
+			Response->Write8(QUERY_STATUS_OK);
+			break;
+		}
+
+		case QUERY_LOGIN_ACCOUNT:{
+			WriteLoginResult(Response, (int)Request->Read32());
+			break;
+		}
+
+		case QUERY_GET_WORLDS:{
+			Response->Write8(QUERY_STATUS_OK);
+			Response->Write8(1);
+			WriteString(Response, "World");
+			Response->Write8(0);	// type
+			Response->Write16(10);	// players
+			Response->Write16(100);	// max players
+			Response->Write16(20);	// online peak
+			Response->Write32(0);	// online peak timestamp
+			Response->Write32((uint32)time(NULL) - 100); // last startup
+			Response->Write32(0);	// last shutdown
+			break;
+		}
+
+		case QUERY_LOGIN_ACCOUNT_BATCH:{
+			if(g_Batch){
+				WriteBatchResult(Request, Response);
+				break;
+			}
+			ATTR_FALLTHROUGH;
+		}
+
+		default:{
+			printf("unknown query %d\n", QueryType);
+			if(g_DropUnknown){
+				return false;
+			}
+			Response->Write8(QUERY_STATUS_FAILED);
+			break;
+		}
+	}
+
+	return true;
+}
+
+static void *ConnectionThread(void *Data){
+	int Socket = (int)(intptr_t)Data;
+	uint8 *Request = (uint8*)malloc(KB(64));
+	uint8 *Response = (uint8*)malloc(KB(64));
+	while(true){
+		uint8 Header[4];
+		if(!ReadExact(Socket, Header, 2)){
+			break;
+		}
+
+		int Size = (int)BufferRead16LE(Header);
+		if(Size == 0xFFFF){
+			if(!ReadExact(Socket, Header, 4)){
+				break;
+			}
+			Size = (int)BufferRead32LE(Header);
+		}
+
+		if(Size <= 0 || Size > KB(64) || !ReadExact(Socket, Request, Size)){
+			break;
+		}
+
+		if(g_Delay > 0){
+			usleep(g_Delay * 1000);
+		}
+
+		TReadBuffer ReadBuffer(Request, Size);
+		TWriteBuffer WriteBuffer(Response, KB(64));
+		WriteBuffer.Write16(0);
+		if(!HandleQuery(&ReadBuffer, &WriteBuffer) || WriteBuffer.Overflowed()){
+			break;
+		}
+
+		WriteBuffer.Rewrite16(0, (uint16)(WriteBuffer.Position - 2));
+		if(!WriteExact(Socket, Response, WriteBuffer.Position)){
+			break;
+		}
+	}
+
+	free(Request);
+	free(Response);
+	close(Socket);
+	return NULL;
+}
+
+static int ListenTCP(int Port){
+	int Socket = socket(AF_INET, SOCK_STREAM, 0);
+	if(Socket == -1){
+		return -1;
+	}
+
+	int ReuseAddr = 1;
+	setsockopt(Socket, SOL_SOCKET, SO_REUSEADDR, &ReuseAddr, sizeof(ReuseAddr));
+
+	sockaddr_in Addr = {};
+	Addr.sin_family = AF_INET;
+	Addr.sin_port = htons((uint16)Port);
+	Addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+	if(bind(Socket, (sockaddr*)&Addr, sizeof(Addr)) == -1 || listen(Socket, 128) == -1){
+		close(Socket);
+		return -1;
+	}
+
+	return Socket;
+}
+
+static int ListenUnix(const char *Path){
+	sockaddr_un Addr = {};
+	if(strlen(Path) >= sizeof(Addr.sun_path)){
+		return -1;
+	}
+
+	int Socket = socket(AF_UNIX, SOCK_STREAM, 0);
+	if(Socket == -1){
+		return -1;
+	}
+
+	unlink(Path);
+	Addr.sun_family = AF_UNIX;
+	strcpy(Addr.sun_path, Path);
+	if(bind(Socket, (sockaddr*)&Addr, sizeof(Addr)) == -1 || listen(Socket, 128) == -1){
+		close(Socket);
+		return -1;
+	}
+
+	return Socket;
+}
+
+int main(int argc, char **argv){
+	int Port = 7173;
+	const char *UnixPath = NULL;
+	for(int i = 1; i < argc; i += 1){
+		if(strcmp(argv[i], "-p") == 0 && (i + 1) < argc){
+			Port = atoi(argv[++i]);
+		}else if(strcmp(argv[i], "-u") == 0 && (i + 1) < argc){
+			UnixPath = argv[++i];
+		}else if(strcmp(argv[i], "-d") == 0 && (i + 1) < argc){
+			g_Delay = atoi(argv[++i]);
+		}else if(strcmp(argv[i], "-b") == 0){
+			g_Batch = true;
+		}else if(strcmp(argv[i], "-x") == 0){
+			g_DropUnknown = true;
+		}else{
+			fprintf(stderr, "usage: %s [-p PORT | -u PATH] [-d DELAY_MS] [-b] [-x]\n", argv[0]);
+			return EXIT_FAILURE;
+		}
+	}
+
+	setvbuf(stdout, NULL, _IOLBF, 0);
+	signal(SIGPIPE, SIG_IGN);
+
+	int Listener = (UnixPath != NULL) ? ListenUnix(UnixPath) : ListenTCP(Port);
+	if(Listener == -1){
+		fprintf(stderr, "failed to listen: (%d) %s\n", errno, strerror(errno));
+		return EXIT_FAILURE;
+	}
+
+	while(true){
+		int Socket = accept(Listener, NULL, NULL);
+		if(Socket == -1){
+			if(errno == EINTR || errno == ECONNABORTED){
+				continue;
+			}
+			fprintf(stderr, "failed to accept: (%d) %s\n", errno, strerror(errno));
+			return EXIT_FAILURE;
+		}
+
+		pthread_t Thread;
+		if(pthread_create(&Thread, NULL, ConnectionThread, (void*)(intptr_t)Socket) != 0){
+			close(Socket);
+			continue;
+		}
+		pthread_detach(Thread);
+	}
+}
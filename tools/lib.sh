@@ -0,0 +1,78 @@
+# Shared helpers for the test scripts in this directory, meant to be sourced.
+# Scripts set PORT and QMPORT before sourcing, and get a scratch WORKDIR that
+# is removed on exit, along with any server still running.
+
+ROOT=$(cd "$(dirname "${BASH_SOURCE[0]}")/.." && pwd)
+BUILD=$ROOT/build
+WORKDIR=$(mktemp -d)
+QMPID=
+LOGINPID=
+
+cleanup(){
+	[ -n "$LOGINPID" ] && kill "$LOGINPID" 2>/dev/null
+	[ -n "$QMPID" ] && kill "$QMPID" 2>/dev/null
+	wait 2>/dev/null
+	rm -rf "$WORKDIR"
+}
+trap cleanup EXIT
+
+fail(){
+	echo "FAIL: $*"
+	[ -f "$WORKDIR/login.log" ] && tail -n 20 "$WORKDIR/login.log"
+	exit 1
+}
+
+check_binaries(){
+	[ -x "$BUILD/login" ] && [ -x "$BUILD/fakeqm" ] && [ -x "$BUILD/client" ] \
+		|| fail "missing binaries, run \`make && make tools\` first"
+}
+
+# start_fakeqm [FAKEQM OPTIONS...]
+start_fakeqm(){
+	"$BUILD/fakeqm" -p "$QMPORT" "$@" > "$WORKDIR/fakeqm.log" 2>&1 &
+	QMPID=$!
+	sleep 0.2
+}
+
+stop_fakeqm(){
+	kill "$QMPID" 2>/dev/null
+	wait "$QMPID" 2>/dev/null
+	QMPID=
+}
+
+# start_login [CONFIG LINES...]
+# NOTE(fusion): Later config lines override earlier ones, so the defaults here
+# can be overridden by the caller.
+start_login(){
+	cp "$ROOT/tibia.pem" "$WORKDIR/"
+	cp "$ROOT/config.cfg.dist" "$WORKDIR/config.cfg"
+	cat >> "$WORKDIR/config.cfg" <<-EOF
+	LoginPort = $PORT
+	MaxConnections = 100
+	QueryManagerPort = $QMPORT
+	StatusWorld = "World"
+	EOF
+	for Line in "$@"; do
+		echo "$Line" >> "$WORKDIR/config.cfg"
+	done
+
+	(cd "$WORKDIR" && exec "$BUILD/login" > login.log 2>&1) &
+	LOGINPID=$!
+	for _ in $(seq 50); do
+		grep -q "Running..." "$WORKDIR/login.log" 2>/dev/null && return 0
+		kill -0 "$LOGINPID" 2>/dev/null || break
+		sleep 0.1
+	done
+	fail "login server didn't start with: $*"
+}
+
+stop_login(){
+	kill "$LOGINPID" 2>/dev/null
+	wait "$LOGINPID" 2>/dev/null
+	LOGINPID=
+}
+
+# client [CLIENT OPTIONS...]
+client(){
+	(cd "$WORKDIR" && "$BUILD/client" -p "$PORT" "$@")
+}
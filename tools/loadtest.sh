@@ -0,0 +1,101 @@
+#!/bin/bash
+# Sustained load against a local login server, with the stand-in query manager,
+# to compare server options. Each scenario starts a fresh server with its own
+# config lines, runs the client load generator for DURATION seconds and prints
+# its results.
+#
+# Usage: tools/loadtest.sh [SUITE...] (after `make && make tools`)
+#	listener	accept throughput with ListenBacklog, DeferAccept, and FastOpen
+#	teardown	TIME_WAIT build-up with each TeardownMode
+# Environment: PORT (default 17271), QMPORT (default 17273), DURATION (default 5),
+# ENGINE (default epoll)
+
+set -u
+PORT=${PORT:-17271}
+QMPORT=${QMPORT:-17273}
+DURATION=${DURATION:-5}
+ENGINE=${ENGINE:-epoll}
+source "$(dirname "$0")/lib.sh"
+
+# scenario LABEL CONFIG_LINES CLIENT_ARGS...
+# NOTE(fusion): Config lines are separated by `;`.
+scenario(){
+	local Label=$1
+	local Config=$2
+	shift 2
+
+	local Lines=()
+	IFS=';' read -ra Lines <<< "$Config"
+	start_login "IOEngine = \"$ENGINE\"" "Workers = 1" "${Lines[@]}"
+	echo "== $Label"
+	client -d "$DURATION" "$@" | sed 's/^/   /'
+	stop_login
+}
+
+# netstat COUNTER
+# NOTE(fusion): Reads a TcpExt counter from /proc/net/netstat.
+netstat(){
+	awk -v Name="$1" '$1 == "TcpExt:" {
+		if(!Header){ for(i = 2; i <= NF; i += 1) Index[$i] = i; Header = 1 }
+		else{ print $Index[Name] + 0 }
+	}' /proc/net/netstat
+}
+
+suite_listener(){
+	scenario "connect/close, ListenBacklog 128" \
+		"ListenBacklog = 128" -c 32 connect
+	scenario "connect/close, ListenBacklog 1024" \
+		"ListenBacklog = 1024" -c 32 connect
+	scenario "login" \
+		"" -c 16 login
+
+	# NOTE(fusion): Idle connections take every slot until the header timeout
+	# closes them, unless the kernel holds them back with TCP_DEFER_ACCEPT.
+	scenario "login with 100 idle connections, DeferAccept 0s" \
+		"DeferAccept = 0s" -c 16 -i 100 login
+	scenario "login with 100 idle connections, DeferAccept 10s" \
+		"DeferAccept = 10s" -c 16 -i 100 login
+
+	# NOTE(fusion): The server side of TCP Fast Open also needs bit 2 of
+	# net.ipv4.tcp_fastopen, otherwise the client silently falls back to a
+	# regular handshake.
+	echo "(net.ipv4.tcp_fastopen = $(cat /proc/sys/net/ipv4/tcp_fastopen))"
+	for FastOpen in 0 64; do
+		local Before=$(netstat TCPFastOpenPassive)
+		scenario "login with client Fast Open, FastOpen $FastOpen" \
+			"FastOpen = $FastOpen" -c 16 -f login
+		echo "   fast open: $(( $(netstat TCPFastOpenPassive) - Before )) accepted with data in the SYN"
+	done
+}
+
+# NOTE(fusion): TIME_WAIT lasts a minute, so each mode gets its own port, past
+# QMPORT, to keep the counts apart. The close counters come from the last stats
+# line.
+suite_teardown(){
+	local BasePort=$PORT
+	local Offset=10
+	for Mode in close shutdown passive; do
+		PORT=$((BasePort + Offset))
+		Offset=$((Offset + 1))
+		start_login "IOEngine = \"$ENGINE\"" "Workers = 1" \
+			"TeardownMode = \"$Mode\"" "StatsInterval = 1s"
+		echo "== login, TeardownMode $Mode"
+		client -d "$DURATION" -c 16 login | sed 's/^/   /'
+		sleep 1.1
+		stop_login
+		grep "Worker 0:" "$WORKDIR/login.log" | tail -n 1 \
+			| grep -o "[0-9]* active close, [0-9]* passive close, [0-9]* reset, [0-9]* drain timed out" \
+			| sed 's/^/   server: /'
+	done
+	PORT=$BasePort
+}
+
+check_binaries
+start_fakeqm
+
+Suites=("$@")
+[ ${#Suites[@]} -eq 0 ] && Suites=(listener)
+for Suite in "${Suites[@]}"; do
+	declare -F "suite_$Suite" > /dev/null || fail "unknown suite \"$Suite\""
+	"suite_$Suite"
+done
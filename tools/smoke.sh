@@ -0,0 +1,54 @@
+#!/bin/bash
+# Runs the same login and status exchange against each IO engine, with more
+# than one worker, and checks that both engines give the same answers and that
+# connections are spread across every worker. It uses the stand-in query
+# manager so it doesn't need a game server or database.
+#
+# Usage: tools/smoke.sh (after `make && make tools`)
+# Environment: PORT (default 17171), QMPORT (default 17173), WORKERS (default 2)
+
+set -u
+PORT=${PORT:-17171}
+QMPORT=${QMPORT:-17173}
+WORKERS=${WORKERS:-2}
+source "$(dirname "$0")/lib.sh"
+
+# NOTE(fusion): SO_REUSEPORT hashes connections over the workers' listeners,
+# so no worker should end up with less than half of its fair share.
+check_distribution(){
+	local Engine=$1
+	local Total=0
+	local Counts=()
+	for ((i = 0; i < WORKERS; i += 1)); do
+		Counts[i]=$(grep -c "assigned to worker $i slot" "$WORKDIR/login.log")
+		Total=$((Total + Counts[i]))
+	done
+
+	echo "$Engine: connections per worker: ${Counts[*]}"
+	for ((i = 0; i < WORKERS; i += 1)); do
+		[ $((Counts[i] * WORKERS * 2)) -ge "$Total" ] \
+			|| fail "worker $i got ${Counts[i]} of $Total connections with IOEngine = \"$Engine\""
+	done
+}
+
+check_binaries
+start_fakeqm
+
+for Engine in epoll io_uring; do
+	start_login "IOEngine = \"$Engine\"" "Workers = $WORKERS"
+
+	# NOTE(fusion): Accounts 1 to 200, where account 2 is always rejected.
+	client -a 1 -n 200 -c 16 login > "$WORKDIR/$Engine.out"
+	client status >> "$WORKDIR/$Engine.out"
+
+	stop_login
+	check_distribution "$Engine"
+	sed "s/^/$Engine: /" "$WORKDIR/$Engine.out"
+done
+
+EXPECTED='login: 199 ok, 1 rejected, 0 error, 0 empty, 0 mismatch
+status: <players online="10" max="100" peak="20"/>
+status: 1 ok, 0 rejected, 0 error, 0 empty, 0 mismatch'
+[ "$(cat "$WORKDIR/epoll.out")" = "$EXPECTED" ] || fail "unexpected epoll results"
+cmp -s "$WORKDIR/epoll.out" "$WORKDIR/io_uring.out" || fail "engines disagree"
+echo "PASS"